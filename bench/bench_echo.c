@@ -0,0 +1,447 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "lthread.h"
+
+/* Loopback TCP echo server under load. Each configuration runs the
+ * server and the load generator in their own processes. The load
+ * generator keeps one request in flight per connection and reports
+ * requests/sec and latency percentiles
+ *
+ * Server modes:
+ *   lthread - an lthread per connection, nonblocking sockets. While
+ *             there is nothing to read a connection parks on a flag that
+ *             the main lthread sets from epoll, and the main lthread
+ *             waits in epoll_wait through lthread_offload when nothing
+ *             is ready. The scheduler itself still spins while no
+ *             lthread can run, so the server uses a core even when idle
+ *   pthread - a pthread per connection, blocking sockets
+ *   epoll   - a single threaded epoll loop
+ *
+ * usage: bench_echo [mode|all] [connections] [seconds]
+ */
+
+#define DEFAULT_SECONDS (2)
+#define MESSAGE_SIZE (64)
+#define MAX_SAMPLES (1 << 22)
+#define MAX_EVENTS (1024)
+#define PTHREAD_STACK_SIZE (64 * 1024)
+
+static const char *modes[] = { "lthread", "pthread", "epoll" };
+static const size_t connection_counts[] = { 100, 1000, 10000 };
+
+static int listen_fd = -1;
+
+static int64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+die(const char *what)
+{
+    perror(what);
+    _exit(EXIT_FAILURE);
+}
+
+/* Echo server, lthread per connection */
+
+/* Set by the poller when a descriptor may be readable, indexed by fd */
+static volatile int *fd_ready;
+static size_t nfd_ready;
+
+struct epoll_job {
+    int epfd;
+    struct epoll_event *events;
+};
+
+/* Runs on an offload helper while no connection has anything to do */
+static void *
+epoll_job_wait(void *arg)
+{
+    struct epoll_job *job = arg;
+    return (void *)(intptr_t)epoll_wait(job->epfd, job->events, MAX_EVENTS, -1);
+}
+
+static void *
+lthread_connection(void *data)
+{
+    int fd = (int)(intptr_t)data;
+    char buf[MESSAGE_SIZE * 4];
+    ssize_t n, sent, w;
+
+    for (;;) {
+        n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EAGAIN) {
+            /* Edge triggered, an edge after the read leaves it set */
+            while (!fd_ready[fd]) {
+                lthread_wait_on(&fd_ready[fd], 0, NULL);
+            }
+            fd_ready[fd] = 0;
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        for (sent = 0; sent < n; sent += w) {
+            w = write(fd, buf + sent, (size_t)(n - sent));
+            /* Replies are small enough that this hardly ever happens */
+            if (w < 0) {
+                if (errno != EAGAIN) goto done;
+                w = 0;
+                lthread_yield();
+            }
+        }
+    }
+done:
+    close(fd);
+    return NULL;
+}
+
+/* The main lthread polls, waking connections whose sockets are ready */
+static void
+serve_lthread(void)
+{
+    struct epoll_event ev, events[MAX_EVENTS];
+    struct epoll_job job;
+    struct rlimit lim;
+    void *ret;
+    lthread t;
+    int n, fd;
+
+    if (getrlimit(RLIMIT_NOFILE, &lim) != 0) die("getrlimit");
+    nfd_ready = lim.rlim_cur;
+    fd_ready = calloc(nfd_ready, sizeof(*fd_ready));
+
+    job.epfd = epoll_create1(0);
+    job.events = events;
+    if (job.epfd < 0) die("epoll_create1");
+    fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd;
+    epoll_ctl(job.epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    lthread_init();
+
+    for (;;) {
+        /* Only block while every connection is parked */
+        n = epoll_wait(job.epfd, events, MAX_EVENTS, 0);
+        if (n == 0) {
+            if (lthread_offload(epoll_job_wait, &job, &ret)) die("lthread_offload");
+            n = (int)(intptr_t)ret;
+        }
+        for (int ii = 0; ii < n; ii++) {
+            fd = events[ii].data.fd;
+            if (fd != listen_fd) {
+                /* A closed and reused descriptor only gets a spurious read */
+                fd_ready[fd] = 1;
+                lthread_wake(&fd_ready[fd], 1);
+                continue;
+            }
+            while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                if ((size_t)fd >= nfd_ready) {
+                    close(fd);
+                    continue;
+                }
+                fd_ready[fd] = 0;
+                ev.events = EPOLLIN | EPOLLET;
+                ev.data.fd = fd;
+                epoll_ctl(job.epfd, EPOLL_CTL_ADD, fd, &ev);
+                lthread_create(&t, lthread_connection, (void *)(intptr_t)fd);
+                lthread_detach(t);
+            }
+        }
+        lthread_yield();
+    }
+}
+
+/* Echo server, pthread per connection */
+
+static void *
+pthread_connection(void *data)
+{
+    int fd = (int)(intptr_t)data;
+    char buf[MESSAGE_SIZE * 4];
+    ssize_t n, sent, w;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (sent = 0; sent < n; sent += w) {
+            w = write(fd, buf + sent, (size_t)(n - sent));
+            if (w < 0) goto done;
+        }
+    }
+done:
+    close(fd);
+    return NULL;
+}
+
+static void
+serve_pthread(void)
+{
+    pthread_attr_t attr;
+    pthread_t t;
+    int fd;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, PTHREAD_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (;;) {
+        fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        if (pthread_create(&t, &attr, pthread_connection, (void *)(intptr_t)fd)) {
+            close(fd);
+        }
+    }
+}
+
+/* Echo server, one epoll loop */
+
+static void
+serve_epoll(void)
+{
+    struct epoll_event ev, events[MAX_EVENTS];
+    char buf[MESSAGE_SIZE * 4];
+    int epfd, n, fd;
+    ssize_t r, sent, w;
+
+    epfd = epoll_create1(0);
+    if (epfd < 0) die("epoll_create1");
+
+    fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    for (;;) {
+        n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        for (int ii = 0; ii < n; ii++) {
+            fd = events[ii].data.fd;
+            if (fd == listen_fd) {
+                while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                    ev.events = EPOLLIN;
+                    ev.data.fd = fd;
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+                }
+                continue;
+            }
+
+            r = read(fd, buf, sizeof(buf));
+            if (r < 0 && errno == EAGAIN) {
+                continue;
+            }
+            if (r <= 0) {
+                close(fd);
+                continue;
+            }
+            /* Replies are small enough to never fill the send buffer
+             * with a single request in flight */
+            for (sent = 0; sent < r; sent += w) {
+                w = write(fd, buf + sent, (size_t)(r - sent));
+                if (w < 0) {
+                    if (errno != EAGAIN) break;
+                    w = 0;
+                }
+            }
+        }
+    }
+}
+
+/* Load generator */
+
+struct client_conn {
+    int fd;
+    size_t received; /* Bytes of the current reply read so far */
+    int64_t sent_at; /* When the current request was sent */
+};
+
+static int
+compare_samples(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double
+percentile_us(const int64_t *samples, size_t n, double p)
+{
+    size_t idx;
+    if (n == 0) {
+        return 0;
+    }
+    idx = (size_t)(p * (double)(n - 1));
+    return (double)samples[idx] / 1000.0;
+}
+
+static void
+send_request(struct client_conn *c, const char *msg)
+{
+    c->received = 0;
+    c->sent_at = now_ns();
+    if (write(c->fd, msg, MESSAGE_SIZE) != MESSAGE_SIZE) die("write");
+}
+
+static void
+run_client(const char *mode, size_t nconns, int seconds, struct sockaddr_in *addr)
+{
+    struct client_conn *conns;
+    struct epoll_event ev, events[MAX_EVENTS];
+    char msg[MESSAGE_SIZE], buf[MESSAGE_SIZE];
+    int64_t *samples, start, end, stop;
+    size_t nsamples = 0, requests = 0;
+    int epfd, n, one = 1;
+    ssize_t r;
+
+    conns = calloc(nconns, sizeof(*conns));
+    samples = malloc(MAX_SAMPLES * sizeof(*samples));
+    memset(msg, 'x', sizeof(msg));
+
+    epfd = epoll_create1(0);
+    if (epfd < 0) die("epoll_create1");
+
+    for (size_t ii = 0; ii < nconns; ii++) {
+        conns[ii].fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (conns[ii].fd < 0) die("socket");
+        if (connect(conns[ii].fd, (struct sockaddr *)addr, sizeof(*addr))) die("connect");
+        setsockopt(conns[ii].fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(conns[ii].fd, F_SETFL, O_NONBLOCK);
+        ev.events = EPOLLIN;
+        ev.data.ptr = conns + ii;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, conns[ii].fd, &ev);
+    }
+
+    start = now_ns();
+    stop = start + (int64_t)seconds * 1000000000;
+    for (size_t ii = 0; ii < nconns; ii++) {
+        send_request(conns + ii, msg);
+    }
+
+    while (now_ns() < stop) {
+        n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+        for (int ii = 0; ii < n; ii++) {
+            struct client_conn *c = events[ii].data.ptr;
+            r = read(c->fd, buf, MESSAGE_SIZE - c->received);
+            if (r < 0 && errno == EAGAIN) {
+                continue;
+            }
+            if (r <= 0) die("server closed connection");
+            c->received += (size_t)r;
+            if (c->received < MESSAGE_SIZE) {
+                continue;
+            }
+            if (nsamples < MAX_SAMPLES) {
+                samples[nsamples++] = now_ns() - c->sent_at;
+            }
+            requests++;
+            send_request(c, msg);
+        }
+    }
+    end = now_ns();
+
+    qsort(samples, nsamples, sizeof(*samples), compare_samples);
+    printf("%-8s %6zu conns %10.0f req/s  p50 %8.1f us  p99 %8.1f us  p999 %8.1f us\n",
+            mode, nconns, (double)requests * 1e9 / (double)(end - start),
+            percentile_us(samples, nsamples, 0.50),
+            percentile_us(samples, nsamples, 0.99),
+            percentile_us(samples, nsamples, 0.999));
+    fflush(stdout);
+}
+
+/* Runs one configuration, server and load generator each in a child */
+static void
+run(const char *mode, size_t nconns, int seconds)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = 0,
+    };
+    socklen_t len = sizeof(addr);
+    pid_t server, client;
+    int status;
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) die("socket");
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr))) die("bind");
+    if (listen(listen_fd, SOMAXCONN)) die("listen");
+    getsockname(listen_fd, (struct sockaddr *)&addr, &len);
+
+    server = fork();
+    if (server == 0) {
+        if (strcmp(mode, "lthread") == 0) serve_lthread();
+        else if (strcmp(mode, "pthread") == 0) serve_pthread();
+        else serve_epoll();
+        _exit(EXIT_SUCCESS);
+    }
+
+    client = fork();
+    if (client == 0) {
+        close(listen_fd);
+        run_client(mode, nconns, seconds, &addr);
+        _exit(EXIT_SUCCESS);
+    }
+
+    close(listen_fd);
+    waitpid(client, &status, 0);
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        printf("%-8s %6zu conns failed\n", mode, nconns);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *mode = argc > 1 ? argv[1] : "all";
+    size_t nconns = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+    int seconds = argc > 3 ? atoi(argv[3]) : DEFAULT_SECONDS;
+    struct rlimit lim;
+
+    /* Every connection needs a descriptor in the server and one in
+     * the load generator */
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+        if (lim.rlim_cur != RLIM_INFINITY && lim.rlim_cur < 10000 + 64) {
+            fprintf(stderr, "Descriptor limit %lu is too low for 10000 connections\n",
+                    (unsigned long)lim.rlim_cur);
+        }
+    }
+
+    for (size_t ii = 0; ii < sizeof(modes) / sizeof(*modes); ii++) {
+        if (strcmp(mode, "all") != 0 && strcmp(mode, modes[ii]) != 0) {
+            continue;
+        }
+        if (nconns != 0) {
+            run(modes[ii], nconns, seconds);
+            continue;
+        }
+        for (size_t jj = 0; jj < sizeof(connection_counts) / sizeof(*connection_counts); jj++) {
+            run(modes[ii], connection_counts[jj], seconds);
+        }
+    }
+
+    return 0;
+}
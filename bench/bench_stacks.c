@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/resource.h>
+
+#include "lthread.h"
+
+/* Measures the cost of creating and switching between many lthreads,
+ * along with the page faults taken doing so.
+ *
+ * usage: bench_stacks [threads] [yields per thread] [batch]
+ *
+ * With 'batch' the threads are made by one lthread_create_n call
+ */
+
+#define DEFAULT_THREADS (10000)
+#define DEFAULT_YIELDS (100)
+
+static size_t yields = DEFAULT_YIELDS;
+
+/* Set once every thread has been created */
+static volatile int go = 0;
+
+void *
+yield_loop(void *data)
+{
+    (void)data;
+    /* Stay out of the way until creation is measured */
+    while (!go) {
+        lthread_sleep(1);
+    }
+    for (size_t ii = 0; ii < yields; ii++) {
+        lthread_yield();
+    }
+    return NULL;
+}
+
+static double
+elapsed(struct timespec *start, struct timespec *end)
+{
+    return (double)(end->tv_sec - start->tv_sec) +
+        (double)(end->tv_nsec - start->tv_nsec) / 1000000000;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t nthreads = DEFAULT_THREADS;
+    struct timespec start, created, end;
+    struct rusage usage_start, usage_created, usage_end;
+    lthread *threads;
+    int batch = 0;
+
+    if (argc > 1) nthreads = strtoul(argv[1], NULL, 10);
+    if (argc > 2) yields = strtoul(argv[2], NULL, 10);
+    if (argc > 3) batch = strcmp(argv[3], "batch") == 0;
+
+    threads = malloc(nthreads * sizeof(*threads));
+
+    lthread_init();
+
+    LTHREAD_SAFE {
+        getrusage(RUSAGE_SELF, &usage_start);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+
+    if (batch) {
+        lthread_create_n(threads, nthreads, yield_loop, NULL);
+    }
+    else {
+        for (size_t ii = 0; ii < nthreads; ii++) {
+            lthread_create(threads + ii, yield_loop, NULL);
+        }
+    }
+
+    LTHREAD_SAFE {
+        clock_gettime(CLOCK_MONOTONIC, &created);
+        getrusage(RUSAGE_SELF, &usage_created);
+    }
+    go = 1;
+
+    lthread_join_all(threads, nthreads, NULL);
+
+    LTHREAD_SAFE {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        getrusage(RUSAGE_SELF, &usage_end);
+
+        printf("threads:             %zu%s\n", nthreads, batch ? " (batch)" : "");
+        printf("create:              %.3f us/thread\n",
+                elapsed(&start, &created) * 1e6 / (double)nthreads);
+        printf("switch:              %.3f us/yield\n",
+                elapsed(&created, &end) * 1e6 / (double)(nthreads * yields));
+        printf("minor faults create: %ld\n",
+                usage_created.ru_minflt - usage_start.ru_minflt);
+        printf("minor faults run:    %ld\n",
+                usage_end.ru_minflt - usage_created.ru_minflt);
+        printf("max rss:             %ld KB\n", usage_end.ru_maxrss);
+    }
+
+    LTHREAD_SAFE free(threads);
+
+    return 0;
+}
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lthread.h"
+
+/* Measures the cost of a voluntary switch between lthreads created
+ * with different flags.
+ *
+ * usage: bench_switch [threads] [yields per thread]
+ */
+
+#define DEFAULT_THREADS (16)
+#define DEFAULT_YIELDS (100000)
+
+static size_t yields = DEFAULT_YIELDS;
+
+void *
+yield_loop(void *data)
+{
+    (void)data;
+    for (size_t ii = 0; ii < yields; ii++) {
+        lthread_yield();
+    }
+    return NULL;
+}
+
+/* Returns nanoseconds per yield with 'nthreads' threads made with 'flags' */
+static double
+run(size_t nthreads, unsigned int flags)
+{
+    struct timespec start, end;
+    lthread *threads;
+
+    LTHREAD_SAFE threads = malloc(nthreads * sizeof(*threads));
+
+    LTHREAD_SAFE clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t ii = 0; ii < nthreads; ii++) {
+        lthread_create_ex(threads + ii, yield_loop, NULL, flags);
+    }
+    lthread_join_all(threads, nthreads, NULL);
+    LTHREAD_SAFE clock_gettime(CLOCK_MONOTONIC, &end);
+
+    LTHREAD_SAFE free(threads);
+
+    return ((double)(end.tv_sec - start.tv_sec) * 1e9 +
+            (double)(end.tv_nsec - start.tv_nsec)) / (double)(nthreads * yields);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t nthreads = DEFAULT_THREADS;
+    double plain, integer_only;
+
+    if (argc > 1) nthreads = strtoul(argv[1], NULL, 10);
+    if (argc > 2) yields = strtoul(argv[2], NULL, 10);
+
+    lthread_init();
+
+    plain = run(nthreads, 0);
+    integer_only = run(nthreads, LTHREAD_INTEGER_ONLY);
+
+    LTHREAD_SAFE {
+        printf("threads:      %zu\n", nthreads);
+        printf("default:      %.1f ns/yield\n", plain);
+        printf("integer only: %.1f ns/yield\n", integer_only);
+    }
+
+    return 0;
+}
@@ -4,6 +4,11 @@
 #include <stdlib.h>
 #include <setjmp.h>
 #include <ucontext.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 /* Starts a block of code that is safe from signal preemption,
  * after the block completes preemption will start again.
@@ -33,6 +38,33 @@
         (lthread_safe_go_once__ || (lthread_unblock() && 0)); \
         lthread_safe_go_once__ = 0)
 
+/* Flags for lthread_create_ex */
+
+/* The thread never changes the FP environment (rounding mode, exception
+ * masks), so switches skip saving it along with the signal mask
+ */
+#define LTHREAD_INTEGER_ONLY (1u << 0)
+
+/* The thread is a generator, it is created suspended and only runs
+ * while resumed with lthread_resume
+ */
+#define LTHREAD_GENERATOR (1u << 1)
+
+/* The thread runs on a stack shared with every other such thread. When
+ * another one needs it, only the part in use is copied out to a heap
+ * buffer of that size, and copied back before this thread runs again.
+ * Meant for huge numbers of mostly parked threads: an idle one costs its
+ * lthread_info and its live frames instead of a whole stack. Switches
+ * between two of them copy both ways, so they are slower.
+ *
+ * Pointers to the thread's stack variables must not be used by other
+ * threads while it is switched out, its frames are somewhere else then,
+ * see lthread_on_copy_stack. The library's own waits keep what other
+ * threads write to off the stack, but a wait-set on it is refused. Can't
+ * be combined with LTHREAD_INTEGER_ONLY
+ */
+#define LTHREAD_COPY_STACK (1u << 2)
+
 /* TODO: Are all these statuses really needed */
 enum lthread_status {
     CREATED = 0,
@@ -41,17 +73,60 @@ enum lthread_status {
     BLOCKED,
     DONE,
     SLEEPING,
+    SUSPENDED, /* Out of the queue, waiting for a direct switch */
 };
 
+struct lthread_waitset;
+struct lthread_rt_info;
+struct lthread_log_buffer;
+struct lthread_rwlock_waiter;
+struct lthread_slab;
+struct lthread_group;
+struct lthread_cleanup;
+struct lthread_hold_site;
+
 struct lthread_info {
     void *(*start_routine)(void *data); /* Thread entry point */
     void *data; /* Data passed to entry point, return value */
     enum lthread_status status; /* Scheduling status of thread */
     ucontext_t context; /* Stored context of thread */
+    void *regs[8]; /* Stored registers of LTHREAD_INTEGER_ONLY threads */
+    int regs_saved; /* Resume from regs instead of context */
+    unsigned int flags; /* LTHREAD_* flags given at creation */
     void *stack; /* Pointer to end of the stack */
     size_t id; /* Allocated ID for the thread */
     struct timespec wake_time; /* Time to awake thread from SLEEPING */
     struct lthread_info *next; /* Next thread in the queue */
+    struct lthread_info *prev; /* Previous thread in the queue */
+    struct lthread_rt_info *rt; /* Real-time parameters, NULL if best-effort */
+    struct lthread_info *joiner; /* Thread parked in lthread_join on this one */
+    struct lthread_waitset *waitset; /* Wait-set this thread belongs to */
+    struct lthread_info *done_next; /* Next finished thread in the wait-set */
+    int detached; /* Resources are freed as soon as the thread finishes */
+    int park_permit; /* Set by lthread_unpark, consumed by lthread_park */
+    struct lthread_log_buffer *log; /* Messages from lthread_log */
+    struct lthread_info *sched_link; /* For use by the scheduling policy */
+    int sched_queued; /* For use by the scheduling policy */
+    struct lthread_info *resumer; /* Thread suspended in lthread_resume on
+                                     this generator */
+    void *yielded; /* Last value passed to lthread_yield_value */
+    size_t epoch; /* Global epoch when the epoch section was entered */
+    size_t epoch_nest; /* Depth of nested lthread_epoch_enter calls */
+    struct lthread_slab *slab; /* Shared allocation this came from, if any */
+    struct lthread_group *group; /* Group sharing CPU time, NULL for the default */
+    struct lthread_info *group_next; /* Next runnable thread in the group */
+    struct lthread_info *group_prev; /* Previous runnable thread in the group */
+    int cancel_pending; /* Set by lthread_cancel */
+    int cancel_state; /* LTHREAD_CANCEL_ENABLE or LTHREAD_CANCEL_DISABLE */
+    struct lthread_cleanup *cleanup; /* Last cleanup handler pushed */
+    void *stack_copy; /* LTHREAD_COPY_STACK frames while off the stack */
+    size_t stack_copy_size; /* Bytes saved in stack_copy */
+    size_t stack_copy_cap; /* Bytes allocated for stack_copy */
+    void *wait_record; /* LTHREAD_COPY_STACK waiter entry, off the stack */
+    long long cpu_ns; /* Time spent running, in nanoseconds */
+    long long run_since; /* When it last started running, 0 while it isn't */
+    struct lthread_hold_site *hold_site; /* LTHREAD_HOLD_PROFILE hold in progress */
+    long long hold_start; /* When that hold started */
 #ifdef LTHREAD_DEBUG
     /* Debug information to valgrind stops complaining */
     unsigned int stack_reg;
@@ -61,9 +136,177 @@ struct lthread_info {
 /* Thread handle will be its ID */
 typedef size_t lthread;
 
+/* Parameters of a real-time lthread, scheduled earliest-deadline-first
+ * ahead of all best-effort lthreads
+ */
+struct lthread_rt_params {
+    struct timespec period; /* Time between the start of each job */
+    struct timespec deadline; /* Deadline of a job relative to its start,
+                                 zero means the end of the period */
+    struct timespec runtime; /* Run time allowed each period, zero
+                                means unlimited */
+};
+
+/* Counters kept for each real-time lthread */
+struct lthread_rt_stats {
+    size_t jobs; /* Jobs completed with lthread_rt_wait_period */
+    size_t deadline_misses; /* Jobs completed after their deadline */
+    size_t throttled; /* Periods the thread ran out of run time in */
+};
+
+/* A collection of lthreads whose results are handed back in the order
+ * the threads finish, instead of the order they are joined in.
+ *
+ * The structure is owned by the caller and must stay alive until every
+ * thread added to it has been collected with lthread_waitset_next
+ */
+struct lthread_waitset {
+    struct lthread_info *done_head; /* Finished threads not yet collected */
+    struct lthread_info *done_tail; /* Last finished thread */
+    size_t pending; /* Threads added but not yet collected */
+    struct lthread_info *waiter; /* Thread parked waiting for a completion */
+};
+
+/* Wakes a thread at fixed absolute intervals, see lthread_periodic_wait */
+struct lthread_periodic {
+    struct timespec period; /* Time between releases */
+    struct timespec next; /* Next release, on lthread_clock() */
+    size_t overruns; /* Releases that passed before the thread waited for them */
+};
+
+/* A reader-writer lock, threads that can't take it are parked and
+ * granted it in the order they asked for it
+ */
+struct lthread_rwlock {
+    size_t readers; /* Readers holding the lock */
+    int writer; /* A writer holds the lock */
+    struct lthread_rwlock_waiter *wait_head; /* Parked threads, oldest first */
+    struct lthread_rwlock_waiter *wait_tail; /* Most recently parked thread */
+};
+
+#define LTHREAD_RWLOCK_INITIALIZER { 0, 0, NULL, NULL }
+
+/* Weight of a group given an ordinary share of the CPU */
+#define LTHREAD_GROUP_WEIGHT_DEFAULT 1024
+
+/* Counters kept for each lthread group under lthread_sched_fair */
+struct lthread_group_stats {
+    size_t threads; /* Threads in the group that haven't finished */
+    size_t runnable; /* Of those, threads not sleeping or waiting */
+    size_t picks; /* Times one of its threads was picked to run */
+    size_t ticks; /* Times one of its threads used up its time slice */
+    struct timespec run_time; /* Time its threads spent running */
+};
+
+/* A set of lthreads sharing CPU time in proportion to 'weight' with the
+ * other groups, see lthread_sched_fair. The structure is owned by the
+ * caller and must stay alive until lthread_group_destroy
+ */
+struct lthread_group {
+    unsigned int weight; /* Share of the CPU relative to other groups */
+    long long vruntime; /* Run time scaled by weight, lowest runs next */
+    struct lthread_info *cursor; /* Runnable thread whose turn is next */
+    struct lthread_group *next; /* Next group in the list of all groups */
+    struct lthread_group_stats stats; /* Reported by lthread_group_get_stats */
+};
+
+/* A scheduling policy. Every thread lives in a circular queue linked
+ * through lthread_info.next, and the thread at the front is running.
+ * The policy picks which thread in the queue becomes the front next,
+ * the rest of the hooks tell it what happened to a thread so it may
+ * keep its own bookkeeping. Only pick_next is required
+ *
+ * All hooks run inside the scheduler, with scheduling blocked, and so
+ * must be async-signal-safe
+ */
+struct lthread_sched_ops {
+    const char *name; /* Name of the policy */
+    /* New thread 't' was added to the queue */
+    void (*enqueue)(struct lthread_info *t);
+    /* Finished thread 't' is leaving the queue for good */
+    void (*dequeue)(struct lthread_info *t);
+    /* Returns the thread in the queue to try next after 'current', the
+     * scheduler keeps asking until it gets one that can run */
+    struct lthread_info *(*pick_next)(struct lthread_info *current);
+    /* Running thread 't' called lthread_yield */
+    void (*on_yield)(struct lthread_info *t);
+    /* Running thread 't' is going to sleep or wait for something */
+    void (*on_block)(struct lthread_info *t);
+    /* Sleeping or waiting thread 't' can run again */
+    void (*on_wake)(struct lthread_info *t);
+    /* Running thread 't' was preempted at the end of its time slice */
+    void (*on_tick)(struct lthread_info *t);
+};
+
+/* Default policy, threads take turns in the order they were created */
+extern const struct lthread_sched_ops lthread_sched_round_robin;
+
+/* Runs the most recently woken thread first, while the data it was
+ * woken up for is still in cache. Falls back to round-robin
+ */
+extern const struct lthread_sched_ops lthread_sched_lifo;
+
+/* Fair share between lthread groups: the group that has had the least
+ * CPU time for its weight runs next, and threads in a group take turns.
+ * A group with 1000 threads gets no more time than one with a single
+ * thread of the same weight. Threads not put in a group share the
+ * default group
+ */
+extern const struct lthread_sched_ops lthread_sched_fair;
+
+/* Settings for lthread_init_ex, fill in with lthread_config_default
+ * and change only what matters
+ */
+struct lthread_config {
+    const struct lthread_sched_ops *sched; /* Scheduling policy */
+    struct timespec quantum; /* Time a thread runs before preemption */
+    size_t stack_size; /* Stack of each lthread, rounded up to whole pages */
+    size_t initial_lthreads; /* Thread handles allocated up front */
+    clockid_t clock; /* Clock of the scheduling timer and all deadlines */
+    int signal; /* Scheduling signal, from SIGRTMIN to SIGRTMAX */
+    int dump_signal; /* Signal writing lthread_dump to stderr, 0 for none */
+};
+
+/* Fills 'config' with the settings lthread_init uses, the defaults
+ * the library was built with
+ */
+void lthread_config_default(struct lthread_config *config);
+
 /* Start scheduling lthreads */
 int lthread_init(void);
 
+/* Start scheduling lthreads with the policy 'ops'
+ *
+ * returns non-zero if 'ops' is not a usable policy
+ */
+int lthread_init_sched(const struct lthread_sched_ops *ops);
+
+/* Start scheduling lthreads with the settings in 'config', or the
+ * defaults if it is NULL. These environment variables take precedence
+ * over 'config', so a program can be tuned without rebuilding it:
+ *
+ *   LTHREAD_QUANTUM_NS        time slice in nanoseconds
+ *   LTHREAD_STACK_SIZE        stack size in bytes
+ *   LTHREAD_INITIAL_LTHREADS  thread handles allocated up front
+ *   LTHREAD_CLOCK             realtime, monotonic or boottime
+ *   LTHREAD_SIG               scheduling signal
+ *   LTHREAD_DUMP_SIG          signal writing lthread_dump to stderr
+ *
+ * Signals are numbers or names the way kill -l lists them, with or
+ * without SIG, such as USR1, RTMIN+2 or RTMAX-1
+ *
+ * returns non-zero if a setting is out of range or the policy is not usable
+ */
+int lthread_init_ex(const struct lthread_config *config);
+
+/* Changes the time a thread runs before it is preempted to 'quantum',
+ * takes effect from the next tick
+ *
+ * returns non-zero if 'quantum' is not positive or lthread_init hasn't
+ * been called
+ */
+int lthread_set_quantum(const struct timespec *quantum);
+
 /* Create an lthread 't' whose execution will start at 
  * the specified entry point 'start_routine'
  *
@@ -75,6 +318,66 @@ int lthread_init(void);
  */
 int lthread_create(lthread *t, void *(*start_routine)(void *data), void *data);
 
+/* Creates 'n' lthreads at once, all starting at 'start_routine'. Thread
+ * ii is passed args[ii], or NULL if 'args' is NULL, and its handle is
+ * saved in handles[ii]
+ *
+ * Much cheaper than 'n' calls to lthread_create: the stacks come from one
+ * mapping, the thread structures from one allocation, no system call is
+ * made per thread and the threads join the queue all at once
+ *
+ * returns non-zero on failure
+ */
+int lthread_create_n(lthread *handles, size_t n,
+        void *(*start_routine)(void *data), void **args);
+
+/* Like lthread_create, 'flags' is a bitwise or of LTHREAD_* flags
+ * changing how the thread is run
+ *
+ * returns non-zero if the flags can't be combined
+ */
+int lthread_create_ex(lthread *t, void *(*start_routine)(void *data), void *data,
+        unsigned int flags);
+
+/* Returns non-zero if 'addr' is on the stack shared by LTHREAD_COPY_STACK
+ * threads. Other threads must not write there, whatever they write lands
+ * in whichever thread has the stack at the time
+ */
+int lthread_on_copy_stack(const void *addr);
+
+/* Like lthread_create, but the data passed to 'start_routine' lives at
+ * the top of the new thread's own stack instead of being allocated.
+ * 'size' bytes are reserved there and 'init' is called with them and
+ * 'arg' to fill them in, with scheduling blocked and before the thread
+ * can run. The space is gone once the thread finishes
+ *
+ * returns non-zero if 'size' doesn't fit in half the stack
+ */
+int lthread_create_inplace(lthread *t, void *(*start_routine)(void *data), size_t size,
+        void (*init)(void *storage, void *arg), void *arg);
+
+/* Switches straight to generator 't', created with LTHREAD_GENERATOR,
+ * and suspends the caller until the generator calls lthread_yield_value
+ * or returns. The yielded value is saved in 'value' if 'value' is not
+ * NULL. The generator runs in the caller's place in the queue, so no
+ * other thread is scheduled in between
+ *
+ * A finished generator must still be collected with lthread_join,
+ * unless it is detached
+ *
+ * returns 0 if a value was yielded, 1 if the generator finished and
+ * -1 if 't' is not a suspended generator
+ */
+int lthread_resume(lthread t, void **value);
+
+/* Hands 'value' to the thread that resumed the calling generator and
+ * switches straight back to it. Returns once the generator is resumed
+ * again
+ *
+ * returns non-zero if the calling thread was not resumed as a generator
+ */
+int lthread_yield_value(void *value);
+
 /* Waits for a thread 't' to complete execution. The return value of
  * that instance of 'start_routine' will be saved in 'retval' if
  * 'retval' is not NULL
@@ -83,8 +386,436 @@ int lthread_create(lthread *t, void *(*start_routine)(void *data), void *data);
  */
 int lthread_join(lthread t, void **retval);
 
-/* Stops a thread of executing in a more desructive fashion, the return
- * value is not recorded
+/* Like lthread_join, but gives up once 'timeout' (a relative time)
+ * passes without 't' finishing. The thread can still be joined later.
+ * A NULL 'timeout' waits like lthread_join, a negative one is taken as
+ * zero and only checks whether 't' already finished
+ *
+ * returns 0 once joined, 1 if 't' is not a valid thread and -1 if the
+ * timeout passed first
+ */
+int lthread_join_timed(lthread t, void **retval, const struct timespec *timeout);
+
+/* Joins every thread in 'threads' (an array of 'n' handles). If 'retvals'
+ * is not NULL the return value of threads[ii] is stored in retvals[ii]
+ *
+ * returns non-zero if any of the joins failed
+ */
+int lthread_join_all(lthread *threads, size_t n, void **retvals);
+
+/* Prepares an empty wait-set 'ws' for use
+ *
+ * returns non-zero on failure
+ */
+int lthread_waitset_init(struct lthread_waitset *ws);
+
+/* Adds thread 't' to wait-set 'ws'. A thread may belong to a single
+ * wait-set and, once added, must only be collected through
+ * lthread_waitset_next, never with lthread_join
+ *
+ * returns non-zero if 't' is not a valid thread, or if 'ws' is on the
+ * stack shared by LTHREAD_COPY_STACK threads
+ */
+int lthread_waitset_add(struct lthread_waitset *ws, lthread t);
+
+/* Waits for whichever thread in 'ws' finishes first. Its handle is
+ * saved in 't' and its return value in 'retval' (either may be NULL),
+ * after which the thread is destroyed just like lthread_join
+ *
+ * The calling thread is parked, not scheduled, while it waits
+ *
+ * returns non-zero if 'ws' has no threads left to collect
+ */
+int lthread_waitset_next(struct lthread_waitset *ws, lthread *t, void **retval);
+
+/* Calls 'body' for every index in the half open range [begin, end) by
+ * splitting it into chunks of at most 'grain' indices. The chunks are
+ * handed out to a bounded set of lthreads, and the calling thread,
+ * which are all joined before this returns
+ *
+ * 'body' receives a sub range [begin, end) and 'ctx' for each chunk
+ *
+ * returns non-zero on failure
+ */
+int lthread_parallel_for(size_t begin, size_t end, size_t grain,
+        void (*body)(size_t begin, size_t end, void *ctx), void *ctx);
+
+/* Like lthread_parallel_for, but 'map' produces a value for each chunk
+ * which are then folded together with 'combine', starting from 'identity'.
+ * The final value is saved in 'result'
+ *
+ * Chunks are combined in whatever order the workers finish them, so
+ * 'combine' must be associative and commutative
+ *
+ * returns non-zero on failure
+ */
+int lthread_parallel_reduce(size_t begin, size_t end, size_t grain,
+        void *(*map)(size_t begin, size_t end, void *ctx),
+        void *(*combine)(void *a, void *b, void *ctx),
+        void *identity, void *ctx, void **result);
+
+/* Makes the calling lthread a real-time thread with 'params', or
+ * a best-effort thread again if 'params' is NULL. Its first job
+ * starts immediately
+ *
+ * Runnable real-time threads always run before best-effort threads,
+ * the one with the earliest deadline first. A thread that uses up its
+ * run time is not scheduled again until its next period
+ *
+ * returns non-zero on failure
+ */
+int lthread_set_rt(const struct lthread_rt_params *params);
+
+/* Ends the current job of a real-time lthread and sleeps until the
+ * start of its next period
+ *
+ * returns 1 if the job missed its deadline, 0 if it didn't and -1 if
+ * the calling lthread is not a real-time thread
+ */
+int lthread_rt_wait_period(void);
+
+/* Saves the counters of the calling real-time lthread into 'stats'
+ *
+ * returns non-zero if the calling lthread is not a real-time thread
+ */
+int lthread_get_rt_stats(struct lthread_rt_stats *stats);
+
+/* Sets up group 'g' with a share of the CPU proportional to 'weight',
+ * LTHREAD_GROUP_WEIGHT_DEFAULT being the share of the default group.
+ * Groups only affect scheduling under lthread_sched_fair
+ *
+ * returns non-zero if 'weight' is 0
+ */
+int lthread_group_init(struct lthread_group *g, unsigned int weight);
+
+/* Changes the weight of group 'g'
+ *
+ * returns non-zero if 'weight' is 0
+ */
+int lthread_group_set_weight(struct lthread_group *g, unsigned int weight);
+
+/* Moves thread 't' into group 'g', or the default group if 'g' is NULL.
+ * Threads start in the group of the thread that created them
+ *
+ * returns non-zero if 't' is not a valid thread
+ */
+int lthread_group_add(struct lthread_group *g, lthread t);
+
+/* Like lthread_create_ex, but the new thread starts in group 'g', or the
+ * default group if 'g' is NULL. Unlike creating it and then calling
+ * lthread_group_add, it can't run in the creator's group first
+ *
+ * returns non-zero if 'flags' can't be combined
+ */
+int lthread_group_create(struct lthread_group *g, lthread *t,
+        void *(*start_routine)(void *data), void *data, unsigned int flags);
+
+/* Saves the counters of group 'g', or the default group if 'g' is
+ * NULL, into 'stats'
+ */
+void lthread_group_get_stats(const struct lthread_group *g, struct lthread_group_stats *stats);
+
+/* Forgets group 'g', after which its memory may be reused
+ *
+ * returns non-zero if unfinished threads are still in it
+ */
+int lthread_group_destroy(struct lthread_group *g);
+
+/* Returns the handle of the calling lthread */
+lthread lthread_self(void);
+
+/* Marks thread 't' as detached, its resources are released as soon as it
+ * finishes instead of by lthread_join. A detached thread can't be joined
+ *
+ * returns non-zero if 't' is not a valid thread
+ */
+int lthread_detach(lthread t);
+
+/* Return value of a thread that finished because it was canceled */
+#define LTHREAD_CANCELED ((void *)-1)
+
+/* States for lthread_setcancelstate */
+#define LTHREAD_CANCEL_ENABLE (0)
+#define LTHREAD_CANCEL_DISABLE (1)
+
+/* A cleanup handler, see lthread_cleanup_push */
+struct lthread_cleanup {
+    void (*routine)(void *arg);
+    void *arg;
+    struct lthread_cleanup *prev;
+};
+
+/* Asks thread 't' to stop. Cancellation is deferred, 't' keeps running
+ * until it reaches a cancellation point: lthread_sleep,
+ * lthread_sleep_until, lthread_periodic_wait, lthread_join,
+ * lthread_join_timed, lthread_waitset_next, lthread_wait_on,
+ * lthread_park, lthread_rt_wait_period, lthread_rwlock_rdlock,
+ * lthread_rwlock_wrlock or lthread_testcancel. If it is
+ * waiting in one of those it is woken right away. There it finishes as
+ * if it called lthread_exit(LTHREAD_CANCELED), and must still be joined
+ * unless detached
+ *
+ * returns non-zero if 't' is not a valid thread, already finished or
+ * the main thread
+ */
+int lthread_cancel(lthread t);
+
+/* A cancellation point that does nothing else */
+void lthread_testcancel(void);
+
+/* Sets whether the calling thread acts on lthread_cancel, 'state' is
+ * LTHREAD_CANCEL_ENABLE (the default) or LTHREAD_CANCEL_DISABLE. A
+ * cancel arriving while disabled is kept until the first cancellation
+ * point after enabling again. The previous state is saved in 'oldstate'
+ * if it is not NULL
+ *
+ * returns non-zero if 'state' is not valid
+ */
+int lthread_setcancelstate(int state, int *oldstate);
+
+/* Finishes the calling thread with return value 'retval' after running
+ * its cleanup handlers, most recently pushed first. The handlers run
+ * with preemption enabled, even when this is reached from a cancellation
+ * point inside LTHREAD_SAFE. Called from the main thread this exits the
+ * process once the handlers ran
+ */
+void lthread_exit(void *retval) __attribute__((noreturn));
+
+/* Pushes 'routine', which is called with 'arg' if the thread finishes by
+ * lthread_exit or cancellation before the matching lthread_cleanup_pop.
+ * Like their pthread counterparts these are macros, and each push must
+ * be paired with a pop in the same block
+ */
+#define lthread_cleanup_push(routine, arg) \
+    do { \
+        struct lthread_cleanup lthread_cleanup_rec__ = { (routine), (arg), NULL }; \
+        lthread_cleanup_push_(&lthread_cleanup_rec__)
+
+/* Removes the handler pushed last, calling it if 'execute' is non-zero */
+#define lthread_cleanup_pop(execute) \
+        lthread_cleanup_pop_(&lthread_cleanup_rec__, (execute)); \
+    } while (0)
+
+/* Used by lthread_cleanup_push and lthread_cleanup_pop */
+void lthread_cleanup_push_(struct lthread_cleanup *c);
+void lthread_cleanup_pop_(struct lthread_cleanup *c, int execute);
+
+/* Parks the calling lthread until another thread calls lthread_unpark or
+ * lthread_unpark_remote on it. Returns right away if that already
+ * happened since the last park. May also return spuriously, so callers
+ * should re-check whatever they wait for
+ *
+ * returns non-zero on failure
+ */
+int lthread_park(void);
+
+/* Wakes thread 't' from lthread_park, or makes its next lthread_park
+ * return right away. Unlike most lthread functions this may be used
+ * inside LTHREAD_SAFE, preemption stays blocked
+ *
+ * returns non-zero if 't' is not a valid thread
+ */
+int lthread_unpark(lthread t);
+
+/* The _remote functions below are the only ones that may be called from
+ * OS threads other than the one that called lthread_init(). Those
+ * threads must never receive the scheduling signal, block it in them if
+ * it could be sent to the whole process
+ */
+
+/* Like lthread_create, but callable from any OS thread. The request is
+ * queued lock-free and the scheduler picks it up on its next pass
+ *
+ * If 't' is NULL the new thread is detached and this returns right
+ * away, otherwise it waits until the thread exists and saves its handle
+ * in 't'
+ *
+ * returns non-zero on failure
+ */
+int lthread_create_remote(lthread *t, void *(*start_routine)(void *data), void *data);
+
+/* Like lthread_unpark, but callable from any OS thread
+ *
+ * returns non-zero on failure
+ */
+int lthread_unpark_remote(lthread t);
+
+/* Calls 'fn' with 'arg' on a small pool of helper OS threads while the
+ * calling lthread is parked, its return value is saved in 'result' if
+ * 'result' is not NULL. Other lthreads keep running in the meantime,
+ * making this the way to call anything that may block for a long time
+ *
+ * 'fn' runs outside the scheduler so it must not call lthread functions,
+ * other than the _remote ones
+ *
+ * returns non-zero on failure
+ */
+int lthread_offload(void *(*fn)(void *arg), void *arg, void **result);
+
+/* Prepares rwlock 'rw' for use, same as LTHREAD_RWLOCK_INITIALIZER
+ *
+ * returns non-zero on failure
+ */
+int lthread_rwlock_init(struct lthread_rwlock *rw);
+
+/* Takes 'rw' for reading, alongside any other readers. Parks the
+ * calling lthread while a writer holds it or is waiting for it, which
+ * is a cancellation point
+ *
+ * returns non-zero on failure
+ */
+int lthread_rwlock_rdlock(struct lthread_rwlock *rw);
+
+/* Takes 'rw' for writing, parking the calling lthread until every
+ * reader and writer that came before it is done. Parking is a
+ * cancellation point
+ *
+ * returns non-zero on failure
+ */
+int lthread_rwlock_wrlock(struct lthread_rwlock *rw);
+
+/* Releases 'rw', held for reading or writing by the calling lthread
+ *
+ * returns non-zero if 'rw' wasn't held
+ */
+int lthread_rwlock_unlock(struct lthread_rwlock *rw);
+
+/* Starts an epoch section. Shared pointers read inside it stay valid
+ * until the matching lthread_epoch_exit, even if a writer swaps them
+ * out and hands the old object to lthread_defer_free meanwhile. This
+ * never blocks, sections may nest
+ *
+ * A thread must not park, sleep or finish inside a section for long,
+ * it holds back every deferred free until it leaves
+ */
+void lthread_epoch_enter(void);
+
+/* Ends the epoch section started by the last lthread_epoch_enter */
+void lthread_epoch_exit(void);
+
+/* Frees 'ptr' once no lthread can still be reading it, that is once
+ * every epoch section that was running when this was called has ended.
+ * 'destroy' is called on it instead of free() if it is not NULL, with
+ * scheduling blocked
+ *
+ * 'ptr' must already be unreachable for threads entering a section
+ * from now on, e.g. replaced with a new version
+ *
+ * returns non-zero on failure
+ */
+int lthread_defer_free(void *ptr, void (*destroy)(void *ptr));
+
+/* Parks the calling lthread on 'addr' if it still holds 'expected',
+ * until lthread_wake is called on the same address or 'timeout' (a
+ * relative time, NULL to wait forever) passes. The check and the parking
+ * happen atomically, so a wake right after the value changes is never
+ * missed. Like futex(2), the building block for custom synchronization
+ *
+ * returns 0 once woken, 1 if '*addr' didn't hold 'expected' and -1 if
+ * the timeout passed first
+ */
+int lthread_wait_on(const volatile int *addr, int expected, const struct timespec *timeout);
+
+/* Wakes up to 'n' lthreads waiting on 'addr' in lthread_wait_on, longest
+ * waiting first. May be used inside LTHREAD_SAFE
+ *
+ * returns the number of threads woken
+ */
+int lthread_wake(const volatile int *addr, int n);
+
+/* Wakes the longest waiting lthread on 'addr' and switches straight to
+ * it, see lthread_yield_to. The caller keeps its place and runs next
+ * once that thread waits again, so two threads passing work back and
+ * forth never wait behind the rest. Inside LTHREAD_SAFE, or when another
+ * real-time thread is due, it is only woken
+ *
+ * returns the number of threads woken
+ */
+int lthread_wake_handoff(const volatile int *addr);
+
+/* Starts a flusher lthread that writes messages from lthread_log to 'fd'
+ *
+ * returns non-zero if logging was already started
+ */
+int lthread_log_init(int fd);
+
+/* Writes out every buffered message and stops the flusher lthread
+ *
+ * returns non-zero if logging wasn't started
+ */
+int lthread_log_stop(void);
+
+/* Formats a message into the calling lthread's own log buffer, which the
+ * flusher lthread writes out in batches. Only async-signal-safe work is
+ * done so this does not need to be wrapped in LTHREAD_SAFE
+ *
+ * Supports a subset of printf: the '-' and '0' flags, widths, the hh, h,
+ * l, ll and z length modifiers and the d, i, u, x, X, o, p, s, c and %
+ * conversions. Messages longer than LTHREAD_LOG_LINE_MAX are truncated
+ *
+ * returns non-zero if the message was dropped because the buffer was
+ * full or logging wasn't started. The flusher counts dropped messages
+ * in a "[dropped] N" line after those it writes out
+ */
+int lthread_log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/* Starts the sampling profiler. On every scheduler tick the running
+ * lthread's interrupted PC and frame pointer backtrace are saved, until
+ * 'max_samples' samples are taken. Code built without frame pointers
+ * (-fno-omit-frame-pointer) gets short backtraces
+ *
+ * Samples from an earlier run are discarded
+ *
+ * returns non-zero if the profiler is already running or on failure
+ */
+int lthread_profile_start(size_t max_samples);
+
+/* Stops taking samples, they are kept for lthread_profile_dump
+ *
+ * returns non-zero if the profiler wasn't running
+ */
+int lthread_profile_stop(void);
+
+/* Writes the samples taken so far to 'fd' as folded stacks, one line per
+ * distinct backtrace of each thread followed by how many times it was
+ * seen, e.g. "lthread 3;main_loop;parse;memcpy 42". Feed this to
+ * flamegraph.pl to draw a flame graph. Frames are named with dladdr(3),
+ * so link with -rdynamic to get names for functions in the executable
+ *
+ * Scheduling is blocked while this runs
+ *
+ * returns non-zero if the profiler was never started or on failure
+ */
+int lthread_profile_dump(int fd);
+
+/* Writes a report on every lthread to 'fd' for diagnosing stalls: its
+ * id, status, what it waits for, when it wakes, time spent running,
+ * stack in use and a frame pointer backtrace of where it stopped. The
+ * scheduler's queue lengths follow. Addresses are written as is, look
+ * them up with addr2line(1)
+ *
+ * Only async-signal-safe work is done, so this may be called from a
+ * signal handler, see lthread_dump_on_signal. Scheduling is blocked
+ * while this runs
+ *
+ * returns non-zero if writing to 'fd' failed
+ */
+int lthread_dump(int fd);
+
+/* Makes signal 'signo' write lthread_dump to 'fd', so a process that
+ * hangs can be looked at with kill(1). When the signal interrupts code
+ * with scheduling blocked, the scheduler writes the report on its next
+ * pass instead, which is never if that code never unblocks it
+ *
+ * returns non-zero if 'signo' is the scheduling signal or can't be
+ * caught
+ */
+int lthread_dump_on_signal(int signo, int fd);
+
+/* Cancels thread 't' and joins it, its return value is not recorded.
+ * Like lthread_join this waits, until 't' reaches a cancellation point.
+ * A thread that never reaches one, spinning on the CPU for instance, is
+ * waited for forever
  */
 void lthread_destroy(lthread t);
 
@@ -96,6 +827,46 @@ void lthread_destroy(lthread t);
  */
 int lthread_sleep(size_t milliseconds);
 
+/* Sleeps the currently executing thread until 'deadline', an absolute
+ * time on the clock returned by lthread_clock(). The deadline is rounded
+ * up to the timer slack, see lthread_set_timer_slack. Returns right away
+ * if it already passed
+ *
+ * return value is zero on success, non-zero otherwise
+ */
+int lthread_sleep_until(const struct timespec *deadline);
+
+/* Returns the clock lthread deadlines are measured on, CLOCK_REALTIME
+ * unless another one was configured, see lthread_init_ex
+ */
+clockid_t lthread_clock(void);
+
+/* Sets the timer slack to 'slack'. Sleep deadlines are rounded up to a
+ * multiple of it, so threads sleeping until nearby times are woken
+ * together by one scheduler pass. Zero, the default, disables rounding
+ *
+ * returns non-zero if 'slack' is negative
+ */
+int lthread_set_timer_slack(const struct timespec *slack);
+
+/* Starts periodic timer 'p', releasing every 'period' starting one
+ * period from now
+ *
+ * returns non-zero if 'period' is not positive
+ */
+int lthread_periodic_init(struct lthread_periodic *p, const struct timespec *period);
+
+/* Sleeps until the next release of 'p'. Releases are at fixed absolute
+ * times, so time spent running between waits doesn't add up to drift
+ *
+ * If the next release has already passed this returns right away, and
+ * every release that passed in the meantime is counted as an overrun.
+ * Later releases stay on the original schedule
+ *
+ * returns the number of releases overrun, 0 if the thread was on time
+ */
+int lthread_periodic_wait(struct lthread_periodic *p);
+
 /* Yeilds the execution of the current lthread so that another lthread
  * may begin execution. returns non-zero on failure
  *
@@ -103,6 +874,17 @@ int lthread_sleep(size_t milliseconds);
  */
 int lthread_yield(void);
 
+/* Like lthread_yield, but switches straight to thread 't' instead of
+ * whichever thread is next, so a thread that was just handed work gets
+ * to it right away. Wake it first if it waits, e.g.
+ * lthread_unpark(t); lthread_yield_to(t);
+ *
+ * returns non-zero if 't' is not a valid thread, is the caller or can't
+ * run right now, if scheduling is blocked, or if a real-time thread
+ * other than 't' is due to run. Nothing happens then
+ */
+int lthread_yield_to(lthread t);
+
 /* Stops preemption of the currently executing thread. This thread's
  * context will no be swapped out, no other threads will be scheduled.
  *
@@ -114,6 +896,16 @@ int lthread_yield(void);
  */
 int lthread_block(void);
 
+/* Writes how long lthread_block held off preemption at each call site,
+ * longest first, to 'fd'. Every site gets a histogram of hold times and
+ * the number of scheduler ticks that had to wait for it. The library
+ * must be built with LTHREAD_HOLD_PROFILE defined, which also prints
+ * this report to stderr at exit
+ *
+ * returns non-zero if hold times aren't being recorded or on failure
+ */
+int lthread_hold_report(int fd);
+
 /* Similar to lthread_block, but starts the preemption of the currently
  * executing thread. This thread's context can be swapped out, other 
  * threads may be scheduled.
@@ -122,4 +914,23 @@ int lthread_block(void);
  */
 int lthread_unblock(void);
 
+/* Defers preemption of the calling lthread until the matching
+ * lthread_preempt_enable. Much cheaper than lthread_block, no system
+ * call is made, and calls nest. A tick arriving in between is handled
+ * by lthread_preempt_enable
+ *
+ * The thread must not yield, sleep or wait for anything before it
+ * enables preemption again
+ */
+void lthread_preempt_disable(void);
+
+/* Undoes one lthread_preempt_disable, switching to another lthread if
+ * a tick was held back
+ */
+void lthread_preempt_enable(void);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
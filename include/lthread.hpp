@@ -0,0 +1,377 @@
+#ifndef LTHREAD_HPP
+#define LTHREAD_HPP
+
+#include <exception>
+#include <future>
+#include <memory>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "lthread.h"
+
+/* C++ wrappers around lthreads, header only. The namespace is lthreads
+ * since the C handle type already takes the name lthread
+ *
+ * Callables are stored at the top of the new thread's own stack with
+ * lthread_create_inplace, so starting a thread allocates nothing more
+ * than lthread_create does. Exceptions must not escape a thread started
+ * with spawn, those from async are handed to whoever calls get()
+ */
+namespace lthreads {
+
+/* Largest callable spawn and async take, it lives on the new stack */
+constexpr std::size_t max_callable_size = 4096;
+
+namespace detail {
+
+/* Moves or copies the callable 'arg' points to into 'storage' */
+template <class F>
+void
+construct(void *storage, void *arg)
+{
+    using Fn = std::decay_t<F>;
+    ::new (storage) Fn(std::forward<F>(*static_cast<std::remove_reference_t<F> *>(arg)));
+}
+
+template <class Fn>
+void *
+run(void *storage) noexcept
+{
+    Fn *fn = static_cast<Fn *>(storage);
+    (*fn)();
+    fn->~Fn();
+    return nullptr;
+}
+
+/* Result handed from an async thread to its future. The thread stays
+ * alive, and with it the state on its stack, until the future took the
+ * result
+ */
+enum { running = 0, ready = 1, taken = 2 };
+
+template <class Fn, class T>
+struct async_state {
+    Fn fn;
+    std::optional<std::conditional_t<std::is_void_v<T>, char, T>> value;
+    std::exception_ptr error;
+    volatile int status = running;
+
+    template <class F>
+    explicit async_state(F &&f) : fn(std::forward<F>(f)) {}
+
+    void
+    produce() noexcept
+    {
+        try {
+            if constexpr (std::is_void_v<T>) {
+                fn();
+                value.emplace();
+            }
+            else {
+                value.emplace(fn());
+            }
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+        status = ready;
+        lthread_wake(&status, 1);
+        while (status != taken) {
+            lthread_wait_on(&status, ready, nullptr);
+        }
+    }
+};
+
+/* Where async's callable comes from, and where its state ended up */
+template <class F>
+struct async_source {
+    std::remove_reference_t<F> *fn;
+    void *storage;
+};
+
+template <class Fn, class T, class F>
+void
+construct_async(void *storage, void *arg)
+{
+    auto *source = static_cast<async_source<F> *>(arg);
+    source->storage = storage;
+    ::new (storage) async_state<Fn, T>(std::forward<F>(*source->fn));
+}
+
+template <class Fn, class T>
+void *
+run_async(void *storage) noexcept
+{
+    auto *state = static_cast<async_state<Fn, T> *>(storage);
+    state->produce();
+    state->~async_state();
+    return nullptr;
+}
+
+/* Starts 'start_routine' on a new thread with a 'State' built in place
+ * by 'init' from 'arg', returns the thread's handle
+ */
+template <class State>
+lthread
+create(void *(*start_routine)(void *), void (*init)(void *, void *), void *arg)
+{
+    static_assert(sizeof(State) <= max_callable_size,
+            "callable is too large to keep on the thread's stack");
+    lthread t;
+    /* Can't fail, the size limit fits in the smallest stack */
+    lthread_create_inplace(&t, start_routine, sizeof(State), init, arg);
+    return t;
+}
+
+template <class T>
+void *
+address(T &value) noexcept
+{
+    return const_cast<void *>(static_cast<const volatile void *>(std::addressof(value)));
+}
+
+} /* namespace detail */
+
+/* Owns an lthread, like std::thread but joined when destroyed */
+class thread {
+public:
+    thread() noexcept = default;
+
+    /* Takes ownership of the thread with handle 't' */
+    explicit thread(lthread t) noexcept : handle(t), owned(true) {}
+
+    thread(thread &&other) noexcept
+        : handle(other.handle), owned(std::exchange(other.owned, false)) {}
+
+    thread &
+    operator=(thread &&other) noexcept
+    {
+        if (this != &other) {
+            if (owned) {
+                join();
+            }
+            handle = other.handle;
+            owned = std::exchange(other.owned, false);
+        }
+        return *this;
+    }
+
+    thread(const thread &) = delete;
+    thread &operator=(const thread &) = delete;
+
+    ~thread()
+    {
+        if (owned) {
+            join();
+        }
+    }
+
+    bool joinable() const noexcept { return owned; }
+    lthread native_handle() const noexcept { return handle; }
+
+    /* Waits for the thread to finish, returns its return value */
+    void *
+    join() noexcept
+    {
+        void *ret = nullptr;
+        if (owned) {
+            owned = false;
+            lthread_join(handle, &ret);
+        }
+        return ret;
+    }
+
+    /* Lets the thread clean up after itself when it finishes */
+    void
+    detach() noexcept
+    {
+        if (owned) {
+            owned = false;
+            lthread_detach(handle);
+        }
+    }
+
+private:
+    lthread handle = 0;
+    bool owned = false;
+};
+
+/* Runs 'f()' on a new thread, 'f' is moved or copied onto its stack */
+template <class F>
+thread
+spawn(F &&f)
+{
+    using Fn = std::decay_t<F>;
+    return thread(detail::create<Fn>(detail::run<Fn>, detail::construct<F>,
+                detail::address(f)));
+}
+
+/* Result of a thread started with async, only movable. Destroying a
+ * future whose result wasn't taken waits for the thread. Like
+ * std::future, waiting on one without a thread, default constructed,
+ * moved from or already taken, throws std::future_error
+ */
+template <class T>
+class future {
+public:
+    future() noexcept = default;
+
+    future(future &&other) noexcept
+        : handle(other.handle), status(std::exchange(other.status, nullptr)),
+          take_value(other.take_value), take_error(other.take_error), data(other.data) {}
+
+    future &
+    operator=(future &&other) noexcept
+    {
+        if (this != &other) {
+            release();
+            handle = other.handle;
+            status = std::exchange(other.status, nullptr);
+            take_value = other.take_value;
+            take_error = other.take_error;
+            data = other.data;
+        }
+        return *this;
+    }
+
+    future(const future &) = delete;
+    future &operator=(const future &) = delete;
+
+    ~future() { release(); }
+
+    bool valid() const noexcept { return status != nullptr; }
+
+    /* Returns true if get() won't have to wait */
+    bool is_ready() const noexcept { return status != nullptr && *status != detail::running; }
+
+    /* Waits for the thread to finish running */
+    void
+    wait() const
+    {
+        if (status == nullptr) {
+            throw std::future_error(std::future_errc::no_state);
+        }
+        while (*status == detail::running) {
+            lthread_wait_on(status, detail::running, nullptr);
+        }
+    }
+
+    /* Waits for and returns the result, or rethrows what the thread threw */
+    T
+    get()
+    {
+        std::exception_ptr error;
+        wait();
+        error = take_error(data);
+        if (error) {
+            release();
+            std::rethrow_exception(error);
+        }
+        if constexpr (std::is_void_v<T>) {
+            release();
+        }
+        else {
+            T value = take_value(data);
+            release();
+            return value;
+        }
+    }
+
+private:
+    template <class F>
+    friend future<std::invoke_result_t<std::decay_t<F>>> async(F &&f);
+
+    using value_type = std::conditional_t<std::is_void_v<T>, char, T>;
+
+    /* Lets the thread finish, after which its stack is gone */
+    void
+    release() noexcept
+    {
+        if (status == nullptr) {
+            return;
+        }
+        wait();
+        *status = detail::taken;
+        lthread_wake(status, 1);
+        lthread_join(handle, nullptr);
+        status = nullptr;
+    }
+
+    lthread handle = 0;
+    volatile int *status = nullptr;
+    /* Reach into the state without knowing the callable's type */
+    value_type (*take_value)(void *) = nullptr;
+    std::exception_ptr (*take_error)(void *) = nullptr;
+    void *data = nullptr;
+};
+
+/* Runs 'f()' on a new thread, the future gets what it returns */
+template <class F>
+future<std::invoke_result_t<std::decay_t<F>>>
+async(F &&f)
+{
+    using Fn = std::decay_t<F>;
+    using T = std::invoke_result_t<Fn>;
+    using State = detail::async_state<Fn, T>;
+    detail::async_source<F> source = { std::addressof(f), nullptr };
+    future<T> result;
+    State *state;
+
+    result.handle = detail::create<State>(detail::run_async<Fn, T>,
+            detail::construct_async<Fn, T, F>, &source);
+    state = static_cast<State *>(source.storage);
+    result.data = state;
+    result.status = &state->status;
+    result.take_value = [](void *p) -> typename future<T>::value_type {
+        return std::move(*static_cast<State *>(p)->value);
+    };
+    result.take_error = [](void *p) { return static_cast<State *>(p)->error; };
+    return result;
+}
+
+/* Exclusive side of an lthread_rwlock, for std::lock_guard and
+ * std::unique_lock
+ */
+class mutex {
+public:
+    mutex() noexcept { lthread_rwlock_init(&rw); }
+    mutex(const mutex &) = delete;
+    mutex &operator=(const mutex &) = delete;
+
+    void lock() noexcept { lthread_rwlock_wrlock(&rw); }
+    void unlock() noexcept { lthread_rwlock_unlock(&rw); }
+
+private:
+    struct lthread_rwlock rw;
+};
+
+/* An lthread_rwlock, also usable with std::shared_lock */
+class shared_mutex {
+public:
+    shared_mutex() noexcept { lthread_rwlock_init(&rw); }
+    shared_mutex(const shared_mutex &) = delete;
+    shared_mutex &operator=(const shared_mutex &) = delete;
+
+    void lock() noexcept { lthread_rwlock_wrlock(&rw); }
+    void unlock() noexcept { lthread_rwlock_unlock(&rw); }
+    void lock_shared() noexcept { lthread_rwlock_rdlock(&rw); }
+    void unlock_shared() noexcept { lthread_rwlock_unlock(&rw); }
+
+private:
+    struct lthread_rwlock rw;
+};
+
+/* Holding this keeps every other lthread from running, the scoped form
+ * of LTHREAD_SAFE: std::lock_guard<lthreads::no_preempt> guard(np);
+ */
+class no_preempt {
+public:
+    void lock() noexcept { lthread_block(); }
+    void unlock() noexcept { lthread_unblock(); }
+};
+
+} /* namespace lthreads */
+
+#endif
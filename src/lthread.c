@@ -2,35 +2,119 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <setjmp.h>
 #include <stdint.h>
+#include <limits.h>
 #include <assert.h>
+#include <dlfcn.h>
+#include <errno.h>
 #include <string.h>
 #include <time.h>
 
 #include <unistd.h>
 #include <signal.h>
 #include <ucontext.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 #include <sys/mman.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #ifdef LTHREAD_DEBUG
 #include <valgrind/valgrind.h>
 #endif
 
+/* The following LTHREAD_* settings are only defaults, lthread_init_ex()
+ * and the environment variables it reads can override them at run time
+ */
 #ifndef LTHREAD_ALARM_INTERVAL_NS
 #define LTHREAD_ALARM_INTERVAL_NS 500000/*(500000)*/
 #endif 
 
 #define NSEC_PER_SEC (1000000000)
-#define LTHREAD_ALARM_INTERVAL_PART_NS ((LTHREAD_ALARM_INTERVAL_NS) % NSEC_PER_SEC)
-#define LTHREAD_ALARM_INTERVAL_PART_S ((LTHREAD_ALARM_INTERVAL_NS) / NSEC_PER_SEC)
 
 #ifndef LTHREAD_STACK_SIZE
 #define LTHREAD_STACK_SIZE (2 * 1024 * 1024) /* 2MB */
 #endif
 
+/* Number of stacks reserved up front in one arena by lthread_init(),
+ * 0 gives every thread its own mapping instead
+ *
+ * The arena is backed by transparent huge pages, or explicit ones with
+ * LTHREAD_STACK_ARENA_HUGETLB. A huge page is faulted in as a whole, so
+ * pair this with a small LTHREAD_STACK_SIZE to pack many stacks per page
+ */
+#ifndef LTHREAD_STACK_ARENA
+#define LTHREAD_STACK_ARENA 0
+#endif
+
+/* Alignment of the stack arena, the huge page size */
+#ifndef LTHREAD_STACK_ARENA_ALIGN
+#define LTHREAD_STACK_ARENA_ALIGN (2 * 1024 * 1024) /* 2MB */
+#endif
+
+/* Size of each lthread's log ring buffer, must be a power of 2 */
+#ifndef LTHREAD_LOG_BUFFER_SIZE
+#define LTHREAD_LOG_BUFFER_SIZE (16 * 1024) /* 16KB */
+#endif
+
+/* Longest formatted log message, longer ones are truncated */
+#ifndef LTHREAD_LOG_LINE_MAX
+#define LTHREAD_LOG_LINE_MAX 512
+#endif
+
+/* How often the log flusher writes out buffered messages */
+#ifndef LTHREAD_LOG_FLUSH_MS
+#define LTHREAD_LOG_FLUSH_MS 10
+#endif
+
+/* Most buffers the flusher hands to one writev call */
+#ifndef LTHREAD_LOG_IOVECS
+#define LTHREAD_LOG_IOVECS 64
+#endif
+
+/* Most frames kept in one profiler sample, including the interrupted one */
+#ifndef LTHREAD_PROFILE_DEPTH
+#define LTHREAD_PROFILE_DEPTH 32
+#endif
+
+/* Most frames lthread_dump writes for one thread */
+#ifndef LTHREAD_DUMP_DEPTH
+#define LTHREAD_DUMP_DEPTH 16
+#endif
+
+/* Deadlines of lthread_sleep_until are rounded up to a multiple of this,
+ * so threads sleeping until nearby times wake in the same scheduler pass.
+ * Changed at run time with lthread_set_timer_slack()
+ */
+#ifndef LTHREAD_TIMER_SLACK_NS
+#define LTHREAD_TIMER_SLACK_NS 0
+#endif
+
+/* Call sites of lthread_block tracked with LTHREAD_HOLD_PROFILE, must be
+ * a power of 2
+ */
+#ifndef LTHREAD_HOLD_SITES
+#define LTHREAD_HOLD_SITES 256
+#endif
+
+/* Buckets in each hold time histogram, bucket ii counts holds shorter
+ * than 2^ii microseconds and the last one everything longer
+ */
+#define LTHREAD_HOLD_BUCKETS 16
+
+/* Number of wait queues lthread_wait_on addresses are hashed into */
+#ifndef LTHREAD_WAIT_BUCKETS
+#define LTHREAD_WAIT_BUCKETS 256
+#endif
+
+/* Deferred frees between attempts to advance the global epoch */
+#ifndef LTHREAD_EPOCH_RECLAIM
+#define LTHREAD_EPOCH_RECLAIM 32
+#endif
+
 #ifndef LTHREAD_MAIN_THREAD
 #define LTHREAD_MAIN_THREAD 1000000
 #endif
@@ -47,6 +131,14 @@
 #define LTHREAD_SIG (SIGRTMIN)
 #endif
 
+/* Smallest stack lthread_init_ex() accepts */
+#define LTHREAD_STACK_MIN (16 * 1024) /* 16KB */
+
+/* Older C libraries don't name the thread ID member */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
 #ifdef LTHREAD_DEBUG_SIGNAL_BLOCKING
 #define UNBLOCK_SIGNAL() do { \
     sigprocmask(SIG_UNBLOCK, &lthread_sig_mask, NULL); \
@@ -93,9 +185,381 @@ void start_thread(
         void *stack
         );
 
+/* Round-robin: every thread gets a turn in queue order */
+static struct lthread_info *
+round_robin_pick_next(struct lthread_info *current)
+{
+    return current->next;
+}
+
+const struct lthread_sched_ops lthread_sched_round_robin = {
+    .name = "round-robin",
+    .pick_next = round_robin_pick_next,
+};
+
+/* LIFO wake affinity: the most recently woken thread runs next, while
+ * whatever it was woken for is likely still in cache. Threads nobody
+ * woke are served round-robin
+ */
+static struct lthread_info *lifo_woken = NULL;
+
+static void
+lifo_push(struct lthread_info *t)
+{
+    if (!t->sched_queued) {
+        t->sched_queued = 1;
+        t->sched_link = lifo_woken;
+        lifo_woken = t;
+    }
+}
+
+static void
+lifo_remove(struct lthread_info *t)
+{
+    struct lthread_info **curr = &lifo_woken;
+    if (!t->sched_queued) {
+        return;
+    }
+    while (*curr != t) {
+        curr = &(*curr)->sched_link;
+    }
+    *curr = t->sched_link;
+    t->sched_queued = 0;
+}
+
+static struct lthread_info *
+lifo_pick_next(struct lthread_info *current)
+{
+    struct lthread_info *t;
+    while (lifo_woken != NULL) {
+        t = lifo_woken;
+        lifo_woken = t->sched_link;
+        t->sched_queued = 0;
+        if (t != current && t->status == READY) {
+            return t;
+        }
+    }
+    return current->next;
+}
+
+const struct lthread_sched_ops lthread_sched_lifo = {
+    .name = "lifo-wake-affinity",
+    .enqueue = lifo_push,
+    .dequeue = lifo_remove,
+    .pick_next = lifo_pick_next,
+    .on_wake = lifo_push,
+};
+
+/* Register only context switching for LTHREAD_INTEGER_ONLY threads */
+int lthread_save_regs(void *regs[8]) __attribute__((returns_twice));
+void lthread_restore_regs(void *regs[8]) __attribute__((noreturn));
+
+static int64_t lthread_now_ns(void);
+static int64_t timespec_to_ns(const struct timespec *ts);
+static struct timespec ns_to_timespec(int64_t ns);
+#ifdef LTHREAD_HOLD_PROFILE
+static void hold_write_report(FILE *out);
+#endif
+static void queue_reap(struct lthread_info *t);
+static int64_t pass_clock(void);
+
 /* Queue used for scheduling */
 static struct lthread_info *head = NULL;
 static struct lthread_info *tail = NULL;
+static size_t queue_length = 0;
+
+/* Fair share: groups are picked by lowest weighted run time, and the
+ * runnable threads of a group are kept in their own ring through
+ * group_next so a turn is O(1) however many threads there are. Threads
+ * only the scheduler can wake, sleepers, wait in fair_sleepers and are
+ * offered to it once their wake time passes
+ */
+static struct lthread_group default_group = {
+    .weight = LTHREAD_GROUP_WEIGHT_DEFAULT,
+};
+static struct lthread_group *fair_groups = &default_group;
+static struct lthread_info *fair_sleepers = NULL;
+static int64_t fair_next_wake = INT64_MAX;
+/* Time up to which run time was charged to a group */
+static int64_t fair_charged = 0;
+/* Last thread offered to the scheduler, if it is offered again the
+ * thread couldn't run and the queue order is used instead
+ */
+static struct lthread_info *fair_last_pick = NULL;
+
+static struct lthread_group *
+fair_group(struct lthread_info *t)
+{
+    return t->group != NULL ? t->group : &default_group;
+}
+
+/* Charges the time since the last charge to running thread 't' */
+static void
+fair_charge(struct lthread_info *t)
+{
+    struct lthread_group *g = fair_group(t);
+    int64_t now = pass_clock(), ran = fair_charged != 0 ? now - fair_charged : 0;
+
+    fair_charged = now;
+    fair_last_pick = NULL;
+    if (ran <= 0) {
+        return;
+    }
+    g->vruntime += ran * LTHREAD_GROUP_WEIGHT_DEFAULT / g->weight;
+    g->stats.run_time = ns_to_timespec(timespec_to_ns(&g->stats.run_time) + ran);
+}
+
+/* Adds 't' to the runnable ring of its group */
+static void
+fair_ring_add(struct lthread_info *t)
+{
+    struct lthread_group *g = fair_group(t), *other;
+    long long min_vruntime = LLONG_MAX;
+
+    if (t->group_next != NULL) {
+        return;
+    }
+
+    if (g->cursor == NULL) {
+        /* An idle group doesn't get to catch up on the time it was
+         * idle for, it starts level with the busy groups */
+        for (other = fair_groups; other != NULL; other = other->next) {
+            if (other->cursor != NULL && other->vruntime < min_vruntime) {
+                min_vruntime = other->vruntime;
+            }
+        }
+        if (min_vruntime != LLONG_MAX && g->vruntime < min_vruntime) {
+            g->vruntime = min_vruntime;
+        }
+        t->group_next = t->group_prev = t;
+        g->cursor = t;
+    }
+    else {
+        /* Goes last, just before the thread whose turn is next */
+        t->group_next = g->cursor;
+        t->group_prev = g->cursor->group_prev;
+        t->group_prev->group_next = t;
+        g->cursor->group_prev = t;
+    }
+    g->stats.runnable++;
+}
+
+static void
+fair_ring_remove(struct lthread_info *t)
+{
+    struct lthread_group *g = fair_group(t);
+
+    if (t->group_next == NULL) {
+        return;
+    }
+    if (t->group_next == t) {
+        g->cursor = NULL;
+    }
+    else {
+        if (g->cursor == t) {
+            g->cursor = t->group_next;
+        }
+        t->group_prev->group_next = t->group_next;
+        t->group_next->group_prev = t->group_prev;
+    }
+    t->group_next = t->group_prev = NULL;
+    g->stats.runnable--;
+}
+
+static void
+fair_sleeper_remove(struct lthread_info *t)
+{
+    struct lthread_info **curr = &fair_sleepers;
+    if (!t->sched_queued) {
+        return;
+    }
+    while (*curr != t) {
+        curr = &(*curr)->sched_link;
+    }
+    *curr = t->sched_link;
+    t->sched_queued = 0;
+}
+
+static void
+fair_enqueue(struct lthread_info *t)
+{
+    if (t->status == SLEEPING || t->status == BLOCKED) {
+        return;
+    }
+    fair_ring_add(t);
+}
+
+static void
+fair_dequeue(struct lthread_info *t)
+{
+    if (t == head) {
+        fair_charge(t);
+    }
+    fair_ring_remove(t);
+    fair_sleeper_remove(t);
+}
+
+static void
+fair_on_tick(struct lthread_info *t)
+{
+    fair_charge(t);
+    fair_group(t)->stats.ticks++;
+}
+
+static void
+fair_on_block(struct lthread_info *t)
+{
+    int64_t wake;
+
+    fair_charge(t);
+    fair_ring_remove(t);
+    if (t->status == SLEEPING && !t->sched_queued) {
+        wake = timespec_to_ns(&t->wake_time);
+        if (wake < fair_next_wake) {
+            fair_next_wake = wake;
+        }
+        t->sched_queued = 1;
+        t->sched_link = fair_sleepers;
+        fair_sleepers = t;
+    }
+}
+
+static void
+fair_on_wake(struct lthread_info *t)
+{
+    fair_sleeper_remove(t);
+    fair_ring_add(t);
+}
+
+/* Returns a sleeper whose wake time passed, NULL if there is none */
+static struct lthread_info *
+fair_due_sleeper(void)
+{
+    struct lthread_info *t, *due = NULL;
+    int64_t now, wake;
+
+    if (fair_sleepers == NULL || pass_clock() < fair_next_wake) {
+        return NULL;
+    }
+
+    now = pass_clock();
+    fair_next_wake = INT64_MAX;
+    for (t = fair_sleepers; t != NULL; t = t->sched_link) {
+        wake = timespec_to_ns(&t->wake_time);
+        if (due == NULL && wake <= now) {
+            due = t;
+        }
+        else if (wake < fair_next_wake) {
+            fair_next_wake = wake;
+        }
+    }
+    return due;
+}
+
+static struct lthread_info *
+fair_pick_next(struct lthread_info *current)
+{
+    struct lthread_group *g, *best = NULL;
+    struct lthread_info *t;
+
+    /* The last pick couldn't run after all, go around the queue */
+    if (current == fair_last_pick) {
+        fair_last_pick = current->next;
+        return current->next;
+    }
+
+    /* Woken sleepers run first, the scheduler wakes them when offered */
+    t = fair_due_sleeper();
+    if (t == NULL) {
+        for (g = fair_groups; g != NULL; g = g->next) {
+            if (g->cursor != NULL && (best == NULL || g->vruntime < best->vruntime)) {
+                best = g;
+            }
+        }
+        if (best == NULL) {
+            /* Nothing is runnable */
+            return current->next;
+        }
+        t = best->cursor;
+        best->cursor = t->group_next;
+        best->stats.picks++;
+    }
+    fair_last_pick = t;
+    return t;
+}
+
+const struct lthread_sched_ops lthread_sched_fair = {
+    .name = "fair-share",
+    .enqueue = fair_enqueue,
+    .dequeue = fair_dequeue,
+    .pick_next = fair_pick_next,
+    .on_yield = fair_charge,
+    .on_block = fair_on_block,
+    .on_wake = fair_on_wake,
+    .on_tick = fair_on_tick,
+};
+
+/* Puts new thread 't' in group 'g', NULL being the default group */
+static void
+group_join(struct lthread_info *t, struct lthread_group *g)
+{
+    t->group = g;
+    fair_group(t)->stats.threads++;
+}
+
+/* Time on the scheduling clock read once per scheduler pass, 0 until needed */
+static int64_t pass_now = 0;
+
+/* Current rounding of sleep deadlines */
+static int64_t timer_slack_ns = LTHREAD_TIMER_SLACK_NS;
+
+/* Settings chosen by lthread_init_ex(), fixed after it returns except
+ * for the quantum
+ */
+static int64_t quantum_ns = LTHREAD_ALARM_INTERVAL_NS;
+static size_t lthread_stack_size = LTHREAD_STACK_SIZE;
+static clockid_t lthread_clockid = LTHREAD_CLOCKID;
+static int lthread_sig;
+
+/* Policy deciding which thread in the queue runs next */
+static const struct lthread_sched_ops *sched = &lthread_sched_round_robin;
+
+/* Set by lthread_yield so the scheduler can tell a yield from a tick */
+static volatile sig_atomic_t yielding = 0;
+
+/* Depth of lthread_preempt_disable calls, and whether a tick came in
+ * while it was non-zero. Per OS thread, the count of the scheduling
+ * thread belongs to whichever lthread is running
+ */
+static __thread volatile sig_atomic_t preempt_count = 0;
+static __thread volatile sig_atomic_t preempt_deferred = 0;
+
+/* Where the report goes when lthread_dump_on_signal's signal arrives,
+ * and whether it came in while the scheduler was changing its lists,
+ * leaving the report to the scheduler
+ */
+static int dump_fd = -1;
+static volatile sig_atomic_t dump_pending = 0;
+
+/* Earliest-deadline-first scheduling state of a real-time lthread,
+ * all times are nanoseconds of the scheduling clock
+ */
+struct lthread_rt_info {
+    int64_t period; /* Time between releases */
+    int64_t deadline; /* Deadline relative to each release */
+    int64_t runtime; /* Run time budget per period, 0 if unlimited */
+    int64_t release; /* Start of the current job */
+    int64_t abs_deadline; /* Absolute deadline of the current job */
+    int64_t budget_start; /* Start of the current budget period */
+    int64_t budget_used; /* Run time consumed in the budget period */
+    int64_t run_start; /* When the thread was last switched in */
+    struct lthread_rt_stats stats; /* Reported by lthread_get_rt_stats */
+    struct lthread_info *thread; /* Thread these parameters belong to */
+    struct lthread_rt_info *next; /* Next real-time thread */
+};
+
+/* All real-time threads, these are considered ahead of the queue */
+static struct lthread_rt_info *rt_threads = NULL;
 
 /* Array used to store threads for return codes */
 static struct lthread_info **lthreads = NULL;
@@ -107,6 +571,182 @@ static timer_t lthread_timer;
 /* Mask containing scheduling signal */
 static sigset_t lthread_sig_mask;
 
+/* OS thread running the scheduler, target of the scheduling signal */
+static pthread_t lthread_sched_thread;
+
+/* Work handed to the scheduler from other OS threads */
+struct lthread_remote_req {
+    void *(*start_routine)(void *); /* Entry point of a new thread, NULL
+                                       if this is a wake request */
+    void *data; /* Data passed to new thread */
+    lthread target; /* Thread to wake */
+    lthread *handle; /* Where the new thread's handle goes */
+    sem_t *created; /* Posted once 'handle' is set, NULL if detached */
+    struct lthread_remote_req *next; /* Next request in the inbox */
+};
+
+/* Lock-free stack of requests pushed by other OS threads, only the
+ * scheduler ever takes from it
+ */
+static struct lthread_remote_req *remote_inbox = NULL;
+
+/* Detached threads that finished, freed by the next scheduler pass
+ * once nothing is running on their stacks
+ */
+static struct lthread_info *reap_list = NULL;
+
+/* Single producer, single consumer ring of log messages. Only the
+ * owning lthread writes to it and only the flusher reads from it
+ */
+struct lthread_log_buffer {
+    char data[LTHREAD_LOG_BUFFER_SIZE]; /* Formatted messages */
+    size_t head; /* Total bytes ever written by the owner */
+    size_t tail; /* Total bytes ever written out by the flusher */
+    size_t dropped; /* Messages that didn't fit */
+    size_t dropped_reported; /* Part of 'dropped' the flusher wrote out */
+    int orphaned; /* Owner is gone, free once drained */
+    struct lthread_log_buffer *next; /* Next buffer known to the flusher */
+};
+
+/* Every log buffer, newest first */
+static struct lthread_log_buffer *log_buffers = NULL;
+/* Where log messages go, -1 while logging is off */
+static int log_fd = -1;
+/* Thread writing out log buffers and whether it should keep going */
+static lthread log_flusher;
+static volatile int log_running = 0;
+
+/* One backtrace taken by the profiler on a scheduler tick */
+struct lthread_profile_sample {
+    size_t id; /* Thread that was interrupted */
+    size_t depth; /* Frames in 'pcs' */
+    void *pcs[LTHREAD_PROFILE_DEPTH]; /* Interrupted PC, then return addresses */
+};
+
+/* Profiler samples, NULL if the profiler was never started */
+static struct lthread_profile_sample *profile_samples = NULL;
+static size_t profile_max = 0;
+static size_t profile_count = 0;
+static size_t profile_dropped = 0;
+static volatile int profile_running = 0;
+/* Stack of the thread that called lthread_init(), for backtraces */
+static char *main_stack_lo = NULL;
+static char *main_stack_hi = NULL;
+
+/* Stack every LTHREAD_COPY_STACK thread runs on, and the thread whose
+ * frames are on it right now. Those of the others are saved on the heap
+ */
+static char *copy_stack = NULL;
+static struct lthread_info *copy_stack_owner = NULL;
+/* Swaps frames on the shared stack while running on a stack of its own */
+static char *copy_switch_stack = NULL;
+static ucontext_t copy_switch_context;
+static struct lthread_info *copy_switch_to = NULL;
+
+/* A thread parked on an rwlock, lives on its stack, see waiter_record() */
+struct lthread_rwlock_waiter {
+    struct lthread_info *thread; /* Parked thread */
+    int writer; /* Waiting to write instead of read */
+    int granted; /* The lock was handed to this waiter */
+    struct lthread_rwlock_waiter *next; /* Next thread in line */
+};
+
+#ifdef LTHREAD_HOLD_PROFILE
+/* Hold times of lthread_block/lthread_unblock pairs from one call site */
+struct lthread_hold_site {
+    void *site; /* Return address of the lthread_block call */
+    size_t count; /* Pairs seen */
+    int64_t total_ns; /* Time spent blocked */
+    int64_t max_ns; /* Longest single hold */
+    size_t deferred_ticks; /* Timer ticks that had to wait for the unblock */
+    size_t histogram[LTHREAD_HOLD_BUCKETS];
+};
+
+/* Open addressed by call site */
+static struct lthread_hold_site hold_sites[LTHREAD_HOLD_SITES];
+/* Set while lthread_unblock delivers ticks that were held back */
+static struct lthread_hold_site *volatile hold_unblocking = NULL;
+#endif
+
+/* A thread in lthread_wait_on, lives on its stack, see waiter_record() */
+struct lthread_addr_waiter {
+    const volatile int *addr; /* Address waited on */
+    struct lthread_info *thread; /* Waiting thread */
+    int woken; /* Woken by lthread_wake rather than a timeout */
+    struct lthread_addr_waiter *next; /* Next waiter in the bucket */
+    struct lthread_addr_waiter *prev; /* Previous waiter in the bucket */
+};
+
+/* Room for any waiter entry, a thread is in one wait at a time */
+union lthread_waiter_record {
+    struct lthread_addr_waiter addr;
+    struct lthread_rwlock_waiter rw;
+};
+
+/* Threads in lthread_wait_on, by address. Each bucket is in the order
+ * the threads started waiting
+ */
+static struct {
+    struct lthread_addr_waiter *head;
+    struct lthread_addr_waiter *tail;
+} wait_buckets[LTHREAD_WAIT_BUCKETS];
+
+/* Returns where the running thread's waiter entry goes, 'local' on its
+ * own stack unless it is an LTHREAD_COPY_STACK thread. Those are woken
+ * by other threads while their frames are off the stack, so theirs is
+ * kept on the heap. Must be called with the scheduling signal blocked
+ */
+static void *
+waiter_record(void *local)
+{
+    if (!(head->flags & LTHREAD_COPY_STACK)) {
+        return local;
+    }
+    if (head->wait_record == NULL) {
+        head->wait_record = malloc(sizeof(union lthread_waiter_record));
+        if (head->wait_record == NULL) {
+            perror("Failed to allocate waiter");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return head->wait_record;
+}
+
+/* Something handed to lthread_defer_free, waiting for readers to leave */
+struct lthread_deferred {
+    void *ptr;
+    void (*destroy)(void *ptr);
+    struct lthread_deferred *next;
+};
+
+/* Epoch that sections entered now are stamped with */
+static volatile size_t global_epoch = 0;
+/* Deferred frees by the epoch they were deferred in, modulo 3. Those
+ * from two epochs ago are safe to free
+ */
+static struct lthread_deferred *limbo[3] = { NULL, NULL, NULL };
+/* Deferred frees since the last attempt to advance the epoch */
+static size_t epoch_deferred = 0;
+
+/* The thread that called lthread_init(), not in the lthreads table */
+static struct lthread_info *main_thread = NULL;
+
+/* Thread structures made together by lthread_create_n, freed with
+ * the last of them
+ */
+struct lthread_slab {
+    size_t refs; /* Threads not freed yet */
+    struct lthread_info threads[];
+};
+
+/* Arena stacks are carved from, NULL if not in use */
+static char *stack_arena = NULL;
+static size_t stack_arena_size = 0;
+/* Stacks never handed out so far */
+static size_t stack_arena_unused = 0;
+/* Released stacks, linked through their first word */
+static void *stack_arena_free = NULL;
+
 /* Places thread 't' at the front of the queue */
 static void
 push_queue(struct lthread_info *t)
@@ -115,8 +755,11 @@ push_queue(struct lthread_info *t)
      * thread is always running after lthread_init()
      */
     t->next = head;
+    t->prev = tail;
     tail->next = t;
+    head->prev = t;
     tail = t;
+    queue_length++;
 }
 
 /* Initializes the queue with a main thread */
@@ -124,7 +767,8 @@ static void
 init_queue(struct lthread_info *main_thread)
 {
     /* Main thread is always running, and initializes queue */
-    head = tail = main_thread->next = main_thread;
+    head = tail = main_thread->next = main_thread->prev = main_thread;
+    queue_length = 1;
 }
 
 /* Removes the first element from the queue */
@@ -135,7 +779,61 @@ pop_queue(void)
      * should always be running
      */
     tail->next = head->next;
+    head->next->prev = tail;
     head = head->next;
+    queue_length--;
+}
+
+/* Moves thread 't' so that it directly follows the front of the
+ * queue, the next bump_queue() will make it the front
+ */
+static void
+queue_move_next(struct lthread_info *t)
+{
+    /* Unlink from current position */
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    if (tail == t) {
+        tail = t->prev;
+    }
+
+    /* Insert after the front */
+    t->next = head->next;
+    t->prev = head;
+    head->next->prev = t;
+    head->next = t;
+    if (tail == head) {
+        tail = t;
+    }
+}
+
+/* Puts thread 't' in the place of the front of the queue, which
+ * leaves the queue
+ */
+static void
+queue_swap_front(struct lthread_info *t)
+{
+    struct lthread_info *old = head;
+
+    if (sched->dequeue != NULL) {
+        sched->dequeue(old);
+    }
+
+    if (old->next == old) {
+        t->next = t->prev = t;
+    }
+    else {
+        t->next = old->next;
+        t->prev = old->prev;
+        old->prev->next = t;
+        old->next->prev = t;
+    }
+    head = t;
+    tail = t->prev;
+
+    if (sched->enqueue != NULL) {
+        sched->enqueue(t);
+    }
 }
 
 /* Bumps tail and start forward 1, if 'rem' is non-zero
@@ -156,10 +854,11 @@ bump_queue(int rem)
 
 /* Gets an index that can be used to store the value of
  * the lthread structure for a thread so it may persist
- * after being de-scheduled
+ * after being de-scheduled. Only slots from 'start' on are
+ * looked at, callers taking many at once pass the last one + 1
  */
 static size_t
-allocate_lthread(void)
+allocate_lthread_from(size_t start)
 {
     size_t old_size, ii;
     if (lthreads == NULL) {
@@ -168,7 +867,7 @@ allocate_lthread(void)
     }
 
     /* Search for open return code slot */
-    for (ii = 0; ii < nlthreads; ii++) {
+    for (ii = start; ii < nlthreads; ii++) {
         if (lthreads[ii] == NULL) {
             return ii;
         }
@@ -185,6 +884,12 @@ allocate_lthread(void)
     return old_size;
 }
 
+static size_t
+allocate_lthread(void)
+{
+    return allocate_lthread_from(0);
+}
+
 
 /* Uses the provided index to "free" the entry used so it 
  * may be used for another thread
@@ -195,419 +900,3725 @@ deallocate_lthread(size_t id)
     lthreads[id] = NULL;
 }
 
-/* Entry point for new thread
+/* Parks the currently executing thread, it will not be scheduled
+ * again until wake_lthread() is called on it. The scheduling signal
+ * must be blocked by the caller, it is blocked again upon return
+ *
+ * Callers should re-check whatever they are waiting for after this
+ * returns
  */
-extern void
-lthread_run(int id)
+static void
+park_lthread(void)
 {
-#ifdef LTHREAD_DEBUG
-    printf("LTHREAD: Starting lthread!\n");
-#endif
+    head->status = BLOCKED;
+    /* Signal stays pending until it is unblocked below */
+    raise(lthread_sig);
     UNBLOCK_SIGNAL();
-    struct lthread_info *me = lthreads[id];
-    me->status = RUNNING;
-    me->data = me->start_routine(me->data);
-    me->status = DONE;
-#ifdef LTHREAD_DEBUG
-    printf("LTHREAD: Thread finished\n");
-#endif
-    for (;;) raise(LTHREAD_SIG);
+    BLOCK_SIGNAL();
 }
 
-/* Handles freeing resources held by thread
+/* Like park_lthread(), but the thread is also made runnable again
+ * once the scheduling clock passes 'deadline'. Wake it early with
+ * wake_sleeping_lthread()
  */
 static void
-free_lthread(struct lthread_info *t)
+park_lthread_until(int64_t deadline)
 {
-#ifdef LTHREAD_DEBUG
-    VALGRIND_STACK_DEREGISTER(t->stack_reg);
-#endif
-    munmap(t->stack, LTHREAD_STACK_SIZE);
-    free(t);
+    head->wake_time = ns_to_timespec(deadline);
+    head->status = SLEEPING;
+    /* Signal stays pending until it is unblocked below */
+    raise(lthread_sig);
+    UNBLOCK_SIGNAL();
+    BLOCK_SIGNAL();
 }
 
-/* TODO: Is this function needed anymore? */
-/* Returns the pointer to the start of the upwards growing stack
- * for thread 't'
+/* Makes a thread parked by park_lthread() runnable again, must
+ * be called with the scheduling signal blocked
  */
-static void *
-lthread_stack_start(struct lthread_info *t)
+static void
+wake_lthread(struct lthread_info *t)
 {
-    /* Everyone knows stacks grow upward :) */
-    return (void*)( ((char*)t->stack) + LTHREAD_STACK_SIZE );
+    if (t != NULL && t->status == BLOCKED) {
+        t->status = READY;
+        if (sched->on_wake != NULL) {
+            sched->on_wake(t);
+        }
+    }
 }
 
-/* Returns non-zero if the specified thread's wake time is
- * before the current time
+/* Makes a sleeping thread whose wake time passed runnable again */
+static void
+wake_sleeping_lthread(struct lthread_info *t)
+{
+    memset(&t->wake_time, 0, sizeof(t->wake_time));
+    t->status = READY;
+    if (sched->on_wake != NULL) {
+        sched->on_wake(t);
+    }
+}
+
+/* Makes a thread parked by park_lthread() or park_lthread_until()
+ * runnable again, must be called with the scheduling signal blocked
  */
-static int
-lthread_done_sleeping(struct lthread_info *t)
+static void
+wake_parked_lthread(struct lthread_info *t)
 {
-    struct timespec curr;
-    int done;
-    if (clock_gettime(LTHREAD_CLOCKID, &curr)) {
-        perror("Failed to get current clock time");
-        exit(EXIT_FAILURE);
+    if (t != NULL && t->status == SLEEPING) {
+        wake_sleeping_lthread(t);
+    }
+    else {
+        wake_lthread(t);
     }
-    done = (curr.tv_sec > t->wake_time.tv_sec) ||
-        ( (curr.tv_sec == t->wake_time.tv_sec) && 
-          (curr.tv_nsec >= t->wake_time.tv_nsec) );
-    return done;
 }
 
-/* TODO: Is this function really needed anymore */
-/* Conditionally starts and stops the timer whose expiration
- * sends a signal to the process therebye invoking the scheduler
+/* Returns non-zero if the calling thread has to act on a cancel */
+static inline int
+cancel_requested(void)
+{
+    return head->cancel_pending && head->cancel_state == LTHREAD_CANCEL_ENABLE;
+}
+
+/* Finishes the calling thread if it was canceled. May be called with
+ * the scheduling signal blocked, the thread doesn't come back then
+ */
+static inline void
+cancel_point(void)
+{
+    if (cancel_requested()) {
+        lthread_exit(LTHREAD_CANCELED);
+    }
+}
+
+/* Makes 'next' the front of the queue, first removing the current
+ * front if 'remove_front' is non-zero
  */
 static void
-change_alarm(int turn_on)
+queue_advance(struct lthread_info *next, int remove_front)
 {
-    /* The on structure starts with the default scheduling parameters */
-    static struct itimerspec on = {
-        .it_interval = {
-            .tv_sec = LTHREAD_ALARM_INTERVAL_PART_S,
-            .tv_nsec = LTHREAD_ALARM_INTERVAL_PART_NS,
-        },
-        .it_value = {
-            .tv_sec = LTHREAD_ALARM_INTERVAL_PART_S,
-            .tv_nsec = LTHREAD_ALARM_INTERVAL_PART_NS,
-        },
-    };
-    /* The off structure is just all 0s */
-    static struct itimerspec off = {
-        .it_interval = {
-            .tv_sec = 0,
-            .tv_nsec = 0,
-        },
-        .it_value = {
-            .tv_sec = 0,
-            .tv_nsec = 0,
-        },
-    };
+    if (next == head) {
+        if (!remove_front) {
+            return;
+        }
+        /* The front is leaving, can't stay on it */
+        next = head->next;
+    }
 
-    if (turn_on) {
-        /* TODO: off structure might be populated with garbage
-         * that was the old configuration of the timer when this
-         * is first called */
-        /* Turn the timer on */
-        timer_settime(lthread_timer, 0, &on, &off);
+    if (remove_front && sched->dequeue != NULL) {
+        sched->dequeue(head);
+    }
+
+    if (next != head->next) {
+        queue_move_next(next);
+    }
+    bump_queue(remove_front);
+}
+
+extern void lthread_run(int id);
+
+/* Adds the time 't' ran for up to 'now' to its total */
+static void
+charge_cpu(struct lthread_info *t, int64_t now)
+{
+    if (t->run_since != 0) {
+        t->cpu_ns += now - t->run_since;
+        t->run_since = 0;
+    }
+}
+
+/* Bytes below the saved stack pointer that may still be live, the
+ * x86-64 System V red zone
+ */
+#define LTHREAD_RED_ZONE (128)
+
+/* Saves the frames of the shared stack's owner, puts those of
+ * 'copy_switch_to' back and switches to it. Runs on copy_switch_stack,
+ * it can't copy over the stack it is running on
+ */
+static void
+copy_stack_switch(void)
+{
+    struct lthread_info *t = copy_switch_to, *owner = copy_stack_owner;
+    char *top = copy_stack + lthread_stack_size, *sp;
+    size_t used;
+
+    if (owner != NULL && owner->status != DONE) {
+        sp = (char *)owner->context.uc_mcontext.gregs[REG_RSP] - LTHREAD_RED_ZONE;
+        if (sp < copy_stack) {
+            sp = copy_stack;
+        }
+        used = (size_t)(top - sp);
+        /* Right-sized, but not reallocated for every small change */
+        if (used > owner->stack_copy_cap || used < owner->stack_copy_cap / 4) {
+            owner->stack_copy = realloc(owner->stack_copy, used);
+            if (owner->stack_copy == NULL) {
+                perror("Failed to save stack");
+                exit(EXIT_FAILURE);
+            }
+            owner->stack_copy_cap = used;
+        }
+        memcpy(owner->stack_copy, sp, used);
+        owner->stack_copy_size = used;
+    }
+
+    copy_stack_owner = t;
+    if (t->stack_copy_size == 0) {
+        /* Never ran, its first frame can only be built now */
+        makecontext(&t->context, (void(*)(void))lthread_run, 1, t->id);
     }
     else {
-        /* Turn the timer off */
-        timer_settime(lthread_timer, 0, &off, &on);
+        memcpy(top - t->stack_copy_size, t->stack_copy, t->stack_copy_size);
     }
+    setcontext(&t->context);
 }
 
-/* LTHREAD_SIG signal handler, used to handle the scheduling of
- * threads
+/* Switches to the saved context of 't', first putting its frames back
+ * on the shared stack if it is an LTHREAD_COPY_STACK thread that isn't
+ * there. Must be called with the scheduling signal blocked
  */
 static void
-lthread_alarm_handler(int num)
+resume_lthread(struct lthread_info *t)
 {
-    /* TODO: Is this block needed? */
-    BLOCK_SIGNAL();
-    int remove_front = 0; /* Indicated if the first entry should be removed */
-    (void)num;
+    if ((t->flags & LTHREAD_COPY_STACK) && copy_stack_owner != t) {
+        copy_switch_to = t;
+        copy_switch_context.uc_stack.ss_sp = copy_switch_stack;
+        copy_switch_context.uc_stack.ss_size = lthread_stack_size;
+        copy_switch_context.uc_link = NULL;
+        makecontext(&copy_switch_context, copy_stack_switch, 0);
+        setcontext(&copy_switch_context);
+    }
+    if (t->regs_saved) {
+        lthread_restore_regs(t->regs);
+    }
+    setcontext(&t->context);
+}
+
+/* Switches from the running thread 'from' straight to 't', which must
+ * already be the front of the queue, without going through the
+ * scheduler. Must be called with the scheduling signal blocked, it is
+ * blocked again when 'from' is switched back to
+ */
+static void
+switch_lthread(struct lthread_info *from, struct lthread_info *t)
+{
+    int64_t now = lthread_now_ns();
+
+    charge_cpu(from, now);
+    if (from->status != DONE) {
+        if (from->flags & LTHREAD_INTEGER_ONLY) {
+            lthread_save_regs(from->regs);
+            from->regs_saved = 1;
+        }
+        else if (getcontext(&from->context)) {
+            perror("Failed to get context");
+            exit(EXIT_FAILURE);
+        }
+
+        /* Whoever switches back marks this thread running first */
+        if (from->status == RUNNING) {
+            return;
+        }
+    }
+
+    if (t->rt != NULL) {
+        t->rt->run_start = now;
+    }
+    t->run_since = now;
+    t->status = RUNNING;
+    resume_lthread(t);
+}
+
+/* Tells anyone waiting on thread 't' that it has finished, must
+ * be called with the scheduling signal blocked
+ */
+static void
+notify_lthread_done(struct lthread_info *t)
+{
+    struct lthread_waitset *ws = t->waitset;
+
+    wake_parked_lthread(t->joiner);
+
+    if (ws != NULL) {
+        /* Queue on the wait-set in completion order */
+        t->done_next = NULL;
+        if (ws->done_tail == NULL) {
+            ws->done_head = t;
+        }
+        else {
+            ws->done_tail->done_next = t;
+        }
+        ws->done_tail = t;
+        wake_lthread(ws->waiter);
+    }
+}
 
+/* Marks the calling thread 'me' finished and switches away from it for
+ * good, must be called with the scheduling signal blocked
+ */
+static void __attribute__((noreturn))
+finish_lthread(struct lthread_info *me)
+{
+    me->status = DONE;
+    fair_group(me)->stats.threads--;
+    notify_lthread_done(me);
+    if (me->resumer != NULL) {
+        /* A generator hands control straight back when it finishes */
+        if (me->detached) {
+            queue_reap(me);
+        }
+        queue_swap_front(me->resumer);
+        switch_lthread(me, me->resumer);
+    }
+    UNBLOCK_SIGNAL();
 #ifdef LTHREAD_DEBUG
-    signal_handler_inst++;
+    printf("LTHREAD: Thread finished\n");
 #endif
+    for (;;) raise(lthread_sig);
+}
 
-    /* save current thread execution */
-    if (head->status == DONE) {
-        /* If the entry is done, remove it from scheduling */
-        remove_front = 1;
+/* Entry point for new thread
+ */
+extern void
+lthread_run(int id)
+{
+#ifdef LTHREAD_DEBUG
+    printf("LTHREAD: Starting lthread!\n");
+#endif
+    UNBLOCK_SIGNAL();
+    struct lthread_info *me = lthreads[id];
+    me->status = RUNNING;
+    /* Canceled before it ever ran */
+    cancel_point();
+    me->data = me->start_routine(me->data);
+    BLOCK_SIGNAL();
+    finish_lthread(me);
+}
+
+/* Reserves the stack arena, backed by huge pages where possible. Both
+ * the number of mappings and TLB pressure on switches drop compared
+ * to mapping each stack separately
+ */
+static void
+init_stack_arena(void)
+{
+    void *region;
+    size_t size;
+
+    if (LTHREAD_STACK_ARENA == 0) {
+        return;
+    }
+
+    size = (size_t)LTHREAD_STACK_ARENA * lthread_stack_size;
+
+#ifdef LTHREAD_STACK_ARENA_HUGETLB
+    /* Explicit huge pages, come pre-aligned */
+    region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE | MAP_STACK | MAP_HUGETLB,
+            -1, 0);
+    if (region == MAP_FAILED) {
+        perror("Failed to mmap huge page stack arena");
+        exit(EXIT_FAILURE);
+    }
+    stack_arena = region;
+    stack_arena_size = size;
+#else
+    uintptr_t aligned;
+
+    /* Over-reserve so the arena can start on a huge page boundary */
+    region = mmap(NULL, size + LTHREAD_STACK_ARENA_ALIGN, PROT_READ | PROT_WRITE,
+            MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (region == MAP_FAILED) {
+        perror("Failed to mmap stack arena");
+        exit(EXIT_FAILURE);
+    }
+    aligned = ((uintptr_t)region + LTHREAD_STACK_ARENA_ALIGN - 1) &
+        ~((uintptr_t)LTHREAD_STACK_ARENA_ALIGN - 1);
+
+    /* Give back the unaligned ends */
+    if (aligned != (uintptr_t)region) {
+        munmap(region, aligned - (uintptr_t)region);
+    }
+    munmap((char *)aligned + size,
+            LTHREAD_STACK_ARENA_ALIGN - (aligned - (uintptr_t)region));
+
+    stack_arena = (char *)aligned;
+    stack_arena_size = size;
+
+    /* Transparent huge pages are only a hint */
+    madvise(stack_arena, stack_arena_size, MADV_HUGEPAGE);
+#endif
+    stack_arena_unused = LTHREAD_STACK_ARENA;
+    stack_arena_free = NULL;
+}
+
+/* Returns a stack from the arena, NULL if it has none left */
+static void *
+arena_stack(void)
+{
+    void *stack;
+
+    if (stack_arena_free != NULL) {
+        /* Most recently released first, it's likely still cached */
+        stack = stack_arena_free;
+        stack_arena_free = *(void **)stack;
+        return stack;
+    }
+
+    if (stack_arena_unused > 0) {
+        stack_arena_unused--;
+        return stack_arena + stack_arena_unused * lthread_stack_size;
+    }
+
+    return NULL;
+}
+
+/* Returns a new lthread_stack_size stack, from the arena while it
+ * has space left
+ */
+static void *
+allocate_stack(void)
+{
+    void *stack = arena_stack();
+
+    if (stack != NULL) {
+        return stack;
+    }
+
+    stack = mmap(NULL, lthread_stack_size,
+            PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED) {
+        perror("Failed to mmap stack space for new thread: ");
+        exit(EXIT_FAILURE);
+    }
+    return stack;
+}
+
+/* Releases a stack from allocate_stack() or lthread_create_n(), parts
+ * of a larger mapping can be unmapped on their own
+ */
+static void
+free_stack(void *stack)
+{
+    if ((char *)stack >= stack_arena && (char *)stack < stack_arena + stack_arena_size) {
+        *(void **)stack = stack_arena_free;
+        stack_arena_free = stack;
     }
     else {
-        /* Otherwise, save status for later */
-        if (head->status == RUNNING) {
-            head->status = READY;
+        munmap(stack, lthread_stack_size);
+    }
+}
+
+/* Removes the real-time parameters of thread 't', it becomes
+ * a best-effort thread again
+ */
+static void
+remove_rt_thread(struct lthread_info *t)
+{
+    struct lthread_rt_info **curr = &rt_threads;
+    while (*curr != t->rt) {
+        curr = &(*curr)->next;
+    }
+    *curr = t->rt->next;
+    free(t->rt);
+    t->rt = NULL;
+}
+
+/* Appends 'len' bytes of 'str' to 'out' if there is room, tracking
+ * the position in 'pos'. Always leaves room for a terminating '\0'
+ */
+static void
+format_append(char *out, size_t size, size_t *pos, const char *str, size_t len)
+{
+    while (len-- > 0 && *pos + 1 < size) {
+        out[(*pos)++] = *str++;
+    }
+}
+
+/* Writes 'value' in 'base' to 'out', padded to 'width' with 'pad' */
+static void
+format_unsigned(char *out, size_t size, size_t *pos, unsigned long long value,
+        unsigned int base, int upper, int negative, size_t width, char pad, int left)
+{
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char buf[32];
+    size_t len = 0, total;
+
+    do {
+        buf[sizeof(buf) - ++len] = digits[value % base];
+        value /= base;
+    } while (value != 0);
+
+    total = len + (size_t)negative;
+    if (negative && pad == '0') {
+        format_append(out, size, pos, "-", 1);
+    }
+    while (!left && total < width) {
+        format_append(out, size, pos, &pad, 1);
+        width--;
+    }
+    if (negative && pad != '0') {
+        format_append(out, size, pos, "-", 1);
+    }
+    format_append(out, size, pos, buf + sizeof(buf) - len, len);
+    while (left && total < width) {
+        format_append(out, size, pos, " ", 1);
+        width--;
+    }
+}
+
+/* A small vsnprintf that only does async-signal-safe things. Handles the
+ * '-' and '0' flags, a width, the hh, h, l, ll and z length modifiers
+ * and the d, i, u, x, X, o, p, s, c and % conversions
+ *
+ * returns the length of the string written to 'out'
+ */
+static size_t
+lthread_vformat(char *out, size_t size, const char *fmt, va_list ap)
+{
+    size_t pos = 0, width, len;
+    unsigned long long uvalue;
+    long long svalue;
+    const char *str;
+    int left, length;
+    char pad, c;
+
+    if (size == 0) {
+        return 0;
+    }
+
+    for (; *fmt != '\0'; fmt++) {
+        if (*fmt != '%') {
+            format_append(out, size, &pos, fmt, 1);
+            continue;
         }
 
-        if (getcontext(&head->context)) {
-            perror("Failed to get context");
-            exit(EXIT_FAILURE);
+        /* Flags */
+        left = 0;
+        pad = ' ';
+        for (fmt++; *fmt == '-' || *fmt == '0'; fmt++) {
+            if (*fmt == '-') left = 1;
+            else pad = '0';
+        }
+        if (left) {
+            pad = ' ';
+        }
+
+        /* Width */
+        width = 0;
+        for (; *fmt >= '0' && *fmt <= '9'; fmt++) {
+            width = width * 10 + (size_t)(*fmt - '0');
+        }
+
+        /* Length, counted in 'l's, z is treated like l */
+        length = 0;
+        for (; *fmt == 'l' || *fmt == 'h' || *fmt == 'z'; fmt++) {
+            if (*fmt == 'h') length--;
+            else length++;
+        }
+
+        switch (*fmt) {
+            case 'd':
+            case 'i':
+                if (length >= 2) svalue = va_arg(ap, long long);
+                else if (length == 1) svalue = va_arg(ap, long);
+                else svalue = va_arg(ap, int);
+                if (length == -1) svalue = (short)svalue;
+                if (length <= -2) svalue = (signed char)svalue;
+                uvalue = svalue < 0 ? 0 - (unsigned long long)svalue : (unsigned long long)svalue;
+                format_unsigned(out, size, &pos, uvalue, 10, 0, svalue < 0, width, pad, left);
+                break;
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+                if (length >= 2) uvalue = va_arg(ap, unsigned long long);
+                else if (length == 1) uvalue = va_arg(ap, unsigned long);
+                else uvalue = va_arg(ap, unsigned int);
+                if (length == -1) uvalue = (unsigned short)uvalue;
+                if (length <= -2) uvalue = (unsigned char)uvalue;
+                format_unsigned(out, size, &pos, uvalue,
+                        *fmt == 'u' ? 10 : *fmt == 'o' ? 8 : 16,
+                        *fmt == 'X', 0, width, pad, left);
+                break;
+            case 'p':
+                format_append(out, size, &pos, "0x", 2);
+                format_unsigned(out, size, &pos, (uintptr_t)va_arg(ap, void *),
+                        16, 0, 0, width, pad, left);
+                break;
+            case 's':
+                str = va_arg(ap, const char *);
+                if (str == NULL) {
+                    str = "(null)";
+                }
+                len = strlen(str);
+                while (!left && len < width--) {
+                    format_append(out, size, &pos, " ", 1);
+                }
+                format_append(out, size, &pos, str, len);
+                while (left && len < width--) {
+                    format_append(out, size, &pos, " ", 1);
+                }
+                break;
+            case 'c':
+                c = (char)va_arg(ap, int);
+                format_append(out, size, &pos, &c, 1);
+                break;
+            case '%':
+                format_append(out, size, &pos, "%", 1);
+                break;
+            case '\0':
+                /* Format ended mid conversion */
+                fmt--;
+                break;
+            default:
+                /* Unknown conversion, print it as is */
+                format_append(out, size, &pos, fmt - 1, 2);
+        }
+    }
+
+    out[pos] = '\0';
+    return pos;
+}
+
+/* lthread_vformat taking its arguments directly */
+static size_t __attribute__((format(printf, 3, 4)))
+log_format(char *out, size_t size, const char *fmt, ...)
+{
+    va_list ap;
+    size_t len;
+
+    va_start(ap, fmt);
+    len = lthread_vformat(out, size, fmt, ap);
+    va_end(ap);
+    return len;
+}
+
+/* Writes every buffered log message to the log file with as few
+ * writev calls as possible. Only the flusher, or the process on
+ * exit, may call this
+ */
+static void
+log_flush_buffers(void)
+{
+    struct iovec iov[LTHREAD_LOG_IOVECS];
+    struct lthread_log_buffer *bufs[LTHREAD_LOG_IOVECS];
+    size_t lens[LTHREAD_LOG_IOVECS];
+    struct lthread_log_buffer *buf;
+    size_t niov, nbufs, avail, start, first, dropped, len;
+    char line[64];
+    ssize_t written;
+    int more = 1;
+
+    while (more) {
+        more = 0;
+        niov = 0;
+        nbufs = 0;
+
+        /* Gather up to two pieces of each ring, it may wrap around */
+        buf = __atomic_load_n(&log_buffers, __ATOMIC_ACQUIRE);
+        for (; buf != NULL; buf = buf->next) {
+            avail = __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE) - buf->tail;
+            if (avail == 0) {
+                continue;
+            }
+            if (niov + 2 > LTHREAD_LOG_IOVECS) {
+                more = 1;
+                break;
+            }
+            start = buf->tail & (LTHREAD_LOG_BUFFER_SIZE - 1);
+            first = LTHREAD_LOG_BUFFER_SIZE - start;
+            if (first > avail) {
+                first = avail;
+            }
+            iov[niov].iov_base = buf->data + start;
+            iov[niov++].iov_len = first;
+            if (avail > first) {
+                iov[niov].iov_base = buf->data;
+                iov[niov++].iov_len = avail - first;
+            }
+            lens[nbufs] = avail;
+            bufs[nbufs++] = buf;
+        }
+
+        if (niov == 0) {
+            break;
+        }
+
+        written = writev(log_fd, iov, (int)niov);
+        if (written <= 0) {
+            break;
+        }
+
+        /* Hand space back to the owners, in the order it was written */
+        for (size_t ii = 0; ii < nbufs && written > 0; ii++) {
+            avail = lens[ii];
+            if ((size_t)written < avail) {
+                avail = (size_t)written;
+                more = 1;
+            }
+            __atomic_store_n(&bufs[ii]->tail, bufs[ii]->tail + avail, __ATOMIC_RELEASE);
+            written -= (ssize_t)avail;
+        }
+    }
+
+    /* Then how many messages didn't fit since the last pass */
+    buf = __atomic_load_n(&log_buffers, __ATOMIC_ACQUIRE);
+    for (; buf != NULL; buf = buf->next) {
+        dropped = __atomic_load_n(&buf->dropped, __ATOMIC_RELAXED);
+        if (dropped == buf->dropped_reported) {
+            continue;
+        }
+        len = log_format(line, sizeof(line), "[dropped] %zu\n", dropped - buf->dropped_reported);
+        if (write(log_fd, line, len) == (ssize_t)len) {
+            buf->dropped_reported = dropped;
+        }
+    }
+}
+
+/* Frees log buffers whose owners are gone once they are drained */
+static void
+log_free_orphans(void)
+{
+    struct lthread_log_buffer *buf, **curr;
+
+    /* New buffers are pushed on the front of the list */
+    BLOCK_SIGNAL();
+    curr = &log_buffers;
+    while (*curr != NULL) {
+        buf = *curr;
+        if (buf->orphaned && buf->head == buf->tail) {
+            *curr = buf->next;
+            munmap(buf, sizeof(*buf));
+        }
+        else {
+            curr = &buf->next;
+        }
+    }
+    UNBLOCK_SIGNAL();
+}
+
+/* Log flusher thread, batches every lthread's messages out */
+static void *
+log_flusher_run(void *data)
+{
+    (void)data;
+    while (log_running) {
+        log_flush_buffers();
+        log_free_orphans();
+        lthread_sleep(LTHREAD_LOG_FLUSH_MS);
+    }
+    log_flush_buffers();
+    log_free_orphans();
+    return NULL;
+}
+
+/* Handles freeing resources held by thread
+ */
+static void
+free_lthread(struct lthread_info *t)
+{
+#ifdef LTHREAD_DEBUG
+    VALGRIND_STACK_DEREGISTER(t->stack_reg);
+#endif
+    if (t->flags & LTHREAD_COPY_STACK) {
+        /* The stack is shared, only the saved frames are its own */
+        free(t->stack_copy);
+        free(t->wait_record);
+        if (copy_stack_owner == t) {
+            copy_stack_owner = NULL;
+        }
+    }
+    else {
+        free_stack(t->stack);
+    }
+    if (t->rt != NULL) {
+        remove_rt_thread(t);
+    }
+    if (t->log != NULL) {
+        /* Flusher frees it once its messages are out */
+        t->log->orphaned = 1;
+    }
+    if (t->slab == NULL) {
+        free(t);
+    }
+    else if (--t->slab->refs == 0) {
+        free(t->slab);
+    }
+}
+
+/* TODO: Is this function needed anymore? */
+/* Returns the pointer to the start of the upwards growing stack
+ * for thread 't'
+ */
+static void *
+lthread_stack_start(struct lthread_info *t)
+{
+    /* Everyone knows stacks grow upward :) */
+    return (void*)( ((char*)t->stack) + lthread_stack_size );
+}
+
+/* Returns the time of the current scheduler pass, reading the clock
+ * only for the first thread that needs it
+ */
+static int64_t
+pass_clock(void)
+{
+    if (pass_now == 0) {
+        pass_now = lthread_now_ns();
+    }
+    return pass_now;
+}
+
+/* Returns non-zero if the specified thread's wake time is
+ * before the time of the current scheduler pass
+ */
+static int
+lthread_done_sleeping(struct lthread_info *t)
+{
+    return pass_clock() >= timespec_to_ns(&t->wake_time);
+}
+
+/* Returns the current time of the scheduling clock in nanoseconds */
+static int64_t
+lthread_now_ns(void)
+{
+    struct timespec curr;
+    if (clock_gettime(lthread_clockid, &curr)) {
+        perror("Failed to get current clock time");
+        exit(EXIT_FAILURE);
+    }
+    return (int64_t)curr.tv_sec * NSEC_PER_SEC + curr.tv_nsec;
+}
+
+static int64_t
+timespec_to_ns(const struct timespec *ts)
+{
+    return (int64_t)ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static struct timespec
+ns_to_timespec(int64_t ns)
+{
+    return (struct timespec) {
+        .tv_sec = (time_t)(ns / NSEC_PER_SEC),
+        .tv_nsec = (long)(ns % NSEC_PER_SEC),
+    };
+}
+
+/* Charges the time real-time thread 't' has been running since it was
+ * switched in against its budget. If the budget is used up the thread
+ * sleeps until its next budget period starts
+ */
+static void
+rt_charge(struct lthread_info *t, int64_t now)
+{
+    struct lthread_rt_info *rt = t->rt;
+    if (rt == NULL) {
+        return;
+    }
+
+    rt->budget_used += now - rt->run_start;
+    if (rt->runtime != 0 && rt->budget_used >= rt->runtime && t->status == READY) {
+        rt->stats.throttled++;
+        t->wake_time = ns_to_timespec(rt->budget_start + rt->period);
+        t->status = SLEEPING;
+    }
+}
+
+/* Returns the runnable real-time thread with the earliest deadline,
+ * or NULL if no real-time thread can run
+ */
+static struct lthread_info *
+rt_pick(int64_t now)
+{
+    struct lthread_rt_info *rt, *earliest = NULL;
+    struct lthread_info *t;
+
+    for (rt = rt_threads; rt != NULL; rt = rt->next) {
+        t = rt->thread;
+
+        /* Start a new budget period if the last one is over */
+        if (now >= rt->budget_start + rt->period) {
+            rt->budget_start += (now - rt->budget_start) / rt->period * rt->period;
+            rt->budget_used = 0;
+        }
+
+        if (t->status == SLEEPING && now >= timespec_to_ns(&t->wake_time)) {
+            wake_sleeping_lthread(t);
+        }
+
+        if (t->status == READY &&
+                (earliest == NULL || rt->abs_deadline < earliest->abs_deadline)) {
+            earliest = rt;
+        }
+    }
+
+    return earliest != NULL ? earliest->thread : NULL;
+}
+
+/* TODO: Is this function really needed anymore */
+/* Conditionally starts and stops the timer whose expiration
+ * sends a signal to the process therebye invoking the scheduler
+ */
+static void
+change_alarm(int turn_on)
+{
+    /* The on structure fires every quantum */
+    struct itimerspec on = {
+        .it_interval = ns_to_timespec(quantum_ns),
+        .it_value = ns_to_timespec(quantum_ns),
+    };
+    /* The off structure is just all 0s */
+    static struct itimerspec off = {
+        .it_interval = {
+            .tv_sec = 0,
+            .tv_nsec = 0,
+        },
+        .it_value = {
+            .tv_sec = 0,
+            .tv_nsec = 0,
+        },
+    };
+
+    if (turn_on) {
+        /* TODO: off structure might be populated with garbage
+         * that was the old configuration of the timer when this
+         * is first called */
+        /* Turn the timer on */
+        timer_settime(lthread_timer, 0, &on, &off);
+    }
+    else {
+        /* Turn the timer off */
+        timer_settime(lthread_timer, 0, &off, &on);
+    }
+}
+
+/* Allocates and sets up a thread that will start at 'start_routine',
+ * it is not added to the scheduling queue. Must be called with the
+ * scheduling signal blocked
+ */
+static struct lthread_info *
+new_lthread(void *(*start_routine)(void *data), void *data)
+{
+    void *stack;
+    struct lthread_info *new_thread;
+
+    /* Allocate space for new thread stack */
+    stack = allocate_stack();
+
+    /* Allocate lthread storage */
+    new_thread = calloc(1, sizeof(*new_thread));
+    new_thread->id = allocate_lthread();
+    lthreads[new_thread->id] = new_thread;
+
+    /* Setup thread parameters */
+#ifdef LTHREAD_DEBUG
+    new_thread->stack_reg = VALGRIND_STACK_REGISTER(stack, stack + lthread_stack_size);
+#endif
+    /* setup structure */
+    new_thread->stack = stack;
+    new_thread->start_routine = start_routine;
+    new_thread->data = data;
+    new_thread->status = READY;
+
+    /* Use current context as starting context */
+    if (getcontext(&new_thread->context)) {
+        perror("Failed to get context");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Update current context with desired context for thread start */
+    new_thread->context.uc_stack.ss_sp = new_thread->stack;
+    new_thread->context.uc_stack.ss_size = lthread_stack_size;
+    new_thread->context.uc_link = &head->context;
+    makecontext(&new_thread->context, (void(*)(void))lthread_run, 1, new_thread->id);
+
+    return new_thread;
+}
+
+/* Like new_lthread(), but for a thread running on the shared stack. Its
+ * starting frame is only made once the stack is free, see
+ * copy_stack_switch()
+ */
+static struct lthread_info *
+new_copy_stack_lthread(void *(*start_routine)(void *data), void *data)
+{
+    struct lthread_info *new_thread;
+
+    if (copy_stack == NULL) {
+        copy_stack = allocate_stack();
+        copy_switch_stack = allocate_stack();
+        if (getcontext(&copy_switch_context)) {
+            perror("Failed to get context");
+            exit(EXIT_FAILURE);
+        }
+        sigaddset(&copy_switch_context.uc_sigmask, lthread_sig);
+    }
+
+    new_thread = calloc(1, sizeof(*new_thread));
+    new_thread->id = allocate_lthread();
+    lthreads[new_thread->id] = new_thread;
+
+    new_thread->stack = copy_stack;
+    new_thread->start_routine = start_routine;
+    new_thread->data = data;
+    new_thread->status = READY;
+
+    if (getcontext(&new_thread->context)) {
+        perror("Failed to get context");
+        exit(EXIT_FAILURE);
+    }
+    new_thread->context.uc_stack.ss_sp = copy_stack;
+    new_thread->context.uc_stack.ss_size = lthread_stack_size;
+    new_thread->context.uc_link = &head->context;
+
+    return new_thread;
+}
+
+/* Schedules detached thread 't' to be freed by a later scheduler pass */
+static void
+queue_reap(struct lthread_info *t)
+{
+    t->done_next = reap_list;
+    reap_list = t;
+}
+
+/* Frees the detached threads that finished since the last pass,
+ * must not be called while running on one of their stacks
+ */
+static void
+reap_lthreads(void)
+{
+    struct lthread_info *t;
+    while (reap_list != NULL) {
+        t = reap_list;
+        reap_list = t->done_next;
+        deallocate_lthread(t->id);
+        free_lthread(t);
+    }
+}
+
+/* Handles everything other OS threads have handed to the scheduler,
+ * must be called with the scheduling signal blocked
+ */
+static void
+drain_remote_inbox(void)
+{
+    struct lthread_remote_req *req, *fifo = NULL, *next;
+    struct lthread_info *t;
+
+    /* Take every request at once, they come out newest first */
+    req = __atomic_exchange_n(&remote_inbox, NULL, __ATOMIC_ACQUIRE);
+    while (req != NULL) {
+        next = req->next;
+        req->next = fifo;
+        fifo = req;
+        req = next;
+    }
+
+    for (req = fifo; req != NULL; req = next) {
+        next = req->next;
+        if (req->start_routine != NULL) {
+            t = new_lthread(req->start_routine, req->data);
+            /* Not created by whichever thread happens to be running */
+            group_join(t, NULL);
+            push_queue(t);
+            if (sched->enqueue != NULL) {
+                sched->enqueue(t);
+            }
+            if (req->created != NULL) {
+                /* Requester owns 'req' again after this */
+                *req->handle = t->id;
+                sem_post(req->created);
+            }
+            else {
+                t->detached = 1;
+                free(req);
+            }
+        }
+        else {
+            t = NULL;
+            if (req->target == LTHREAD_MAIN_THREAD) {
+                t = main_thread;
+            }
+            else if (req->target < nlthreads) {
+                t = lthreads[req->target];
+            }
+            if (t != NULL) {
+                t->park_permit = 1;
+                wake_lthread(t);
+            }
+            free(req);
+        }
+    }
+}
+
+/* Records the interrupted PC and frame pointer backtrace of the
+ * running thread. Frames are only followed while they stay within the
+ * thread's stack and move towards its top, so a missing frame pointer
+ * cuts the backtrace short instead of faulting
+ */
+static void
+profile_sample(const ucontext_t *uc)
+{
+    struct lthread_profile_sample *sample;
+    uintptr_t fp, lo, hi, *frame;
+
+    if (profile_count == profile_max) {
+        profile_dropped++;
+        return;
+    }
+    sample = profile_samples + profile_count++;
+    sample->id = head->id;
+    sample->pcs[0] = (void *)uc->uc_mcontext.gregs[REG_RIP];
+    sample->depth = 1;
+
+    lo = (uintptr_t)uc->uc_mcontext.gregs[REG_RSP];
+    if (head->stack != NULL) {
+        hi = (uintptr_t)head->stack + lthread_stack_size;
+    }
+    else {
+        hi = (uintptr_t)main_stack_hi;
+    }
+
+    fp = (uintptr_t)uc->uc_mcontext.gregs[REG_RBP];
+    while (sample->depth < LTHREAD_PROFILE_DEPTH && fp >= lo &&
+            fp + 2 * sizeof(uintptr_t) <= hi && fp % sizeof(uintptr_t) == 0) {
+        frame = (uintptr_t *)fp;
+        if (frame[1] == 0) {
+            break;
+        }
+        sample->pcs[sample->depth++] = (void *)frame[1];
+        if (frame[0] <= fp) {
+            break;
+        }
+        fp = frame[0];
+    }
+}
+
+/* Scheduling signal handler, used to handle the scheduling of
+ * threads
+ */
+static void
+lthread_alarm_handler(int num, siginfo_t *info, void *ucontext)
+{
+    /* The running thread is in a call that mustn't be interrupted,
+     * lthread_preempt_enable comes back here when it's done */
+    if (preempt_count != 0 && head->status == RUNNING) {
+        preempt_deferred = 1;
+        return;
+    }
+    preempt_deferred = 0;
+
+    /* TODO: Is this block needed? */
+    BLOCK_SIGNAL();
+    int remove_front = 0; /* Indicated if the first entry should be removed */
+    struct lthread_info *next; /* Real-time thread to run next */
+    /* Threads looked at since the clock was read, volatile as it lives
+     * across the getcontext below */
+    volatile size_t visited = 0;
+    /* Kept on the interrupted thread's stack, so every thread gets back
+     * the errno it had when it was preempted */
+    int saved_errno = errno;
+    (void)num;
+
+    /* Read the clock at most once, for every thread that needs it */
+    pass_now = 0;
+
+#ifdef LTHREAD_HOLD_PROFILE
+    /* Ticks held back by lthread_block come in as soon as it's undone */
+    if (hold_unblocking != NULL && info->si_code == SI_TIMER) {
+        hold_unblocking->deferred_ticks += 1 + (size_t)info->si_overrun;
+        hold_unblocking = NULL;
+    }
+#endif
+
+    /* Only timer ticks land at random points worth sampling, yields
+     * and kicks from other OS threads are raised on purpose */
+    if (profile_running && info->si_code == SI_TIMER && head->status == RUNNING) {
+        profile_sample(ucontext);
+    }
+
+    /* Whatever happens next, the interrupted thread stopped running */
+    charge_cpu(head, pass_clock());
+
+#ifdef LTHREAD_DEBUG
+    signal_handler_inst++;
+#endif
+
+    /* Not running on any finished thread's stack here */
+    if (reap_list != NULL) {
+        reap_lthreads();
+    }
+
+    if (__atomic_load_n(&remote_inbox, __ATOMIC_RELAXED) != NULL) {
+        drain_remote_inbox();
+    }
+
+    if (dump_pending) {
+        dump_pending = 0;
+        lthread_dump(dump_fd);
+    }
+
+    /* save current thread execution */
+    if (head->status == DONE) {
+        /* If the entry is done, remove it from scheduling */
+        remove_front = 1;
+        if (head->detached) {
+            queue_reap(head);
+        }
+    }
+    else {
+        /* Otherwise, save status for later */
+        if (head->status == RUNNING) {
+            head->status = READY;
+            if (yielding) {
+                if (sched->on_yield != NULL) sched->on_yield(head);
+            }
+            else if (sched->on_tick != NULL) {
+                sched->on_tick(head);
+            }
+        }
+        else if (sched->on_block != NULL) {
+            sched->on_block(head);
+        }
+        yielding = 0;
+
+        if (head->flags & LTHREAD_INTEGER_ONLY) {
+            /* Only callee saved registers, no FP environment or signal
+             * mask syscall. The kernel already saved the full FP and
+             * vector state in this signal's frame
+             */
+            lthread_save_regs(head->regs);
+            head->regs_saved = 1;
+        }
+        else if (getcontext(&head->context)) {
+            perror("Failed to get context");
+            exit(EXIT_FAILURE);
+        }
+
+        /* getcontext doesn't work like setjmp, need to use
+         * status flag to ensure this thread only leaves when it is chosen */
+        if (head->status == RUNNING) {
+            UNBLOCK_SIGNAL();
+            errno = saved_errno;
+            return;
+        }
+        remove_front = 0;
+    }
+
+    /* Real-time threads go ahead of the rest of the queue */
+    next = NULL;
+    if (rt_threads != NULL) {
+        if (!remove_front) {
+            rt_charge(head, pass_clock());
+        }
+        next = rt_pick(pass_clock());
+    }
+
+    if (next != NULL) {
+        queue_advance(next, remove_front);
+    }
+    else {
+        /* Find next runnable thread in the queue */
+        do {
+            /* Other OS threads may make something runnable while we wait */
+            if (__atomic_load_n(&remote_inbox, __ATOMIC_RELAXED) != NULL) {
+                drain_remote_inbox();
+            }
+
+            /* Move to whichever thread the policy wants next (removing
+             * first element if necessary) */
+            queue_advance(sched->pick_next(head), remove_front);
+            remove_front = 0;
+
+            /* Nothing could run on the whole way around, time has moved
+             * on since the clock was read */
+            if (++visited > queue_length) {
+                visited = 0;
+                pass_now = 0;
+                /* Stuck with nothing to run is when a report is wanted */
+                if (dump_pending) {
+                    dump_pending = 0;
+                    lthread_dump(dump_fd);
+                }
+            }
+            /* TODO: Are all these statuses needed? */
+            switch (head->status) {
+                case CREATED:
+                    UNBLOCK_SIGNAL();
+                    start_thread(head, head->start_routine, head->data, lthread_stack_start(head));
+                    break;
+                case RUNNING:
+                    fprintf(stderr, "Thread marked running when it shouldn't be!\n");
+                    break;
+                case SLEEPING:
+                    if (lthread_done_sleeping(head)) {
+                        wake_sleeping_lthread(head);
+                    }
+                    break;
+                case READY:
+                    break;
+                case DONE:
+                    remove_front = 1;
+                    if (head->detached) {
+                        queue_reap(head);
+                    }
+                    break;
+                case BLOCKED:
+                    break;
+                default:
+                    fprintf(stderr, "Invalid state %d\n", head->status);
+            }
+        } while (head->status != READY);
+    }
+    /* Setup thread and swap to its context */
+    if (head->rt != NULL) {
+        head->rt->run_start = pass_clock();
+    }
+    head->run_since = pass_clock();
+    head->status = RUNNING;
+    resume_lthread(head);
+}
+
+/* Frees every entry in deferred list 'd', must be called with the
+ * scheduling signal blocked
+ */
+static void
+free_deferred(struct lthread_deferred *d)
+{
+    struct lthread_deferred *next;
+    for (; d != NULL; d = next) {
+        next = d->next;
+        if (d->destroy != NULL) {
+            d->destroy(d->ptr);
+        }
+        else {
+            free(d->ptr);
+        }
+        free(d);
+    }
+}
+
+/* Returns non-zero if thread 't' is in an epoch section older than
+ * the current epoch
+ */
+static int
+epoch_behind(const struct lthread_info *t)
+{
+    return t != NULL && t->epoch_nest != 0 && t->epoch != global_epoch;
+}
+
+/* Moves the global epoch forward if every thread in a section has
+ * seen the current one, then frees what was deferred two epochs ago.
+ * Must be called with the scheduling signal blocked
+ */
+static void
+epoch_try_advance(void)
+{
+    struct lthread_deferred *ready;
+
+    if (epoch_behind(main_thread)) {
+        return;
+    }
+    for (size_t ii = 0; ii < nlthreads; ii++) {
+        if (epoch_behind(lthreads[ii])) {
+            return;
+        }
+    }
+
+    global_epoch++;
+    /* Deferred two epochs ago, every section since started after it */
+    ready = limbo[(global_epoch + 1) % 3];
+    limbo[(global_epoch + 1) % 3] = NULL;
+    free_deferred(ready);
+}
+
+/* Cleans up the environment when exiting */
+void
+lthread_cleanup(void)
+{
+    BLOCK_SIGNAL();
+#ifdef LTHREAD_HOLD_PROFILE
+    /* Worst lthread_block offenders */
+    hold_write_report(stderr);
+#endif
+    /* Write out whatever is still buffered */
+    if (log_fd >= 0) {
+        log_flush_buffers();
+    }
+    while (log_buffers != NULL) {
+        struct lthread_log_buffer *buf = log_buffers;
+        log_buffers = buf->next;
+        munmap(buf, sizeof(*buf));
+    }
+    /* Delete timer */
+    timer_delete(lthread_timer);
+    /* Free lthreads array */
+    free(lthreads);
+    /* Nobody is reading anymore */
+    for (size_t ii = 0; ii < 3; ii++) {
+        free_deferred(limbo[ii]);
+        limbo[ii] = NULL;
+    }
+    /* Release profiler samples */
+    profile_running = 0;
+    free(profile_samples);
+    /* Release stack arena */
+    if (stack_arena != NULL) {
+        munmap(stack_arena, stack_arena_size);
+    }
+    /* Free main thread information */
+    if (head->rt != NULL) {
+        remove_rt_thread(head);
+    }
+    free(head);
+#ifdef LTHREAD_DEBUG
+    clock_gettime(lthread_clockid, &lthread_end);
+    lthread_debug_print_stats();
+#endif
+}
+
+void
+lthread_config_default(struct lthread_config *config)
+{
+    config->sched = &lthread_sched_round_robin;
+    config->quantum = ns_to_timespec(LTHREAD_ALARM_INTERVAL_NS);
+    config->stack_size = LTHREAD_STACK_SIZE;
+    config->initial_lthreads = LTHREAD_INITIAL_LTHREADS;
+    config->clock = LTHREAD_CLOCKID;
+    config->signal = LTHREAD_SIG;
+    config->dump_signal = 0;
+}
+
+/* Parses environment variable 'name' as an unsigned number into 'value',
+ * which is left alone if it isn't set. Returns non-zero if it is garbage
+ */
+static int
+config_env_number(const char *name, unsigned long long *value)
+{
+    const char *str = getenv(name);
+    char *end;
+
+    if (str == NULL) {
+        return 0;
+    }
+    errno = 0;
+    *value = strtoull(str, &end, 0);
+    if (errno != 0 || end == str || *end != '\0' || *str == '-') {
+        fprintf(stderr, "Invalid %s '%s'\n", name, str);
+        return 1;
+    }
+    return 0;
+}
+
+/* Parses environment variable 'name' as a signal number or name into
+ * 'signo', which is left alone if it isn't set. Returns non-zero if it
+ * is garbage or past SIGRTMAX
+ */
+static int
+config_env_signal(const char *name, int *signo)
+{
+    const char *str = getenv(name), *num;
+    unsigned long long value = 0;
+    int base = 0, sign = 1, prefixed, valid;
+    char *end;
+
+    if (str == NULL) {
+        return 0;
+    }
+    prefixed = strncmp(str, "SIG", 3) == 0;
+    num = prefixed ? str + 3 : str;
+    if (strcmp(num, "USR1") == 0 || strcmp(num, "USR2") == 0) {
+        *signo = num[3] == '1' ? SIGUSR1 : SIGUSR2;
+        return 0;
+    }
+    if (strncmp(num, "RTMIN", 5) == 0 || strncmp(num, "RTMAX", 5) == 0) {
+        base = num[4] == 'N' ? SIGRTMIN : SIGRTMAX;
+        sign = num[4] == 'N' ? 1 : -1;
+        num += 5;
+        /* A bare RTMIN or RTMAX, otherwise only counting inwards */
+        if (*num == (sign > 0 ? '+' : '-')) {
+            num++;
+        }
+        else if (*num == '\0') {
+            num = "0";
+        }
+    }
+
+    errno = 0;
+    /* SIG only goes before a name */
+    valid = (!prefixed || base != 0) && *num >= '0' && *num <= '9';
+    if (valid) {
+        value = strtoull(num, &end, 10);
+        valid = errno == 0 && *end == '\0' && value <= (unsigned long long)SIGRTMAX;
+    }
+    if (!valid) {
+        fprintf(stderr, "Invalid %s '%s'\n", name, str);
+        return 1;
+    }
+    *signo = base + sign * (int)value;
+    return 0;
+}
+
+/* Applies the LTHREAD_* environment variables to 'config', returns
+ * non-zero if one of them can't be parsed
+ */
+static int
+config_from_env(struct lthread_config *config)
+{
+    unsigned long long value;
+    const char *clock;
+
+    value = (unsigned long long)timespec_to_ns(&config->quantum);
+    if (config_env_number("LTHREAD_QUANTUM_NS", &value)) return 1;
+    config->quantum = ns_to_timespec((int64_t)value);
+
+    value = config->stack_size;
+    if (config_env_number("LTHREAD_STACK_SIZE", &value)) return 1;
+    config->stack_size = (size_t)value;
+
+    value = config->initial_lthreads;
+    if (config_env_number("LTHREAD_INITIAL_LTHREADS", &value)) return 1;
+    config->initial_lthreads = (size_t)value;
+
+    if (config_env_signal("LTHREAD_SIG", &config->signal)) return 1;
+    if (config_env_signal("LTHREAD_DUMP_SIG", &config->dump_signal)) return 1;
+
+    clock = getenv("LTHREAD_CLOCK");
+    if (clock != NULL) {
+        if (strcmp(clock, "realtime") == 0) {
+            config->clock = CLOCK_REALTIME;
+        }
+        else if (strcmp(clock, "monotonic") == 0) {
+            config->clock = CLOCK_MONOTONIC;
+        }
+        else if (strcmp(clock, "boottime") == 0) {
+            config->clock = CLOCK_BOOTTIME;
+        }
+        else {
+            fprintf(stderr, "Invalid LTHREAD_CLOCK '%s'\n", clock);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int lthread_init(void)
+{
+    return lthread_init_ex(NULL);
+}
+
+int lthread_init_sched(const struct lthread_sched_ops *ops)
+{
+    struct lthread_config config;
+    lthread_config_default(&config);
+    config.sched = ops;
+    return lthread_init_ex(&config);
+}
+
+int lthread_init_ex(const struct lthread_config *user_config)
+{
+    struct lthread_config config;
+    const struct lthread_sched_ops *ops;
+    struct timespec res;
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    struct lthread_info *new_thread;
+    /* Exported by liblthread_preload.so */
+    void (*register_preload)(void (*disable)(void), void (*enable)(void));
+    /* Action to perform on the scheduling signal */
+    struct sigaction act = {
+        .sa_sigaction = lthread_alarm_handler, /* Scheduling handler */
+        .sa_flags = SA_RESTART | SA_SIGINFO/*0SA_NODEFER*/, /* Can be interrupted within scheduler
+                                -- Maybe this shouldn't be the case? */
+    };
+    struct sigevent event = {
+        .sigev_notify = SIGEV_THREAD_ID, /* Call handler on signal, only in
+                                            the scheduling OS thread */
+        .sigev_signo = 0, /* Signal number, set once configured */
+        .sigev_value.sival_ptr = &lthread_timer, /* Timer to use if necessary */
+    };
+    pthread_attr_t attr;
+    void *stack_addr;
+    size_t stack_size;
+    event.sigev_notify_thread_id = gettid();
+    lthread_sched_thread = pthread_self();
+
+    /* Bounds for the profiler's backtraces of the main thread */
+    if (pthread_getattr_np(lthread_sched_thread, &attr) == 0) {
+        if (pthread_attr_getstack(&attr, &stack_addr, &stack_size) == 0) {
+            main_stack_lo = stack_addr;
+            main_stack_hi = main_stack_lo + stack_size;
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    if (user_config != NULL) {
+        config = *user_config;
+    }
+    else {
+        lthread_config_default(&config);
+    }
+    if (config_from_env(&config)) {
+        return 1;
+    }
+
+    ops = config.sched;
+    if (ops == NULL || ops->pick_next == NULL) {
+        return 1;
+    }
+    if (timespec_to_ns(&config.quantum) <= 0 ||
+            config.stack_size < LTHREAD_STACK_MIN ||
+            config.stack_size > SIZE_MAX - page_size ||
+            config.initial_lthreads == 0 ||
+            config.signal < SIGRTMIN || config.signal > SIGRTMAX ||
+            config.dump_signal < 0 || config.dump_signal > SIGRTMAX ||
+            config.dump_signal == config.signal ||
+            clock_getres(config.clock, &res) != 0) {
+        return 1;
+    }
+    sched = ops;
+    quantum_ns = timespec_to_ns(&config.quantum);
+    lthread_stack_size = (config.stack_size + page_size - 1) & ~(page_size - 1);
+    lthread_clockid = config.clock;
+    lthread_sig = config.signal;
+    event.sigev_signo = lthread_sig;
+    if (config.dump_signal != 0 &&
+            lthread_dump_on_signal(config.dump_signal, STDERR_FILENO)) {
+        return 1;
+    }
+
+    /* Allocate thread storage */
+    lthreads = calloc(config.initial_lthreads, sizeof(*lthreads));
+    nlthreads = config.initial_lthreads;
+
+    /* Reserve stacks up front if configured to */
+    init_stack_arena();
+
+    /* Setup signal mask */
+    sigemptyset(&lthread_sig_mask);
+    sigaddset(&lthread_sig_mask, lthread_sig);
+
+    /* Set scheduling signal handler */
+    sigemptyset(&act.sa_mask);
+    if (sigaction(lthread_sig , &act, NULL)) {
+        fprintf(stderr, "Failed to set scheduling signal handler\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* TODO: Is this where blocking should start? */
+    /* block lthread signal */
+    BLOCK_SIGNAL();
+
+    /* Create timer */
+    if (timer_create(lthread_clockid, &event, &lthread_timer) == -1) {
+        perror("Failed to create timer");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Setup main thread context */
+    new_thread = calloc(1, sizeof(*new_thread));
+    new_thread->status = RUNNING;
+    new_thread->id = LTHREAD_MAIN_THREAD;
+    new_thread->run_since = lthread_now_ns();
+    main_thread = new_thread;
+
+    /* Setup main threads context as current context */
+    if (getcontext(&new_thread->context)) {
+        perror("Failed to get context");
+        exit(EXIT_FAILURE);
+    }
+
+    init_queue(new_thread);
+    if (sched->enqueue != NULL) {
+        sched->enqueue(new_thread);
+    }
+
+    /* Add cleanup function run at exit() */
+    atexit(lthread_cleanup);
+
+    /* Hand the preemption hooks to liblthread_preload.so if it's loaded,
+     * it can't look them up itself unless this program exports them */
+    *(void **)&register_preload = dlsym(RTLD_DEFAULT, "lthread_preload_register");
+    if (register_preload != NULL) {
+        register_preload(lthread_preempt_disable, lthread_preempt_enable);
+    }
+
+    /* Start scheduled signals */
+    change_alarm(1);
+
+#ifdef LTHREAD_DEBUG
+    clock_gettime(lthread_clockid, &lthread_start);
+#endif
+
+    /* Unblock lthread signal */
+    UNBLOCK_SIGNAL();
+
+    return 0;
+}
+
+/* Creates a thread already in group 'g', joined before it can run */
+static int
+create_in_group(lthread *t, void *(*start_routine)(void *data), void *data,
+        unsigned int flags, struct lthread_group *g)
+{
+    struct lthread_info *new_thread;
+
+    /* Register-only switches don't save a stack pointer to copy from */
+    if ((flags & LTHREAD_COPY_STACK) && (flags & LTHREAD_INTEGER_ONLY)) {
+        return 1;
+    }
+
+    /* TODO: Should blocking start here? */
+    /* Stop interrupting me! */
+    BLOCK_SIGNAL();
+
+    if (flags & LTHREAD_COPY_STACK) {
+        new_thread = new_copy_stack_lthread(start_routine, data);
+    }
+    else {
+        new_thread = new_lthread(start_routine, data);
+    }
+    new_thread->flags = flags;
+    group_join(new_thread, g);
+    *t = new_thread->id;
+
+    if (flags & LTHREAD_GENERATOR) {
+        /* Stays out of the queue until it is resumed */
+        new_thread->status = SUSPENDED;
+    }
+    else {
+        /* Add thread to end of scheduling queue */
+        push_queue(new_thread);
+        if (sched->enqueue != NULL) {
+            sched->enqueue(new_thread);
+        }
+    }
+
+    /* OK Now I'm done */
+    UNBLOCK_SIGNAL();
+
+    return 0;
+}
+
+int
+lthread_create(lthread *t, void *(*start_routine)(void *data), void *data)
+{
+    return lthread_create_ex(t, start_routine, data, 0);
+}
+
+int
+lthread_create_ex(lthread *t, void *(*start_routine)(void *data), void *data,
+        unsigned int flags)
+{
+    return create_in_group(t, start_routine, data, flags, head->group);
+}
+
+int
+lthread_group_create(struct lthread_group *g, lthread *t,
+        void *(*start_routine)(void *data), void *data, unsigned int flags)
+{
+    return create_in_group(t, start_routine, data, flags, g);
+}
+
+int
+lthread_on_copy_stack(const void *addr)
+{
+    const char *p = addr;
+    return copy_stack != NULL && p >= copy_stack && p < copy_stack + lthread_stack_size;
+}
+
+int
+lthread_create_inplace(lthread *t, void *(*start_routine)(void *data), size_t size,
+        void (*init)(void *storage, void *arg), void *arg)
+{
+    struct lthread_info *new_thread;
+    /* Keeps the new thread's stack pointer 16 byte aligned */
+    size_t reserved = (size + 63) & ~(size_t)63;
+
+    if (reserved > lthread_stack_size / 2) {
+        return 1;
+    }
+
+    BLOCK_SIGNAL();
+
+    new_thread = new_lthread(start_routine, NULL);
+    group_join(new_thread, head->group);
+    *t = new_thread->id;
+
+    /* Start again below the reserved space */
+    new_thread->data = (char *)new_thread->stack + lthread_stack_size - reserved;
+    new_thread->context.uc_stack.ss_size = lthread_stack_size - reserved;
+    makecontext(&new_thread->context, (void(*)(void))lthread_run, 1, new_thread->id);
+
+    /* Filled in before the thread can possibly run */
+    init(new_thread->data, arg);
+
+    push_queue(new_thread);
+    if (sched->enqueue != NULL) {
+        sched->enqueue(new_thread);
+    }
+
+    UNBLOCK_SIGNAL();
+
+    return 0;
+}
+
+int
+lthread_create_n(lthread *handles, size_t n,
+        void *(*start_routine)(void *data), void **args)
+{
+    struct lthread_slab *slab;
+    struct lthread_info *t, *first, *last;
+    ucontext_t template;
+    char *batch;
+    void *stack;
+    size_t ii, id;
+
+    if (n == 0) {
+        return 0;
+    }
+
+    /* Blocked once for the whole batch */
+    BLOCK_SIGNAL();
+
+    slab = calloc(1, sizeof(*slab) + n * sizeof(slab->threads[0]));
+    if (slab == NULL) {
+        UNBLOCK_SIGNAL();
+        return 1;
+    }
+    slab->refs = n;
+
+    /* Every thread starts from a copy of the same context */
+    if (getcontext(&template)) {
+        perror("Failed to get context");
+        exit(EXIT_FAILURE);
+    }
+
+    first = last = NULL;
+    batch = NULL;
+    id = 0;
+    for (ii = 0; ii < n; ii++) {
+        t = slab->threads + ii;
+
+        /* Stacks the arena can't provide all come from one mapping */
+        stack = arena_stack();
+        if (stack == NULL) {
+            if (batch == NULL) {
+                batch = mmap(NULL, (n - ii) * lthread_stack_size, PROT_READ | PROT_WRITE,
+                        MAP_ANONYMOUS | MAP_PRIVATE | MAP_STACK, -1, 0);
+                if (batch == MAP_FAILED) {
+                    perror("Failed to mmap stack space for new threads: ");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            stack = batch;
+            batch += lthread_stack_size;
+        }
+
+        /* Table slots are taken in order, no need to search from 0 */
+        id = allocate_lthread_from(id);
+        lthreads[id] = t;
+        t->id = id++;
+        handles[ii] = t->id;
+
+#ifdef LTHREAD_DEBUG
+        t->stack_reg = VALGRIND_STACK_REGISTER(stack, stack + lthread_stack_size);
+#endif
+        t->slab = slab;
+        group_join(t, head->group);
+        t->stack = stack;
+        t->start_routine = start_routine;
+        t->data = args != NULL ? args[ii] : NULL;
+        t->status = READY;
+
+        t->context = template;
+        /* The copy still points at the template's FP state */
+        t->context.uc_mcontext.fpregs = &t->context.__fpregs_mem;
+        t->context.uc_stack.ss_sp = t->stack;
+        t->context.uc_stack.ss_size = lthread_stack_size;
+        t->context.uc_link = &head->context;
+        makecontext(&t->context, (void(*)(void))lthread_run, 1, t->id);
+
+        /* Chain the new threads together */
+        t->prev = last;
+        if (last != NULL) {
+            last->next = t;
+        }
+        else {
+            first = t;
+        }
+        last = t;
+    }
+
+    /* Splice the chain onto the end of the queue in one go */
+    first->prev = tail;
+    last->next = head;
+    tail->next = first;
+    head->prev = last;
+    tail = last;
+    queue_length += n;
+
+    if (sched->enqueue != NULL) {
+        for (ii = 0; ii < n; ii++) {
+            sched->enqueue(slab->threads + ii);
+        }
+    }
+
+    UNBLOCK_SIGNAL();
+
+    return 0;
+}
+
+/* Cancels the thread corresponding to 't' and waits
+ * for it to stop at a cancellation point, so that
+ * it finishes cleanly instead of mid-way
+ */
+void
+lthread_destroy(lthread t)
+{
+    /* Fails for threads already done, which still need joining */
+    lthread_cancel(t);
+    lthread_join(t, NULL);
+}
+
+int
+lthread_resume(lthread t, void **value)
+{
+    struct lthread_info *gen, *me;
+    int ret;
+
+    /* Check that this is a valid thread */
+    if (t >= nlthreads) {
+        return -1;
+    }
+
+    BLOCK_SIGNAL();
+    gen = lthreads[t];
+    if (gen == NULL || gen->status != SUSPENDED) {
+        UNBLOCK_SIGNAL();
+        return -1;
+    }
+
+    /* The generator runs in our place until it yields */
+    me = head;
+    gen->resumer = me;
+    queue_swap_front(gen);
+    me->status = SUSPENDED;
+    switch_lthread(me, gen);
+
+    /* Still blocked, so a finished detached generator isn't freed yet */
+    ret = gen->status == DONE;
+    if (!ret && value != NULL) {
+        *value = gen->yielded;
+    }
+    UNBLOCK_SIGNAL();
+
+    return ret;
+}
+
+int
+lthread_yield_value(void *value)
+{
+    struct lthread_info *me, *resumer;
+
+    BLOCK_SIGNAL();
+    me = head;
+    resumer = me->resumer;
+    if (resumer == NULL) {
+        UNBLOCK_SIGNAL();
+        return 1;
+    }
+
+    me->resumer = NULL;
+    me->yielded = value;
+    queue_swap_front(resumer);
+    me->status = SUSPENDED;
+    switch_lthread(me, resumer);
+    UNBLOCK_SIGNAL();
+
+    return 0;
+}
+
+/* Similar to pthread_join(), wait for the specified 
+ * thread 't' to finish working. The value returned
+ * by that thread will be placed in 'retval'. Gives
+ * up once the clock passes 'deadline', unless zero
+ */
+static int
+join_lthread(lthread t, void **retval, int64_t deadline)
+{
+    /* Check that this is a valid thread */
+    if (t >= nlthreads) {
+        return 1;
+    }
+
+    /* The scheduler may grow the table for remotely created threads */
+    BLOCK_SIGNAL();
+    struct lthread_info *thread = lthreads[t];
+    if (thread == NULL || thread->detached) {
+        UNBLOCK_SIGNAL();
+        return 1;
+    }
+
+    /* Wait for the  thread to complete naturally */
+    while (thread->status != DONE) {
+        if (cancel_requested()) {
+            thread->joiner = NULL;
+            lthread_exit(LTHREAD_CANCELED);
+        }
+        if (deadline != 0 && lthread_now_ns() >= deadline) {
+            thread->joiner = NULL;
+            UNBLOCK_SIGNAL();
+            return -1;
+        }
+        thread->joiner = head;
+        if (deadline != 0) {
+            park_lthread_until(deadline);
+        }
+        else {
+            park_lthread();
+        }
+    }
+
+    /* Save return value and deallocate resources */
+    if (retval != NULL) *retval = thread->data;
+    deallocate_lthread(thread->id);
+    free_lthread(thread);
+    UNBLOCK_SIGNAL();
+
+
+    return 0;
+}
+
+int
+lthread_join(lthread t, void **retval)
+{
+    return join_lthread(t, retval, 0);
+}
+
+int
+lthread_join_timed(lthread t, void **retval, const struct timespec *timeout)
+{
+    int64_t deadline, ns;
+
+    if (timeout == NULL) {
+        return join_lthread(t, retval, 0);
+    }
+    ns = timespec_to_ns(timeout);
+    /* Never zero, that means no timeout */
+    deadline = lthread_now_ns() + (ns > 0 ? ns : 0);
+    return join_lthread(t, retval, deadline != 0 ? deadline : 1);
+}
+
+int
+lthread_join_all(lthread *threads, size_t n, void **retvals)
+{
+    int failed = 0;
+    for (size_t ii = 0; ii < n; ii++) {
+        if (lthread_join(threads[ii], retvals != NULL ? retvals + ii : NULL)) {
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+int
+lthread_waitset_init(struct lthread_waitset *ws)
+{
+    ws->done_head = NULL;
+    ws->done_tail = NULL;
+    ws->pending = 0;
+    ws->waiter = NULL;
+    return 0;
+}
+
+int
+lthread_waitset_add(struct lthread_waitset *ws, lthread t)
+{
+    struct lthread_info *thread;
+
+    /* Check that this is a valid thread */
+    if (t >= nlthreads) {
+        return 1;
+    }
+
+    BLOCK_SIGNAL();
+    thread = lthreads[t];
+    /* Finishing members write to 'ws', which must stay where it is */
+    if (thread == NULL || thread->waitset != NULL || thread->detached ||
+            lthread_on_copy_stack(ws)) {
+        UNBLOCK_SIGNAL();
+        return 1;
+    }
+
+    thread->waitset = ws;
+    ws->pending++;
+
+    /* Already finished threads go straight to the completion queue */
+    if (thread->status == DONE) {
+        notify_lthread_done(thread);
+    }
+    UNBLOCK_SIGNAL();
+
+    return 0;
+}
+
+int
+lthread_waitset_next(struct lthread_waitset *ws, lthread *t, void **retval)
+{
+    struct lthread_info *thread;
+
+    BLOCK_SIGNAL();
+    if (ws->pending == 0) {
+        UNBLOCK_SIGNAL();
+        return 1;
+    }
+
+    /* Wait for any member to finish */
+    while (ws->done_head == NULL) {
+        if (cancel_requested()) {
+            ws->waiter = NULL;
+            lthread_exit(LTHREAD_CANCELED);
+        }
+        ws->waiter = head;
+        park_lthread();
+    }
+    ws->waiter = NULL;
+
+    /* Take the earliest finisher off the completion queue */
+    thread = ws->done_head;
+    ws->done_head = thread->done_next;
+    if (ws->done_head == NULL) {
+        ws->done_tail = NULL;
+    }
+    ws->pending--;
+
+    /* Save handle and return value and deallocate resources */
+    if (t != NULL) *t = thread->id;
+    if (retval != NULL) *retval = thread->data;
+    deallocate_lthread(thread->id);
+    free_lthread(thread);
+    UNBLOCK_SIGNAL();
+
+    return 0;
+}
+
+int
+lthread_sleep(size_t milliseconds)
+{
+    struct timespec deadline = ns_to_timespec(lthread_now_ns() +
+            (int64_t)milliseconds * 1000 * 1000);
+    return lthread_sleep_until(&deadline);
+}
+
+int
+lthread_sleep_until(const struct timespec *deadline)
+{
+    int64_t wake = timespec_to_ns(deadline);
+    int64_t slack = timer_slack_ns;
+    sigset_t old_mask;
+
+    /* Later, never earlier, so nearby deadlines end up the same */
+    if (slack > 1) {
+        wake = (wake + slack - 1) / slack * slack;
+    }
+
+    /* A cancel can't slip in between the check and falling asleep */
+    sigprocmask(SIG_BLOCK, &lthread_sig_mask, &old_mask);
+    cancel_point();
+
+    if (wake <= lthread_now_ns()) {
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        return 0;
+    }
+
+    /* Put the deadline as the sleep time */
+    head->wake_time = ns_to_timespec(wake);
+
+    /* This thread is now sleeping */
+    head->status = SLEEPING;
+
+    /* Scheduler, come and take me! */
+    raise(lthread_sig);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+    /* Woken early by lthread_cancel */
+    cancel_point();
+
+    return 0;
+}
+
+clockid_t
+lthread_clock(void)
+{
+    return lthread_clockid;
+}
+
+int
+lthread_set_timer_slack(const struct timespec *slack)
+{
+    int64_t ns = timespec_to_ns(slack);
+    if (ns < 0) {
+        return 1;
+    }
+    timer_slack_ns = ns;
+    return 0;
+}
+
+int
+lthread_set_quantum(const struct timespec *quantum)
+{
+    sigset_t old_mask;
+    int64_t ns = timespec_to_ns(quantum);
+    /* There is no timer to change before lthread_init */
+    if (ns <= 0 || main_thread == NULL) {
+        return 1;
+    }
+
+    /* May be called with scheduling already blocked */
+    sigprocmask(SIG_BLOCK, &lthread_sig_mask, &old_mask);
+    quantum_ns = ns;
+    change_alarm(1);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return 0;
+}
+
+int
+lthread_periodic_init(struct lthread_periodic *p, const struct timespec *period)
+{
+    if (timespec_to_ns(period) <= 0) {
+        return 1;
+    }
+    p->period = *period;
+    p->next = ns_to_timespec(lthread_now_ns() + timespec_to_ns(period));
+    p->overruns = 0;
+    return 0;
+}
+
+int
+lthread_periodic_wait(struct lthread_periodic *p)
+{
+    int64_t period = timespec_to_ns(&p->period);
+    int64_t release = timespec_to_ns(&p->next);
+    int64_t now = lthread_now_ns();
+    size_t missed = 0;
+
+    /* Still a cancellation point when no sleep is needed */
+    cancel_point();
+
+    if (now >= release) {
+        /* Overran, run right away for the latest release that passed */
+        missed = (size_t)((now - release) / period) + 1;
+        release += (int64_t)(missed - 1) * period;
+        p->overruns += missed;
+    }
+
+    /* Releases stay on the original grid, however late we wake */
+    p->next = ns_to_timespec(release + period);
+    if (missed == 0) {
+        struct timespec wake = ns_to_timespec(release);
+        lthread_sleep_until(&wake);
+    }
+
+    return (int)(missed < INT32_MAX ? missed : INT32_MAX);
+}
+
+int
+lthread_yield(void)
+{
+    yielding = 1;
+    return raise(lthread_sig);
+}
+
+/* Returns non-zero if the caller, whose signal mask before blocking
+ * the scheduling signal was 'old_mask', may switch straight to 't'
+ */
+static int
+can_handoff(const sigset_t *old_mask, const struct lthread_info *t)
+{
+    struct lthread_info *due;
+
+    if (t == head || t->status != READY || preempt_count != 0 ||
+            sigismember(old_mask, lthread_sig)) {
+        return 0;
+    }
+
+    /* Skipping the scheduler mustn't skip a real-time thread it would
+     * run first, unless that's the one being handed to */
+    if (rt_threads != NULL) {
+        pass_now = 0;
+        due = rt_pick(pass_clock());
+        return due == NULL || due == t;
+    }
+    return 1;
+}
+
+/* Switches straight from the running thread to runnable thread 't',
+ * without a scheduler pass. The running thread goes to the back of
+ * the queue as if it yielded, or right behind 't' if 'keep_place' is
+ * non-zero. Must be called with the scheduling signal blocked, it is
+ * blocked again on return
+ */
+static void
+handoff_lthread(struct lthread_info *t, int keep_place)
+{
+    struct lthread_info *me = head;
+
+    /* Not inside the handler, the cached clock is stale */
+    pass_now = 0;
+    me->status = READY;
+    if (sched->on_yield != NULL) {
+        sched->on_yield(me);
+    }
+    rt_charge(me, pass_clock());
+
+    queue_advance(t, 0);
+    if (keep_place && t->next != me) {
+        queue_move_next(me);
+    }
+    switch_lthread(me, t);
+}
+
+int
+lthread_yield_to(lthread t)
+{
+    struct lthread_info *thread;
+    sigset_t old_mask;
+    int ret = 1;
+
+    /* Check that this is a valid thread */
+    if (t >= nlthreads) {
+        return 1;
+    }
+
+    sigprocmask(SIG_BLOCK, &lthread_sig_mask, &old_mask);
+    thread = lthreads[t];
+    if (thread != NULL && can_handoff(&old_mask, thread)) {
+        handoff_lthread(thread, 0);
+        ret = 0;
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+    return ret;
+}
+
+#ifdef LTHREAD_HOLD_PROFILE
+/* Returns the statistics of call site 'site', NULL if the table is full */
+static struct lthread_hold_site *
+hold_lookup(void *site)
+{
+    size_t ii = ((uintptr_t)site >> 2) & (LTHREAD_HOLD_SITES - 1);
+    for (size_t probes = 0; probes < LTHREAD_HOLD_SITES; probes++) {
+        if (hold_sites[ii].site == site || hold_sites[ii].site == NULL) {
+            hold_sites[ii].site = site;
+            return hold_sites + ii;
+        }
+        ii = (ii + 1) & (LTHREAD_HOLD_SITES - 1);
+    }
+    return NULL;
+}
+#endif
+
+void
+lthread_preempt_disable(void)
+{
+    preempt_count++;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+void
+lthread_preempt_enable(void)
+{
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    if (--preempt_count == 0 && preempt_deferred) {
+        preempt_deferred = 0;
+        raise(lthread_sig);
+    }
+}
+
+int
+lthread_block(void)
+{
+#ifdef LTHREAD_HOLD_PROFILE
+    int ret = BLOCK_SIGNAL();
+    /* Kept with the thread, which may park or sleep before unblocking.
+     * Blocking again while blocked is still the same hold */
+    if (head != NULL && head->hold_site == NULL) {
+        head->hold_site = hold_lookup(__builtin_return_address(0));
+        head->hold_start = lthread_now_ns();
+    }
+    return ret;
+#else
+    return BLOCK_SIGNAL();
+#endif
+}
+
+int
+lthread_unblock(void)
+{
+#ifdef LTHREAD_HOLD_PROFILE
+    struct lthread_hold_site *site = head != NULL ? head->hold_site : NULL;
+    int64_t held;
+    unsigned int bucket = 0;
+    int ret;
+
+    if (site != NULL) {
+        held = lthread_now_ns() - head->hold_start;
+        site->count++;
+        site->total_ns += held;
+        if (held > site->max_ns) {
+            site->max_ns = held;
+        }
+        while (bucket < LTHREAD_HOLD_BUCKETS - 1 && held >= (1000ll << bucket)) {
+            bucket++;
+        }
+        site->histogram[bucket]++;
+        head->hold_site = NULL;
+    }
+
+    hold_unblocking = site;
+    ret = UNBLOCK_SIGNAL();
+    hold_unblocking = NULL;
+    return ret;
+#else
+    return UNBLOCK_SIGNAL();
+#endif
+}
+
+#ifdef LTHREAD_HOLD_PROFILE
+/* Orders call sites by longest hold, worst first */
+static int
+hold_compare(const void *a, const void *b)
+{
+    const struct lthread_hold_site *x = *(struct lthread_hold_site *const *)a;
+    const struct lthread_hold_site *y = *(struct lthread_hold_site *const *)b;
+    return (x->max_ns < y->max_ns) - (x->max_ns > y->max_ns);
+}
+
+/* Writes the hold time report to 'out', must be called with the
+ * scheduling signal blocked
+ */
+static void
+hold_write_report(FILE *out)
+{
+    struct lthread_hold_site *sorted[LTHREAD_HOLD_SITES];
+    size_t nsites = 0;
+    Dl_info info;
+
+    for (size_t ii = 0; ii < LTHREAD_HOLD_SITES; ii++) {
+        if (hold_sites[ii].count != 0) {
+            sorted[nsites++] = hold_sites + ii;
+        }
+    }
+    qsort(sorted, nsites, sizeof(*sorted), hold_compare);
+
+    fprintf(out, "lthread_block hold times by call site, longest first\n");
+    for (size_t ii = 0; ii < nsites; ii++) {
+        struct lthread_hold_site *site = sorted[ii];
+        /* The return address is just past the call */
+        if (dladdr((char *)site->site - 1, &info) && info.dli_sname != NULL) {
+            fprintf(out, "%s+%#lx", info.dli_sname,
+                    (unsigned long)((char *)site->site - (char *)info.dli_saddr));
+        }
+        else {
+            fprintf(out, "%p", site->site);
+        }
+        fprintf(out, ": %zu holds, max %.1f us, mean %.1f us, %zu ticks deferred\n",
+                site->count, (double)site->max_ns / 1000.0,
+                (double)site->total_ns / 1000.0 / (double)site->count,
+                site->deferred_ticks);
+        fprintf(out, "   ");
+        for (unsigned int bucket = 0; bucket < LTHREAD_HOLD_BUCKETS; bucket++) {
+            if (site->histogram[bucket] == 0) {
+                continue;
+            }
+            if (bucket < LTHREAD_HOLD_BUCKETS - 1) {
+                fprintf(out, " <%lluus:%zu", 1ull << bucket, site->histogram[bucket]);
+            }
+            else {
+                fprintf(out, " more:%zu", site->histogram[bucket]);
+            }
+        }
+        fprintf(out, "\n");
+    }
+}
+#endif
+
+int
+lthread_hold_report(int fd)
+{
+#ifdef LTHREAD_HOLD_PROFILE
+    FILE *out;
+    int out_fd;
+
+    BLOCK_SIGNAL();
+    out_fd = dup(fd);
+    out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+    if (out == NULL) {
+        if (out_fd >= 0) close(out_fd);
+        UNBLOCK_SIGNAL();
+        return 1;
+    }
+    hold_write_report(out);
+    fclose(out);
+    UNBLOCK_SIGNAL();
+    return 0;
+#else
+    (void)fd;
+    return 1;
+#endif
+}
+
+int
+lthread_set_rt(const struct lthread_rt_params *params)
+{
+    struct lthread_rt_info *rt;
+    int64_t now;
+
+    if (params == NULL) {
+        BLOCK_SIGNAL();
+        if (head->rt != NULL) {
+            remove_rt_thread(head);
+        }
+        UNBLOCK_SIGNAL();
+        return 0;
+    }
+
+    if (timespec_to_ns(&params->period) <= 0) {
+        return 1;
+    }
+
+    BLOCK_SIGNAL();
+    rt = head->rt;
+    if (rt == NULL) {
+        rt = calloc(1, sizeof(*rt));
+        rt->thread = head;
+        rt->next = rt_threads;
+        rt_threads = rt;
+        head->rt = rt;
+    }
+
+    rt->period = timespec_to_ns(&params->period);
+    rt->deadline = timespec_to_ns(&params->deadline);
+    if (rt->deadline == 0) {
+        rt->deadline = rt->period;
+    }
+    rt->runtime = timespec_to_ns(&params->runtime);
+
+    /* First job starts now */
+    now = lthread_now_ns();
+    rt->release = now;
+    rt->abs_deadline = now + rt->deadline;
+    rt->budget_start = now;
+    rt->budget_used = 0;
+    rt->run_start = now;
+    UNBLOCK_SIGNAL();
+
+    return 0;
+}
+
+int
+lthread_rt_wait_period(void)
+{
+    struct lthread_rt_info *rt;
+    int64_t now;
+    int missed;
+
+    BLOCK_SIGNAL();
+    rt = head->rt;
+    if (rt == NULL) {
+        UNBLOCK_SIGNAL();
+        return -1;
+    }
+    cancel_point();
+
+    now = lthread_now_ns();
+    missed = now > rt->abs_deadline;
+    rt->stats.jobs++;
+    rt->stats.deadline_misses += (size_t)missed;
+
+    /* Next job is released at the start of the next period */
+    rt->release += rt->period;
+    rt->abs_deadline = rt->release + rt->deadline;
+
+    /* Charge this job up to now, the next one gets a fresh budget */
+    rt->budget_used += now - rt->run_start;
+    rt->run_start = now;
+    if (rt->release > rt->budget_start) {
+        rt->budget_start = rt->release;
+        rt->budget_used = 0;
+    }
+
+    /* Scheduler, come and take me! */
+    head->wake_time = ns_to_timespec(rt->release);
+    head->status = SLEEPING;
+    raise(lthread_sig);
+    UNBLOCK_SIGNAL();
+
+    /* Woken early by lthread_cancel */
+    cancel_point();
+
+    return missed;
+}
+
+int
+lthread_get_rt_stats(struct lthread_rt_stats *stats)
+{
+    int ret = 1;
+    BLOCK_SIGNAL();
+    if (head->rt != NULL) {
+        *stats = head->rt->stats;
+        ret = 0;
+    }
+    UNBLOCK_SIGNAL();
+    return ret;
+}
+
+int
+lthread_group_init(struct lthread_group *g, unsigned int weight)
+{
+    sigset_t old_mask;
+    if (weight == 0) {
+        return 1;
+    }
+    memset(g, 0, sizeof(*g));
+    g->weight = weight;
+
+    sigprocmask(SIG_BLOCK, &lthread_sig_mask, &old_mask);
+    g->next = fair_groups;
+    fair_groups = g;
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return 0;
+}
+
+int
+lthread_group_set_weight(struct lthread_group *g, unsigned int weight)
+{
+    if (weight == 0) {
+        return 1;
+    }
+    g->weight = weight;
+    return 0;
+}
+
+int
+lthread_group_add(struct lthread_group *g, lthread t)
+{
+    struct lthread_info *thread;
+    int runnable;
+
+    if (t >= nlthreads) {
+        return 1;
+    }
+
+    BLOCK_SIGNAL();
+    thread = lthreads[t];
+    if (thread == NULL || thread->status == DONE) {
+        UNBLOCK_SIGNAL();
+        return 1;
+    }
+
+    /* Leave the old group's ring for the new one's */
+    runnable = thread->group_next != NULL;
+    fair_ring_remove(thread);
+    fair_group(thread)->stats.threads--;
+    group_join(thread, g);
+    if (runnable) {
+        fair_ring_add(thread);
+    }
+    UNBLOCK_SIGNAL();
+    return 0;
+}
+
+void
+lthread_group_get_stats(const struct lthread_group *g, struct lthread_group_stats *stats)
+{
+    sigset_t old_mask;
+    sigprocmask(SIG_BLOCK, &lthread_sig_mask, &old_mask);
+    *stats = (g != NULL ? g : &default_group)->stats;
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+int
+lthread_group_destroy(struct lthread_group *g)
+{
+    struct lthread_group **curr;
+    int ret = 1;
+
+    BLOCK_SIGNAL();
+    if (g->stats.threads == 0) {
+        for (curr = &fair_groups; *curr != NULL; curr = &(*curr)->next) {
+            if (*curr == g) {
+                *curr = g->next;
+                break;
+            }
+        }
+        ret = 0;
+    }
+    UNBLOCK_SIGNAL();
+    return ret;
+}
+
+lthread
+lthread_self(void)
+{
+    return head->id;
+}
+
+int
+lthread_detach(lthread t)
+{
+    struct lthread_info *thread;
+
+    /* Check that this is a valid thread */
+    if (t >= nlthreads) {
+        return 1;
+    }
+
+    BLOCK_SIGNAL();
+    thread = lthreads[t];
+    if (thread == NULL || thread->detached || thread->waitset != NULL) {
+        UNBLOCK_SIGNAL();
+        return 1;
+    }
+
+    if (thread->status == DONE) {
+        /* Finished threads are already out of the queue */
+        deallocate_lthread(thread->id);
+        free_lthread(thread);
+    }
+    else {
+        thread->detached = 1;
+    }
+    UNBLOCK_SIGNAL();
+
+    return 0;
+}
+
+int
+lthread_cancel(lthread t)
+{
+    struct lthread_info *thread;
+    int ret = 1;
+
+    /* Check that this is a valid thread */
+    if (t >= nlthreads) {
+        return 1;
+    }
+
+    BLOCK_SIGNAL();
+    thread = lthreads[t];
+    if (thread != NULL && thread != main_thread && thread->status != DONE) {
+        thread->cancel_pending = 1;
+        /* Cut short whatever it waits for, it re-checks on waking */
+        if (thread->cancel_state == LTHREAD_CANCEL_ENABLE) {
+            wake_parked_lthread(thread);
+        }
+        ret = 0;
+    }
+    UNBLOCK_SIGNAL();
+
+    return ret;
+}
+
+void
+lthread_testcancel(void)
+{
+    cancel_point();
+}
+
+int
+lthread_setcancelstate(int state, int *oldstate)
+{
+    if (state != LTHREAD_CANCEL_ENABLE && state != LTHREAD_CANCEL_DISABLE) {
+        return 1;
+    }
+    if (oldstate != NULL) {
+        *oldstate = head->cancel_state;
+    }
+    head->cancel_state = state;
+    return 0;
+}
+
+void
+lthread_exit(void *retval)
+{
+    struct lthread_cleanup *c;
+
+    /* Handlers run like the rest of the thread would have */
+    UNBLOCK_SIGNAL();
+    while ((c = head->cleanup) != NULL) {
+        head->cleanup = c->prev;
+        c->routine(c->arg);
+    }
+
+    if (head == main_thread) {
+        exit(EXIT_SUCCESS);
+    }
+
+    BLOCK_SIGNAL();
+    head->data = retval;
+    finish_lthread(head);
+}
+
+void
+lthread_cleanup_push_(struct lthread_cleanup *c)
+{
+    c->prev = head->cleanup;
+    head->cleanup = c;
+}
+
+void
+lthread_cleanup_pop_(struct lthread_cleanup *c, int execute)
+{
+    head->cleanup = c->prev;
+    if (execute) {
+        c->routine(c->arg);
+    }
+}
+
+int
+lthread_park(void)
+{
+    BLOCK_SIGNAL();
+    cancel_point();
+    if (!head->park_permit) {
+        park_lthread();
+    }
+    head->park_permit = 0;
+    UNBLOCK_SIGNAL();
+    cancel_point();
+    return 0;
+}
+
+int
+lthread_unpark(lthread t)
+{
+    struct lthread_info *thread;
+    sigset_t old_mask;
+    int ret = 1;
+
+    /* Check that this is a valid thread */
+    if (t >= nlthreads) {
+        return 1;
+    }
+
+    /* Keep preemption blocked if the caller had it blocked, so many
+     * threads can be woken at once */
+    sigprocmask(SIG_BLOCK, &lthread_sig_mask, &old_mask);
+    thread = lthreads[t];
+    if (thread != NULL) {
+        thread->park_permit = 1;
+        wake_lthread(thread);
+        ret = 0;
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+    return ret;
+}
+
+/* Pushes 'req' onto the inbox and kicks the scheduler if the
+ * inbox was empty, any OS thread may call this
+ */
+static void
+post_remote_req(struct lthread_remote_req *req)
+{
+    struct lthread_remote_req *old = __atomic_load_n(&remote_inbox, __ATOMIC_RELAXED);
+    do {
+        req->next = old;
+    } while (!__atomic_compare_exchange_n(&remote_inbox, &old, req, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    /* A non-empty inbox already has a kick on the way */
+    if (old == NULL) {
+        pthread_kill(lthread_sched_thread, lthread_sig);
+    }
+}
+
+int
+lthread_create_remote(lthread *t, void *(*start_routine)(void *data), void *data)
+{
+    struct lthread_remote_req *req, sync_req;
+    sem_t created;
+
+    if (t == NULL) {
+        /* Scheduler frees detached requests */
+        req = malloc(sizeof(*req));
+        if (req == NULL) {
+            return 1;
+        }
+        req->created = NULL;
+    }
+    else {
+        req = &sync_req;
+        sem_init(&created, 0, 0);
+        req->created = &created;
+        req->handle = t;
+    }
+    req->start_routine = start_routine;
+    req->data = data;
+
+    post_remote_req(req);
+
+    if (t != NULL) {
+        while (sem_wait(&created) != 0) ;
+        sem_destroy(&created);
+    }
+
+    return 0;
+}
+
+int
+lthread_unpark_remote(lthread t)
+{
+    struct lthread_remote_req *req = malloc(sizeof(*req));
+    if (req == NULL) {
+        return 1;
+    }
+    req->start_routine = NULL;
+    req->target = t;
+    post_remote_req(req);
+    return 0;
+}
+
+int
+lthread_log_init(int fd)
+{
+    if (log_fd >= 0) {
+        return 1;
+    }
+    log_fd = fd;
+    log_running = 1;
+    return lthread_create(&log_flusher, log_flusher_run, NULL);
+}
+
+int
+lthread_log_stop(void)
+{
+    if (log_fd < 0) {
+        return 1;
+    }
+    log_running = 0;
+    lthread_join(log_flusher, NULL);
+    log_fd = -1;
+    return 0;
+}
+
+int
+lthread_log(const char *fmt, ...)
+{
+    char line[LTHREAD_LOG_LINE_MAX];
+    struct lthread_log_buffer *buf = head->log;
+    size_t len, pos, first;
+    va_list ap;
+
+    if (log_fd < 0) {
+        return 1;
+    }
+
+    /* First message from this thread, make it a buffer */
+    if (buf == NULL) {
+        buf = mmap(NULL, sizeof(*buf), PROT_READ | PROT_WRITE,
+                MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (buf == MAP_FAILED) {
+            return 1;
+        }
+        BLOCK_SIGNAL();
+        buf->next = log_buffers;
+        __atomic_store_n(&log_buffers, buf, __ATOMIC_RELEASE);
+        head->log = buf;
+        UNBLOCK_SIGNAL();
+    }
+
+    va_start(ap, fmt);
+    len = lthread_vformat(line, sizeof(line), fmt, ap);
+    va_end(ap);
+
+    /* Whole messages only, never a partial one */
+    if (len > LTHREAD_LOG_BUFFER_SIZE - (buf->head - __atomic_load_n(&buf->tail, __ATOMIC_ACQUIRE))) {
+        __atomic_store_n(&buf->dropped, buf->dropped + 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    pos = buf->head & (LTHREAD_LOG_BUFFER_SIZE - 1);
+    first = LTHREAD_LOG_BUFFER_SIZE - pos;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(buf->data + pos, line, first);
+    memcpy(buf->data, line + first, len - first);
+
+    /* Publish the message to the flusher */
+    __atomic_store_n(&buf->head, buf->head + len, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+int
+lthread_profile_start(size_t max_samples)
+{
+    struct lthread_profile_sample *samples;
+
+    if (profile_running || max_samples == 0) {
+        return 1;
+    }
+
+    LTHREAD_SAFE samples = malloc(max_samples * sizeof(*samples));
+    if (samples == NULL) {
+        return 1;
+    }
+    /* Fault every page in now instead of in the scheduler */
+    memset(samples, 0, max_samples * sizeof(*samples));
+
+    BLOCK_SIGNAL();
+    free(profile_samples);
+    profile_samples = samples;
+    profile_max = max_samples;
+    profile_count = 0;
+    profile_dropped = 0;
+    profile_running = 1;
+    UNBLOCK_SIGNAL();
+
+    return 0;
+}
+
+int
+lthread_profile_stop(void)
+{
+    if (!profile_running) {
+        return 1;
+    }
+    profile_running = 0;
+    return 0;
+}
+
+/* Orders samples by thread and then by backtrace, so identical
+ * stacks end up next to each other
+ */
+static int
+profile_compare(const void *a, const void *b)
+{
+    const struct lthread_profile_sample *x = a, *y = b;
+    if (x->id != y->id) {
+        return x->id < y->id ? -1 : 1;
+    }
+    if (x->depth != y->depth) {
+        return x->depth < y->depth ? -1 : 1;
+    }
+    return memcmp(x->pcs, y->pcs, x->depth * sizeof(x->pcs[0]));
+}
+
+/* Writes the name of the function containing 'pc' */
+static void
+profile_write_frame(FILE *out, void *pc)
+{
+    Dl_info info;
+    if (!dladdr(pc, &info)) {
+        fprintf(out, ";%p", pc);
+    }
+    else if (info.dli_sname != NULL) {
+        fprintf(out, ";%s", info.dli_sname);
+    }
+    else if (info.dli_fname != NULL) {
+        fprintf(out, ";%s+%#lx", strrchr(info.dli_fname, '/') != NULL ?
+                strrchr(info.dli_fname, '/') + 1 : info.dli_fname,
+                (unsigned long)((char *)pc - (char *)info.dli_fbase));
+    }
+    else {
+        fprintf(out, ";%p", pc);
+    }
+}
+
+int
+lthread_profile_dump(int fd)
+{
+    struct lthread_profile_sample *sample;
+    size_t ii, run;
+    Dl_info info;
+    FILE *out;
+    int out_fd;
+
+    if (profile_samples == NULL) {
+        return 1;
+    }
+
+    /* Nothing is sampled while the scheduler is blocked */
+    BLOCK_SIGNAL();
+    out_fd = dup(fd);
+    out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+    if (out == NULL) {
+        if (out_fd >= 0) close(out_fd);
+        UNBLOCK_SIGNAL();
+        return 1;
+    }
+
+    /* Samples anywhere in the same functions count as the same stack */
+    for (ii = 0; ii < profile_count; ii++) {
+        sample = profile_samples + ii;
+        for (size_t jj = 0; jj < sample->depth; jj++) {
+            /* Return addresses point just past their call */
+            if (dladdr((char *)sample->pcs[jj] - (jj > 0), &info) &&
+                    info.dli_saddr != NULL) {
+                sample->pcs[jj] = info.dli_saddr;
+            }
+        }
+    }
+
+    qsort(profile_samples, profile_count, sizeof(*profile_samples), profile_compare);
+    for (ii = 0; ii < profile_count; ii += run) {
+        sample = profile_samples + ii;
+        for (run = 1; ii + run < profile_count &&
+                profile_compare(sample, sample + run) == 0; run++) ;
+
+        if (sample->id == LTHREAD_MAIN_THREAD) {
+            fprintf(out, "main");
+        }
+        else {
+            fprintf(out, "lthread %zu", sample->id);
+        }
+        /* Root first */
+        for (size_t jj = sample->depth; jj-- > 0;) {
+            profile_write_frame(out, sample->pcs[jj]);
+        }
+        fprintf(out, " %zu\n", run);
+    }
+    if (profile_dropped != 0) {
+        fprintf(out, "[dropped] %zu\n", profile_dropped);
+    }
+
+    fclose(out);
+    UNBLOCK_SIGNAL();
+
+    return 0;
+}
+
+/* Report being put together by lthread_dump, written out whenever the
+ * buffer is close to full
+ */
+struct lthread_dump_out {
+    int fd;
+    int failed; /* A write failed, nothing more is written */
+    size_t len;
+    char buf[1024];
+};
+
+static void
+dump_flush(struct lthread_dump_out *out)
+{
+    size_t done = 0;
+    ssize_t written;
+
+    while (done < out->len && !out->failed) {
+        written = write(out->fd, out->buf + done, out->len - done);
+        if (written < 0) {
+            out->failed = errno != EINTR;
+            continue;
+        }
+        done += (size_t)written;
+    }
+    out->len = 0;
+}
+
+static void __attribute__((format(printf, 2, 3)))
+dump_printf(struct lthread_dump_out *out, const char *fmt, ...)
+{
+    va_list ap;
+
+    /* No single piece of the report is longer */
+    if (sizeof(out->buf) - out->len < 256) {
+        dump_flush(out);
+    }
+    va_start(ap, fmt);
+    out->len += lthread_vformat(out->buf + out->len, sizeof(out->buf) - out->len, fmt, ap);
+    va_end(ap);
+}
+
+/* Writes 'ns' in milliseconds */
+static void
+dump_time(struct lthread_dump_out *out, const char *what, int64_t ns)
+{
+    if (ns < 0) {
+        ns = 0;
+    }
+    dump_printf(out, " %s %lld.%03lld ms", what, (long long)(ns / 1000000),
+            (long long)(ns / 1000 % 1000));
+}
+
+/* Writes 'pc' and the return addresses of the frame pointer chain from
+ * 'fp', as long as it stays within the stack [lo, hi). 'copy' holds the
+ * stack's bytes if they are not on the stack right now
+ */
+static void
+dump_backtrace(struct lthread_dump_out *out, uintptr_t pc, uintptr_t fp,
+        uintptr_t lo, uintptr_t hi, const char *copy)
+{
+    uintptr_t frame[2];
+    size_t depth = 0;
+
+    if (pc != 0) {
+        dump_printf(out, "    #%zu %p\n", depth++, (void *)pc);
+    }
+    while (depth < LTHREAD_DUMP_DEPTH && fp >= lo && fp + sizeof(frame) <= hi &&
+            fp % sizeof(uintptr_t) == 0) {
+        memcpy(frame, copy != NULL ? copy + (fp - lo) : (const char *)fp, sizeof(frame));
+        if (frame[1] == 0) {
+            break;
+        }
+        dump_printf(out, "    #%zu %p\n", depth++, (void *)frame[1]);
+        if (frame[0] <= fp) {
+            break;
+        }
+        fp = frame[0];
+    }
+}
+
+static const char *const dump_status_names[] = {
+    [CREATED] = "created",
+    [RUNNING] = "running",
+    [READY] = "ready",
+    [BLOCKED] = "blocked",
+    [DONE] = "done",
+    [SLEEPING] = "sleeping",
+    [SUSPENDED] = "suspended",
+};
+
+/* Writes the part of lthread_dump about thread 't'. 'now' is when the
+ * report started and 'self' the frame of lthread_dump's caller
+ */
+static void
+dump_lthread(struct lthread_dump_out *out, struct lthread_info *t, int64_t now, uintptr_t self)
+{
+    uintptr_t lo, hi, sp, fp, pc;
+    const char *copy = NULL;
+    size_t size;
+
+    if (t == main_thread) {
+        dump_printf(out, "main");
+        lo = (uintptr_t)main_stack_lo;
+        hi = (uintptr_t)main_stack_hi;
+    }
+    else {
+        dump_printf(out, "lthread %zu", t->id);
+        lo = (uintptr_t)t->stack;
+        hi = lo + lthread_stack_size;
+    }
+    size = hi - lo;
+
+    if ((unsigned int)t->status < sizeof(dump_status_names) / sizeof(dump_status_names[0])) {
+        dump_printf(out, " %s", dump_status_names[t->status]);
+    }
+    else {
+        dump_printf(out, " status %d", (int)t->status);
+    }
+    dump_time(out, "cpu", t->cpu_ns + (t->run_since != 0 ? now - t->run_since : 0));
+    if (t->status == SLEEPING) {
+        dump_time(out, "wakes in", timespec_to_ns(&t->wake_time) - now);
+    }
+    if (t->joiner != NULL) {
+        if (t->joiner == main_thread) {
+            dump_printf(out, " joined by main");
+        }
+        else {
+            dump_printf(out, " joined by %zu", t->joiner->id);
+        }
+    }
+    if (t->rt != NULL) dump_printf(out, " real-time");
+    if (t->flags & LTHREAD_GENERATOR) dump_printf(out, " generator");
+    if (t->flags & LTHREAD_COPY_STACK) dump_printf(out, " copy-stack");
+    if (t->detached) dump_printf(out, " detached");
+    if (t->cancel_pending) dump_printf(out, " canceled");
+
+    /* Where it stopped */
+    if (t == head) {
+        /* Running this, or interrupted by the signal running this */
+        sp = fp = self;
+        pc = 0;
+    }
+    else if (t->regs_saved) {
+        sp = (uintptr_t)t->regs[6];
+        fp = (uintptr_t)t->regs[1];
+        pc = (uintptr_t)t->regs[7];
+    }
+    else {
+        sp = (uintptr_t)t->context.uc_mcontext.gregs[REG_RSP];
+        fp = (uintptr_t)t->context.uc_mcontext.gregs[REG_RBP];
+        pc = (uintptr_t)t->context.uc_mcontext.gregs[REG_RIP];
+    }
+    if ((t->flags & LTHREAD_COPY_STACK) && t != copy_stack_owner) {
+        /* Frames are in the heap copy, if it ever ran */
+        copy = t->stack_copy;
+        lo = hi - t->stack_copy_size;
+        if (t->stack_copy_size == 0) {
+            sp = hi;
+            pc = 0;
+        }
+    }
+
+    if (t->status == DONE || hi == 0 || sp < lo || sp > hi) {
+        dump_printf(out, "\n");
+        return;
+    }
+    dump_printf(out, " stack %zu/%zu\n", (size_t)(hi - sp), size);
+    dump_backtrace(out, pc, fp, lo, hi, copy);
+}
+
+/* Writes the scheduler's queue lengths and who waits on what */
+static void
+dump_queues(struct lthread_dump_out *out)
+{
+    size_t counts[sizeof(dump_status_names) / sizeof(dump_status_names[0])] = { 0 };
+    size_t ii, n, limit = nlthreads + 1;
+    struct lthread_addr_waiter *w;
+    struct lthread_group *g;
+    struct lthread_rt_info *rt;
+    struct lthread_info *t;
+
+    for (ii = 0; ii <= nlthreads; ii++) {
+        t = ii < nlthreads ? lthreads[ii] : main_thread;
+        if (t != NULL && (unsigned int)t->status < sizeof(counts) / sizeof(counts[0])) {
+            counts[t->status]++;
+        }
+    }
+    dump_printf(out, "queue: %zu in the run queue", queue_length);
+    for (ii = 0; ii < sizeof(counts) / sizeof(counts[0]); ii++) {
+        if (counts[ii] != 0) {
+            dump_printf(out, ", %zu %s", counts[ii], dump_status_names[ii]);
+        }
+    }
+    for (n = 0, rt = rt_threads; rt != NULL && n < limit; rt = rt->next) n++;
+    if (n != 0) dump_printf(out, ", %zu real-time", n);
+    for (n = 0, t = reap_list; t != NULL && n < limit; t = t->done_next) n++;
+    if (n != 0) dump_printf(out, ", %zu to reap", n);
+    if (__atomic_load_n(&remote_inbox, __ATOMIC_RELAXED) != NULL) {
+        dump_printf(out, ", remote requests pending");
+    }
+    dump_printf(out, "\n");
+
+    if (sched == &lthread_sched_fair) {
+        for (n = 0, g = fair_groups; g != NULL && n < limit; g = g->next, n++) {
+            dump_printf(out, "group %p: weight %u, %zu threads, %zu runnable",
+                    (void *)g, g->weight, g->stats.threads, g->stats.runnable);
+            dump_time(out, "ran", timespec_to_ns(&g->stats.run_time));
+            dump_printf(out, "\n");
         }
+    }
 
-        /* getcontext doesn't work like setjmp, need to use
-         * status flag to ensure this thread only leaves when it is chosen */
-        if (head->status == RUNNING) {
-            UNBLOCK_SIGNAL();
-            return;
+    for (ii = 0; ii < LTHREAD_WAIT_BUCKETS; ii++) {
+        for (n = 0, w = wait_buckets[ii].head; w != NULL && n < limit; w = w->next, n++) {
+            if (w->thread == main_thread) {
+                dump_printf(out, "main waits on %p\n", (const void *)w->addr);
+            }
+            else {
+                dump_printf(out, "lthread %zu waits on %p\n", w->thread->id,
+                        (const void *)w->addr);
+            }
         }
-        remove_front = 0;
     }
+}
 
-    /* Find next runnable thread in the queue */
-    do {
-        /* Move the list forward one (removing first element if necessary */
-        bump_queue(remove_front);
-        remove_front = 0;
-        /* TODO: Are all these statuses needed? */
-        switch (head->status) {
-            case CREATED:
-                UNBLOCK_SIGNAL();
-                start_thread(head, head->start_routine, head->data, lthread_stack_start(head));
-                break;
-            case RUNNING:
-                fprintf(stderr, "Thread marked running when it shouldn't be!\n");
-                break;
-            case SLEEPING:
-                if (lthread_done_sleeping(head)) {
-                    memset(&head->wake_time, 0, sizeof(head->wake_time));
-                    head->status = READY;
-                }
-                break;
-            case READY:
-                break;
-            case DONE:
-                remove_front = 1;
-                break;
-            case BLOCKED:
-                break;
-            default:
-                fprintf(stderr, "Invalid state %d\n", head->status);
+int
+lthread_dump(int fd)
+{
+    struct lthread_dump_out out = { .fd = fd, .failed = 0, .len = 0 };
+    uintptr_t self = (uintptr_t)__builtin_frame_address(0);
+    sigset_t old_mask;
+    int64_t now;
+
+    if (main_thread == NULL) {
+        return 1;
+    }
+
+    sigprocmask(SIG_BLOCK, &lthread_sig_mask, &old_mask);
+    now = lthread_now_ns();
+    dump_lthread(&out, main_thread, now, self);
+    for (size_t ii = 0; ii < nlthreads; ii++) {
+        if (lthreads[ii] != NULL) {
+            dump_lthread(&out, lthreads[ii], now, self);
         }
-    } while (head->status != READY);
-    /* Setup thread and swap to its context */
-    head->status = RUNNING;
-    setcontext(&head->context);
+    }
+    dump_queues(&out);
+    dump_flush(&out);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+    return out.failed;
 }
 
-/* Cleans up the environment when exiting */
-void
-lthread_cleanup(void)
+static void
+dump_signal_handler(int num, siginfo_t *info, void *context)
 {
-    BLOCK_SIGNAL();
-    /* Delete timer */
-    timer_delete(lthread_timer);
-    /* Free lthreads array */
-    free(lthreads);
-    /* Free main thread information */
-    free(head);
-#ifdef LTHREAD_DEBUG
-    clock_gettime(LTHREAD_CLOCKID, &lthread_end);
-    lthread_debug_print_stats();
-#endif
+    const ucontext_t *interrupted = context;
+    int saved_errno = errno;
+    (void)num, (void)info;
+
+    /* With the scheduling signal blocked the interrupted code may be
+     * halfway through relinking a queue, the scheduler reports once
+     * it's done instead */
+    if (sigismember(&interrupted->uc_sigmask, lthread_sig)) {
+        dump_pending = 1;
+    }
+    else {
+        lthread_dump(dump_fd);
+    }
+    errno = saved_errno;
 }
 
-int lthread_init(void)
+int
+lthread_dump_on_signal(int signo, int fd)
 {
-    struct lthread_info *new_thread;
-    /* Action to perform on LTHREAD_SIG */
     struct sigaction act = {
-        .sa_handler = lthread_alarm_handler, /* Scheduling handler */
-        .sa_flags = SA_RESTART/*0SA_NODEFER*/, /* Can be interrupted within scheduler
-                                -- Maybe this shouldn't be the case? */
-    };
-    struct sigevent event = {
-        .sigev_notify = SIGEV_SIGNAL, /* Call handler on signal */
-        .sigev_signo = LTHREAD_SIG, /* Signal number, based on SIGRTALRM */
-        .sigev_value.sival_ptr = &lthread_timer, /* Timer to use if necessary */
+        .sa_sigaction = dump_signal_handler,
+        .sa_flags = SA_RESTART | SA_SIGINFO,
     };
 
-    /* Allocate thread storage */
-    lthreads = calloc(LTHREAD_INITIAL_LTHREADS, sizeof(*lthreads));
-    nlthreads = LTHREAD_INITIAL_LTHREADS;
-
-    /* Setup signal mask */
-    sigemptyset(&lthread_sig_mask);
-    sigaddset(&lthread_sig_mask, LTHREAD_SIG);
+    if (signo == lthread_sig) {
+        return 1;
+    }
 
-    /* Set LTHREAD_SIG signal handler */
+    /* No switching threads while the report is written */
     sigemptyset(&act.sa_mask);
-    if (sigaction(LTHREAD_SIG , &act, NULL)) {
-        fprintf(stderr, "Failed to set LTHREAD_SIG handler\n");
-        exit(EXIT_FAILURE);
-    }
+    sigaddset(&act.sa_mask, lthread_sig);
+    dump_fd = fd;
+    return sigaction(signo, &act, NULL) != 0;
+}
 
-    /* TODO: Is this where blocking should start? */
-    /* block lthread signal */
-    BLOCK_SIGNAL();
+/* Hands 'rw' to whoever is first in line, if it is free now */
+static void
+rwlock_grant(struct lthread_rwlock *rw)
+{
+    struct lthread_rwlock_waiter *w;
 
-    /* Create timer */
-    if (timer_create(LTHREAD_CLOCKID, &event, &lthread_timer) == -1) {
-        perror("Failed to create timer");
-        exit(EXIT_FAILURE);
+    if (rw->writer || rw->wait_head == NULL) {
+        return;
     }
 
-    /* Setup main thread context */
-    new_thread = malloc(sizeof(*new_thread));
-    new_thread->status = RUNNING;
-    new_thread->id = LTHREAD_MAIN_THREAD;
+    if (rw->wait_head->writer) {
+        if (rw->readers != 0) {
+            return;
+        }
+        w = rw->wait_head;
+        rw->wait_head = w->next;
+        rw->writer = 1;
+        w->granted = 1;
+        wake_lthread(w->thread);
+    }
+    else {
+        /* Every reader up to the next writer shares the lock, along
+         * with readers already holding it if a writer ahead of them was
+         * canceled */
+        while (rw->wait_head != NULL && !rw->wait_head->writer) {
+            w = rw->wait_head;
+            rw->wait_head = w->next;
+            rw->readers++;
+            w->granted = 1;
+            wake_lthread(w->thread);
+        }
+    }
+    if (rw->wait_head == NULL) {
+        rw->wait_tail = NULL;
+    }
+}
 
-    /* Setup main threads context as current context */
-    if (getcontext(&new_thread->context)) {
-        perror("Failed to get context");
-        exit(EXIT_FAILURE);
+/* Puts waiter 'w' at the end of the line for 'rw' */
+static void
+rwlock_enqueue(struct lthread_rwlock *rw, struct lthread_rwlock_waiter *w)
+{
+    if (rw->wait_tail == NULL) {
+        rw->wait_head = w;
+    }
+    else {
+        rw->wait_tail->next = w;
     }
+    rw->wait_tail = w;
+}
 
-    init_queue(new_thread);
+/* Takes waiter 'w' out of the line for 'rw' */
+static void
+rwlock_dequeue(struct lthread_rwlock *rw, struct lthread_rwlock_waiter *w)
+{
+    struct lthread_rwlock_waiter **link = &rw->wait_head, *prev = NULL;
 
-    /* Add cleanup function run at exit() */
-    atexit(lthread_cleanup);
+    while (*link != w) {
+        prev = *link;
+        link = &prev->next;
+    }
+    *link = w->next;
+    if (rw->wait_tail == w) {
+        rw->wait_tail = prev;
+    }
+}
 
-    /* Start scheduled signals */
-    change_alarm(1);
+/* Queues the calling thread on 'rw' and parks it until the lock is
+ * handed to it, must be called with the scheduling signal blocked.
+ * The waiter is off the queue again by the time it is granted, or by
+ * the time a cancel finishes the thread
+ */
+static void
+rwlock_wait(struct lthread_rwlock *rw, int writer)
+{
+    struct lthread_rwlock_waiter local, *w = waiter_record(&local);
 
-#ifdef LTHREAD_DEBUG
-    clock_gettime(LTHREAD_CLOCKID, &lthread_start);
-#endif
+    w->thread = head;
+    w->writer = writer;
+    w->granted = 0;
+    w->next = NULL;
 
-    /* Unblock lthread signal */
-    UNBLOCK_SIGNAL();
+    rwlock_enqueue(rw, w);
+    while (!w->granted) {
+        park_lthread();
+        if (!w->granted && cancel_requested()) {
+            /* Whoever queued behind it may be able to go now */
+            rwlock_dequeue(rw, w);
+            rwlock_grant(rw);
+            cancel_point();
+        }
+    }
+}
 
+int
+lthread_rwlock_init(struct lthread_rwlock *rw)
+{
+    rw->readers = 0;
+    rw->writer = 0;
+    rw->wait_head = NULL;
+    rw->wait_tail = NULL;
     return 0;
 }
 
 int
-lthread_create(lthread *t, void *(*start_routine)(void *data), void *data)
+lthread_rwlock_rdlock(struct lthread_rwlock *rw)
 {
-    void *stack;
-    struct lthread_info *new_thread;
-
-    /* TODO: Should blocking start here? */
-    /* Stop interrupting me! */
     BLOCK_SIGNAL();
-
-    /* Allocate space for new thread stack */
-    stack = mmap(NULL, LTHREAD_STACK_SIZE,
-            PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_STACK, -1, 0);
-    if (stack == MAP_FAILED) {
-        perror("Failed to mmap stack space for new thread: ");
-        exit(EXIT_FAILURE);
+    /* Queued writers go first, so a stream of readers can't starve them */
+    if (rw->writer || rw->wait_head != NULL) {
+        rwlock_wait(rw, 0);
     }
-
-    /* Allocate lthread storage */
-    new_thread = malloc(sizeof(*new_thread));
-    new_thread->id = allocate_lthread();
-    lthreads[new_thread->id] = new_thread;
-    *t = new_thread->id;
-
-    /* Setup thread parameters */
-#ifdef LTHREAD_DEBUG
-    new_thread->stack_reg = VALGRIND_STACK_REGISTER(stack, stack + LTHREAD_STACK_SIZE);
-#endif
-    /* setup structure */
-    new_thread->stack = stack;
-    new_thread->start_routine = start_routine;
-    new_thread->data = data;
-    new_thread->status = READY;
-
-    /* Use current context as starting context */
-    if (getcontext(&new_thread->context)) {
-        perror("Failed to get context");
-        exit(EXIT_FAILURE);
+    else {
+        rw->readers++;
     }
-
-    /* Update current context with desired context for thread start */
-    new_thread->context.uc_stack.ss_sp = stack;
-    new_thread->context.uc_stack.ss_size = LTHREAD_STACK_SIZE;
-    new_thread->context.uc_link = &head->context;
-    makecontext(&new_thread->context, (void(*)(void))lthread_run, 1, new_thread->id);
-
-    /* Add thread to end of scheduling queue */
-    push_queue(new_thread);
-
-    /* OK Now I'm done */
     UNBLOCK_SIGNAL();
-
     return 0;
 }
 
-/* Destroys the thread corresponding to 't'
- * so that it is no longer scheduled, just like
- * it no longer exists
- */
-void
-lthread_destroy(lthread t)
+int
+lthread_rwlock_wrlock(struct lthread_rwlock *rw)
 {
     BLOCK_SIGNAL();
-    /* TODO: Check if valid ID before using */
-    struct lthread_info *thread = lthreads[t];
-    thread->status = DONE;
+    if (rw->writer || rw->readers != 0 || rw->wait_head != NULL) {
+        rwlock_wait(rw, 1);
+    }
+    else {
+        rw->writer = 1;
+    }
     UNBLOCK_SIGNAL();
-    lthread_join(t, NULL);
+    return 0;
 }
 
-/* Similar to pthread_join(), wait for the specified 
- * thread 't' to finish working. The value returned
- * by that thread will be placed in 'retval'
- */
 int
-lthread_join(lthread t, void **retval)
+lthread_rwlock_unlock(struct lthread_rwlock *rw)
 {
-    /* Check that this is a valid thread */
-    if (t >= nlthreads) {
-        return 1;
+    BLOCK_SIGNAL();
+    if (rw->writer) {
+        rw->writer = 0;
     }
-
-    struct lthread_info *thread = lthreads[t];
-    if (thread == NULL) {
+    else if (rw->readers != 0) {
+        rw->readers--;
+    }
+    else {
+        UNBLOCK_SIGNAL();
         return 1;
     }
+    rwlock_grant(rw);
+    UNBLOCK_SIGNAL();
+    return 0;
+}
 
-    /* Wait for the  thread to complete naturally */
-    while (thread->status != DONE) {
-        raise(LTHREAD_SIG);
+void
+lthread_epoch_enter(void)
+{
+    struct lthread_info *me = head;
+    if (me->epoch_nest == 0) {
+        /* Being preempted in between only makes the stamp older, which
+         * holds frees back longer but never lets one through early */
+        me->epoch = global_epoch;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
     }
+    me->epoch_nest++;
+    /* Shared pointers must be read after the section is visible */
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+void
+lthread_epoch_exit(void)
+{
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    head->epoch_nest--;
+}
+
+int
+lthread_defer_free(void *ptr, void (*destroy)(void *ptr))
+{
+    struct lthread_deferred *d;
 
-    /* Save return value and deallocate resources */
     BLOCK_SIGNAL();
-    if (retval != NULL) *retval = thread->data;
-    deallocate_lthread(thread->id);
-    free_lthread(thread);
-    UNBLOCK_SIGNAL();
+    d = malloc(sizeof(*d));
+    if (d == NULL) {
+        UNBLOCK_SIGNAL();
+        return 1;
+    }
+    d->ptr = ptr;
+    d->destroy = destroy;
+    d->next = limbo[global_epoch % 3];
+    limbo[global_epoch % 3] = d;
 
+    /* Scanning every thread is not free, only do it every so often */
+    if (++epoch_deferred >= LTHREAD_EPOCH_RECLAIM) {
+        epoch_deferred = 0;
+        epoch_try_advance();
+    }
+    UNBLOCK_SIGNAL();
 
     return 0;
 }
 
-int
-lthread_sleep(size_t milliseconds)
+/* Returns the wait queue for 'addr' */
+static size_t
+wait_bucket(const volatile int *addr)
 {
-    const size_t nanoseconds = milliseconds * 1000 * 1000;
-    /* Put the current time as the sleep time */
-    if (clock_gettime(LTHREAD_CLOCKID, &head->wake_time)) {
-        perror("Failed to get current clock time");
-        exit(EXIT_FAILURE);
+    return ((uintptr_t)addr / sizeof(*addr)) % LTHREAD_WAIT_BUCKETS;
+}
+
+/* Puts waiter 'w' at the end of its bucket */
+static void
+wait_enqueue(struct lthread_addr_waiter *w)
+{
+    size_t b = wait_bucket(w->addr);
+    w->next = NULL;
+    w->prev = wait_buckets[b].tail;
+    if (w->prev != NULL) {
+        w->prev->next = w;
     }
+    else {
+        wait_buckets[b].head = w;
+    }
+    wait_buckets[b].tail = w;
+}
 
-    /* Add the time to wait to current time */
-    head->wake_time = (struct timespec) {
-        .tv_sec = head->wake_time.tv_sec + (long) nanoseconds / NSEC_PER_SEC,
-        .tv_nsec = head->wake_time.tv_nsec + (long) nanoseconds % NSEC_PER_SEC,
-    };
+/* Takes waiter 'w' out of its bucket */
+static void
+wait_dequeue(struct lthread_addr_waiter *w)
+{
+    size_t b = wait_bucket(w->addr);
+    if (w->prev != NULL) {
+        w->prev->next = w->next;
+    }
+    else {
+        wait_buckets[b].head = w->next;
+    }
+    if (w->next != NULL) {
+        w->next->prev = w->prev;
+    }
+    else {
+        wait_buckets[b].tail = w->prev;
+    }
+}
+
+int
+lthread_wait_on(const volatile int *addr, int expected, const struct timespec *timeout)
+{
+    struct lthread_addr_waiter local, *w;
+    int64_t deadline = 0;
+    int ret = 0;
 
-    /* Make sure nanoseconds value is less than 1000000000 */
-    if (head->wake_time.tv_nsec > NSEC_PER_SEC) {
-        head->wake_time.tv_sec++;
-        head->wake_time.tv_nsec -= NSEC_PER_SEC;
+    if (timeout != NULL) {
+        deadline = lthread_now_ns() + timespec_to_ns(timeout);
     }
 
-    /* This thread is now sleeping */
-    head->status = SLEEPING;
+    BLOCK_SIGNAL();
+    cancel_point();
+    /* Nobody can change it and wake before we're queued */
+    if (*addr != expected) {
+        UNBLOCK_SIGNAL();
+        return 1;
+    }
 
-    /* Scheduler, come and take me! */
-    raise(LTHREAD_SIG);
+    w = waiter_record(&local);
+    w->addr = addr;
+    w->thread = head;
+    w->woken = 0;
+    wait_enqueue(w);
+    if (timeout == NULL) {
+        while (!w->woken && !cancel_requested()) {
+            park_lthread();
+        }
+    }
+    else {
+        while (!w->woken && !cancel_requested() && lthread_now_ns() < deadline) {
+            park_lthread_until(deadline);
+        }
+    }
+    if (!w->woken) {
+        wait_dequeue(w);
+        if (cancel_requested()) {
+            lthread_exit(LTHREAD_CANCELED);
+        }
+        ret = -1;
+    }
+    UNBLOCK_SIGNAL();
 
-    return 0;
+    return ret;
 }
 
 int
-lthread_yield(void)
+lthread_wake(const volatile int *addr, int n)
 {
-    return raise(LTHREAD_SIG);
-}
+    struct lthread_addr_waiter *w, *next;
+    size_t b = wait_bucket(addr);
+    sigset_t old_mask;
+    int woken = 0;
 
-int
-lthread_block(void)
-{
-    return BLOCK_SIGNAL();
+    /* Like lthread_unpark, fine to call with preemption blocked */
+    sigprocmask(SIG_BLOCK, &lthread_sig_mask, &old_mask);
+    for (w = wait_buckets[b].head; w != NULL && woken < n; w = next) {
+        next = w->next;
+        if (w->addr != addr) {
+            continue;
+        }
+        wait_dequeue(w);
+        w->woken = 1;
+        wake_parked_lthread(w->thread);
+        woken++;
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+    return woken;
 }
 
 int
-lthread_unblock(void)
+lthread_wake_handoff(const volatile int *addr)
 {
-    return UNBLOCK_SIGNAL();
+    struct lthread_addr_waiter *w;
+    struct lthread_info *t = NULL;
+    size_t b = wait_bucket(addr);
+    sigset_t old_mask;
+
+    sigprocmask(SIG_BLOCK, &lthread_sig_mask, &old_mask);
+    for (w = wait_buckets[b].head; w != NULL; w = w->next) {
+        if (w->addr == addr) {
+            break;
+        }
+    }
+    if (w != NULL) {
+        t = w->thread;
+        wait_dequeue(w);
+        w->woken = 1;
+        wake_parked_lthread(t);
+        /* Runs before anything else instead of a lap later, and the
+         * caller gets back in once it waits again */
+        if (can_handoff(&old_mask, t)) {
+            handoff_lthread(t, 1);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+    return t != NULL;
 }
@@ -0,0 +1,155 @@
+#include "lthread.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+
+#ifndef LTHREAD_OFFLOAD_THREADS
+#define LTHREAD_OFFLOAD_THREADS 4
+#endif
+
+/* A function call handed to the helper pool, lives on the stack of
+ * the lthread waiting for it unless that is the shared stack of
+ * LTHREAD_COPY_STACK threads
+ */
+struct offload_job {
+    void *(*fn)(void *arg); /* Function to call on a helper thread */
+    void *arg; /* Argument passed to 'fn' */
+    void *result; /* Return value of 'fn' */
+    int done; /* Set once 'result' is valid */
+    lthread waiter; /* lthread parked on the job */
+    struct offload_job *next; /* Next job in the queue */
+};
+
+/* Jobs waiting for a helper, protected by 'offload_lock' */
+static struct offload_job *offload_head = NULL;
+static struct offload_job *offload_tail = NULL;
+static pthread_mutex_t offload_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t offload_cond = PTHREAD_COND_INITIALIZER;
+
+/* Whether the helper threads were started */
+static int offload_started = 0;
+
+/* Helper thread, runs jobs until the process exits */
+static void *
+offload_helper(void *data)
+{
+    struct offload_job *job;
+    lthread waiter;
+    sigset_t mask;
+    (void)data;
+
+    /* Helpers must never run the scheduler */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    for (;;) {
+        pthread_mutex_lock(&offload_lock);
+        while (offload_head == NULL) {
+            pthread_cond_wait(&offload_cond, &offload_lock);
+        }
+        job = offload_head;
+        offload_head = job->next;
+        if (offload_head == NULL) {
+            offload_tail = NULL;
+        }
+        pthread_mutex_unlock(&offload_lock);
+
+        /* The job lives on the waiter's stack, which it may leave as
+         * soon as it sees 'done' */
+        waiter = job->waiter;
+        job->result = job->fn(job->arg);
+        __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+        lthread_unpark_remote(waiter);
+    }
+
+    return NULL;
+}
+
+/* Starts the helper threads, must be called with preemption blocked */
+static int
+start_offload_helpers(void)
+{
+    pthread_t helper;
+
+    for (int ii = 0; ii < LTHREAD_OFFLOAD_THREADS; ii++) {
+        if (pthread_create(&helper, NULL, offload_helper, NULL)) {
+            perror("Failed to create offload helper thread");
+            return 1;
+        }
+        pthread_detach(helper);
+    }
+    offload_started = 1;
+
+    return 0;
+}
+
+int
+lthread_offload(void *(*fn)(void *arg), void *arg, void **result)
+{
+    struct offload_job local = {
+        .fn = fn,
+        .arg = arg,
+        .done = 0,
+        .waiter = lthread_self(),
+        .next = NULL,
+    };
+    struct offload_job *job = &local;
+    int failed = 0, cancel_state;
+
+    /* The helper writes to the job while another thread may have the
+     * shared stack */
+    if (lthread_on_copy_stack(&local)) {
+        job = malloc(sizeof(*job));
+        if (job == NULL) {
+            return 1;
+        }
+        *job = local;
+    }
+
+    /* Holding the lock while preempted would stall the whole scheduler
+     * as soon as another lthread tried to take it
+     */
+    LTHREAD_SAFE {
+        if (!offload_started) {
+            failed = start_offload_helpers();
+        }
+
+        if (!failed) {
+            pthread_mutex_lock(&offload_lock);
+            if (offload_tail == NULL) {
+                offload_head = job;
+            }
+            else {
+                offload_tail->next = job;
+            }
+            offload_tail = job;
+            pthread_cond_signal(&offload_cond);
+            pthread_mutex_unlock(&offload_lock);
+        }
+    }
+
+    if (failed) {
+        if (job != &local) {
+            free(job);
+        }
+        return 1;
+    }
+
+    /* Other lthreads keep running while the helper works. The job lives
+     * on this stack, so a cancel has to wait until it's done
+     */
+    lthread_setcancelstate(LTHREAD_CANCEL_DISABLE, &cancel_state);
+    while (!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) {
+        lthread_park();
+    }
+    lthread_setcancelstate(cancel_state, NULL);
+
+    if (result != NULL) *result = job->result;
+    if (job != &local) {
+        free(job);
+    }
+
+    return 0;
+}
@@ -0,0 +1,182 @@
+#include "lthread.h"
+
+#include <stdlib.h>
+
+#ifndef LTHREAD_PARALLEL_WORKERS
+#define LTHREAD_PARALLEL_WORKERS 4
+#endif
+
+/* Shared description of one parallel loop */
+struct parallel_job {
+    size_t begin; /* First index of the whole range */
+    size_t chunk_size; /* Base number of indices per chunk */
+    size_t chunk_extra; /* Number of chunks that get one extra index */
+    size_t nchunks; /* Total number of chunks */
+    size_t next_chunk; /* Next chunk to be claimed by a worker */
+    void (*body)(size_t begin, size_t end, void *ctx);
+    void *(*map)(size_t begin, size_t end, void *ctx);
+    void *(*combine)(void *a, void *b, void *ctx);
+    void *identity;
+    void *ctx;
+};
+
+/* Splits [begin, end) into chunks of at most 'grain' indices whose
+ * sizes differ by no more than one
+ */
+static void
+parallel_job_split(struct parallel_job *job, size_t begin, size_t end, size_t grain)
+{
+    size_t n = end - begin;
+    if (grain == 0) {
+        grain = 1;
+    }
+    job->begin = begin;
+    job->nchunks = n / grain + (n % grain != 0);
+    job->chunk_size = n / job->nchunks;
+    job->chunk_extra = n % job->nchunks;
+    job->next_chunk = 0;
+}
+
+/* Claims the next chunk of 'job', returns zero when there are none left.
+ *
+ * The counter is bumped with a single atomic instruction, so a worker
+ * preempted here can never leave it half updated and no signal
+ * blocking is required
+ */
+static int
+parallel_job_claim(struct parallel_job *job, size_t *begin, size_t *end)
+{
+    size_t chunk = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED);
+    if (chunk >= job->nchunks) {
+        return 0;
+    }
+
+    /* The first 'chunk_extra' chunks hold one more index */
+    *begin = job->begin + chunk * job->chunk_size +
+        (chunk < job->chunk_extra ? chunk : job->chunk_extra);
+    *end = *begin + job->chunk_size + (chunk < job->chunk_extra);
+    return 1;
+}
+
+/* Worker entry point for lthread_parallel_for */
+static void *
+parallel_for_worker(void *data)
+{
+    struct parallel_job *job = data;
+    size_t begin, end;
+    while (parallel_job_claim(job, &begin, &end)) {
+        job->body(begin, end, job->ctx);
+    }
+    return NULL;
+}
+
+/* Worker entry point for lthread_parallel_reduce, returns the
+ * combination of every chunk this worker processed
+ */
+static void *
+parallel_reduce_worker(void *data)
+{
+    struct parallel_job *job = data;
+    void *partial = job->identity;
+    size_t begin, end;
+    while (parallel_job_claim(job, &begin, &end)) {
+        partial = job->combine(partial, job->map(begin, end, job->ctx), job->ctx);
+    }
+    return partial;
+}
+
+/* Runs 'worker' on a bounded set of lthreads plus the calling thread,
+ * the result of each is saved in 'results' (one slot per worker + 1)
+ */
+static int
+parallel_job_run(struct parallel_job *job, void *(*worker)(void *),
+        void **results, size_t *nresults)
+{
+    lthread workers[LTHREAD_PARALLEL_WORKERS];
+    size_t nworkers = LTHREAD_PARALLEL_WORKERS;
+    struct parallel_job *shared = job;
+    int failed, cancel_state;
+
+    /* The calling thread takes a share, never start idle workers */
+    if (nworkers > job->nchunks - 1) {
+        nworkers = job->nchunks - 1;
+    }
+
+    /* Workers write to the job while another thread may have the stack
+     * shared by LTHREAD_COPY_STACK threads */
+    if (lthread_on_copy_stack(job)) {
+        shared = malloc(sizeof(*shared));
+        if (shared == NULL) {
+            return 1;
+        }
+        *shared = *job;
+    }
+
+    /* Workers share the job, it must outlive all of them */
+    lthread_setcancelstate(LTHREAD_CANCEL_DISABLE, &cancel_state);
+    for (size_t ii = 0; ii < nworkers; ii++) {
+        lthread_create(workers + ii, worker, shared);
+    }
+
+    results[nworkers] = worker(shared);
+    failed = lthread_join_all(workers, nworkers, results);
+    *nresults = nworkers + 1;
+    lthread_setcancelstate(cancel_state, NULL);
+
+    if (shared != job) {
+        free(shared);
+    }
+
+    return failed;
+}
+
+int
+lthread_parallel_for(size_t begin, size_t end, size_t grain,
+        void (*body)(size_t begin, size_t end, void *ctx), void *ctx)
+{
+    struct parallel_job job;
+    void *results[LTHREAD_PARALLEL_WORKERS + 1];
+    size_t nresults;
+
+    if (end <= begin) {
+        return 0;
+    }
+
+    parallel_job_split(&job, begin, end, grain);
+    job.body = body;
+    job.ctx = ctx;
+
+    return parallel_job_run(&job, parallel_for_worker, results, &nresults);
+}
+
+int
+lthread_parallel_reduce(size_t begin, size_t end, size_t grain,
+        void *(*map)(size_t begin, size_t end, void *ctx),
+        void *(*combine)(void *a, void *b, void *ctx),
+        void *identity, void *ctx, void **result)
+{
+    struct parallel_job job;
+    void *results[LTHREAD_PARALLEL_WORKERS + 1];
+    size_t nresults;
+    int failed;
+
+    *result = identity;
+    if (end <= begin) {
+        return 0;
+    }
+
+    parallel_job_split(&job, begin, end, grain);
+    job.map = map;
+    job.combine = combine;
+    job.identity = identity;
+    job.ctx = ctx;
+
+    failed = parallel_job_run(&job, parallel_reduce_worker, results, &nresults);
+
+    /* Fold the partial results of each worker together */
+    for (size_t ii = 0; ii < nresults; ii++) {
+        *result = combine(*result, results[ii], ctx);
+    }
+
+    return failed;
+}
@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <dlfcn.h>
+
+/* Interposition library making common async-signal-unsafe C library
+ * calls safe to make from lthreads without LTHREAD_SAFE:
+ *
+ *   LD_PRELOAD=./liblthread_preload.so ./program
+ *
+ * Each wrapped call runs with preemption deferred by
+ * lthread_preempt_disable, so no other lthread can run and enter the
+ * C library while it holds an internal lock or is halfway through
+ * updating its state. That costs a counter increment and decrement
+ * instead of the two system calls of LTHREAD_SAFE, and only lasts as
+ * long as the call itself.
+ *
+ * Only single calls are covered. Functions keeping state between calls,
+ * strtok, rand or the buffer returned by localtime, still share that
+ * state between all lthreads. Programs not using lthreads, or other OS
+ * threads, just pay for the extra call
+ *
+ * lthread_init hands the library the functions deferring preemption
+ * through lthread_preload_register, until then every wrapper only calls
+ * through
+ */
+
+/* What programs call instead of the plain functions when built with
+ * _FORTIFY_SOURCE, or for the scanf family in C99 and later. Only
+ * declared by stdio.h for the program using them
+ */
+extern int __printf_chk(int flag, const char *fmt, ...);
+extern int __fprintf_chk(FILE *stream, int flag, const char *fmt, ...);
+extern int __dprintf_chk(int fd, int flag, const char *fmt, ...);
+extern int __sprintf_chk(char *str, int flag, size_t len, const char *fmt, ...);
+extern int __snprintf_chk(char *str, size_t size, int flag, size_t len, const char *fmt, ...);
+extern int __vprintf_chk(int flag, const char *fmt, va_list ap);
+extern int __vfprintf_chk(FILE *stream, int flag, const char *fmt, va_list ap);
+extern int __vdprintf_chk(int fd, int flag, const char *fmt, va_list ap);
+extern int __vsprintf_chk(char *str, int flag, size_t len, const char *fmt, va_list ap);
+extern int __vsnprintf_chk(char *str, size_t size, int flag, size_t len, const char *fmt,
+        va_list ap);
+extern char *__fgets_chk(char *s, size_t len, int size, FILE *stream);
+extern size_t __fread_chk(void *ptr, size_t len, size_t size, size_t n, FILE *stream);
+extern int __isoc99_scanf(const char *fmt, ...);
+extern int __isoc99_fscanf(FILE *stream, const char *fmt, ...);
+extern int __isoc99_sscanf(const char *str, const char *fmt, ...);
+extern int __isoc99_vscanf(const char *fmt, va_list ap);
+extern int __isoc99_vfscanf(FILE *stream, const char *fmt, va_list ap);
+extern int __isoc99_vsscanf(const char *str, const char *fmt, va_list ap);
+extern int __isoc23_scanf(const char *fmt, ...);
+extern int __isoc23_fscanf(FILE *stream, const char *fmt, ...);
+extern int __isoc23_sscanf(const char *str, const char *fmt, ...);
+extern int __isoc23_vscanf(const char *fmt, va_list ap);
+extern int __isoc23_vfscanf(FILE *stream, const char *fmt, va_list ap);
+extern int __isoc23_vsscanf(const char *str, const char *fmt, va_list ap);
+
+/* Registered by lthread_init, NULL in programs not using lthreads */
+static void (*preempt_disable)(void) = NULL;
+static void (*preempt_enable)(void) = NULL;
+
+/* The C library's own allocator entry points, which can be used without
+ * dlsym and so without allocating while looking them up
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void *__libc_valloc(size_t size);
+
+/* Called by lthread_init with lthread_preempt_disable and
+ * lthread_preempt_enable, found with dlsym so the program needs no
+ * exported symbols of its own
+ */
+void
+lthread_preload_register(void (*disable)(void), void (*enable)(void))
+{
+    preempt_disable = disable;
+    preempt_enable = enable;
+}
+
+static inline void
+preempt_off(void)
+{
+    if (preempt_disable != NULL) {
+        preempt_disable();
+    }
+}
+
+static inline void
+preempt_on(void)
+{
+    if (preempt_enable != NULL) {
+        preempt_enable();
+    }
+}
+
+/* Declares the pointer to the next definition of 'name' */
+#define REAL(name) static __typeof__(name) *real_##name
+
+/* Looks up the next definition of 'name', the one being wrapped */
+#define RESOLVE(name) (*(void **)&real_##name = dlsym(RTLD_NEXT, #name))
+
+/* Defines wrapper 'name' returning 'type', with parameters 'params'
+ * passed on as 'args'
+ */
+#define WRAP(type, name, params, args) \
+    type name params \
+    { \
+        type ret; \
+        preempt_off(); \
+        ret = real_##name args; \
+        preempt_on(); \
+        return ret; \
+    }
+
+#define WRAP_VOID(name, params, args) \
+    void name params \
+    { \
+        preempt_off(); \
+        real_##name args; \
+        preempt_on(); \
+    }
+
+/* Defines a wrapper for variadic 'name', which calls 'vname' for it */
+#define WRAP_VARIADIC(type, name, params, last, vname, vargs) \
+    type name params \
+    { \
+        type ret; \
+        va_list ap; \
+        va_start(ap, last); \
+        preempt_off(); \
+        ret = real_##vname vargs; \
+        preempt_on(); \
+        va_end(ap); \
+        return ret; \
+    }
+
+REAL(vprintf);
+REAL(vfprintf);
+REAL(vdprintf);
+REAL(vsprintf);
+REAL(vsnprintf);
+REAL(__vprintf_chk);
+REAL(__vfprintf_chk);
+REAL(__vdprintf_chk);
+REAL(__vsprintf_chk);
+REAL(__vsnprintf_chk);
+REAL(__fgets_chk);
+REAL(__fread_chk);
+REAL(__isoc99_vscanf);
+REAL(__isoc99_vfscanf);
+REAL(__isoc99_vsscanf);
+REAL(__isoc23_vscanf);
+REAL(__isoc23_vfscanf);
+REAL(__isoc23_vsscanf);
+REAL(puts);
+REAL(fputs);
+REAL(fputc);
+REAL(putc);
+REAL(putchar);
+REAL(fwrite);
+REAL(fread);
+REAL(fgets);
+REAL(fgetc);
+REAL(getc);
+REAL(getchar);
+REAL(getline);
+REAL(fopen);
+REAL(fdopen);
+REAL(fclose);
+REAL(fflush);
+REAL(fseek);
+REAL(ftell);
+REAL(setvbuf);
+REAL(perror);
+REAL(strtok);
+REAL(strerror);
+REAL(localtime);
+REAL(gmtime);
+REAL(mktime);
+REAL(rand);
+REAL(srand);
+
+/* Looks everything up while loading, dlsym itself isn't safe to
+ * preempt either
+ */
+__attribute__((constructor)) static void
+resolve_all(void)
+{
+    RESOLVE(vprintf);
+    RESOLVE(vfprintf);
+    RESOLVE(vdprintf);
+    RESOLVE(vsprintf);
+    RESOLVE(vsnprintf);
+    RESOLVE(__vprintf_chk);
+    RESOLVE(__vfprintf_chk);
+    RESOLVE(__vdprintf_chk);
+    RESOLVE(__vsprintf_chk);
+    RESOLVE(__vsnprintf_chk);
+    RESOLVE(__fgets_chk);
+    RESOLVE(__fread_chk);
+    /* Missing before glibc 2.38, and then never called */
+    RESOLVE(__isoc99_vscanf);
+    RESOLVE(__isoc99_vfscanf);
+    RESOLVE(__isoc99_vsscanf);
+    RESOLVE(__isoc23_vscanf);
+    RESOLVE(__isoc23_vfscanf);
+    RESOLVE(__isoc23_vsscanf);
+    RESOLVE(puts);
+    RESOLVE(fputs);
+    RESOLVE(fputc);
+    RESOLVE(putc);
+    RESOLVE(putchar);
+    RESOLVE(fwrite);
+    RESOLVE(fread);
+    RESOLVE(fgets);
+    RESOLVE(fgetc);
+    RESOLVE(getc);
+    RESOLVE(getchar);
+    RESOLVE(getline);
+    RESOLVE(fopen);
+    RESOLVE(fdopen);
+    RESOLVE(fclose);
+    RESOLVE(fflush);
+    RESOLVE(fseek);
+    RESOLVE(ftell);
+    RESOLVE(setvbuf);
+    RESOLVE(perror);
+    RESOLVE(strtok);
+    RESOLVE(strerror);
+    RESOLVE(localtime);
+    RESOLVE(gmtime);
+    RESOLVE(mktime);
+    RESOLVE(rand);
+    RESOLVE(srand);
+}
+
+/* malloc family */
+
+#define real_malloc __libc_malloc
+#define real_calloc __libc_calloc
+#define real_realloc __libc_realloc
+#define real_free __libc_free
+#define real_memalign __libc_memalign
+#define real_valloc __libc_valloc
+
+WRAP(void *, malloc, (size_t size), (size))
+WRAP(void *, calloc, (size_t n, size_t size), (n, size))
+WRAP(void *, realloc, (void *ptr, size_t size), (ptr, size))
+WRAP_VOID(free, (void *ptr), (ptr))
+WRAP(void *, memalign, (size_t alignment, size_t size), (alignment, size))
+WRAP(void *, valloc, (size_t size), (size))
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+int
+posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    void *mem;
+
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    mem = memalign(alignment, size);
+    if (mem == NULL) {
+        return ENOMEM;
+    }
+    *ptr = mem;
+    return 0;
+}
+
+/* stdio */
+
+WRAP_VARIADIC(int, printf, (const char *fmt, ...), fmt, vprintf, (fmt, ap))
+WRAP_VARIADIC(int, fprintf, (FILE *stream, const char *fmt, ...), fmt, vfprintf, (stream, fmt, ap))
+WRAP_VARIADIC(int, dprintf, (int fd, const char *fmt, ...), fmt, vdprintf, (fd, fmt, ap))
+WRAP_VARIADIC(int, sprintf, (char *str, const char *fmt, ...), fmt, vsprintf, (str, fmt, ap))
+WRAP_VARIADIC(int, snprintf, (char *str, size_t size, const char *fmt, ...), fmt, vsnprintf,
+        (str, size, fmt, ap))
+WRAP(int, vprintf, (const char *fmt, va_list ap), (fmt, ap))
+WRAP(int, vfprintf, (FILE *stream, const char *fmt, va_list ap), (stream, fmt, ap))
+WRAP(int, vdprintf, (int fd, const char *fmt, va_list ap), (fd, fmt, ap))
+WRAP(int, vsprintf, (char *str, const char *fmt, va_list ap), (str, fmt, ap))
+WRAP(int, vsnprintf, (char *str, size_t size, const char *fmt, va_list ap), (str, size, fmt, ap))
+WRAP(int, puts, (const char *s), (s))
+WRAP(int, fputs, (const char *s, FILE *stream), (s, stream))
+WRAP(int, fputc, (int c, FILE *stream), (c, stream))
+WRAP(int, putc, (int c, FILE *stream), (c, stream))
+WRAP(int, putchar, (int c), (c))
+WRAP(size_t, fwrite, (const void *ptr, size_t size, size_t n, FILE *stream), (ptr, size, n, stream))
+WRAP(size_t, fread, (void *ptr, size_t size, size_t n, FILE *stream), (ptr, size, n, stream))
+WRAP(char *, fgets, (char *s, int size, FILE *stream), (s, size, stream))
+WRAP(int, fgetc, (FILE *stream), (stream))
+WRAP(int, getc, (FILE *stream), (stream))
+WRAP(int, getchar, (void), ())
+WRAP(ssize_t, getline, (char **line, size_t *n, FILE *stream), (line, n, stream))
+WRAP(FILE *, fopen, (const char *path, const char *mode), (path, mode))
+WRAP(FILE *, fdopen, (int fd, const char *mode), (fd, mode))
+WRAP(int, fclose, (FILE *stream), (stream))
+WRAP(int, fflush, (FILE *stream), (stream))
+WRAP(int, fseek, (FILE *stream, long offset, int whence), (stream, offset, whence))
+WRAP(long, ftell, (FILE *stream), (stream))
+WRAP(int, setvbuf, (FILE *stream, char *buf, int mode, size_t size), (stream, buf, mode, size))
+WRAP_VOID(perror, (const char *s), (s))
+
+/* Fortified stdio */
+
+WRAP_VARIADIC(int, __printf_chk, (int flag, const char *fmt, ...), fmt, __vprintf_chk,
+        (flag, fmt, ap))
+WRAP_VARIADIC(int, __fprintf_chk, (FILE *stream, int flag, const char *fmt, ...), fmt,
+        __vfprintf_chk, (stream, flag, fmt, ap))
+WRAP_VARIADIC(int, __dprintf_chk, (int fd, int flag, const char *fmt, ...), fmt,
+        __vdprintf_chk, (fd, flag, fmt, ap))
+WRAP_VARIADIC(int, __sprintf_chk, (char *str, int flag, size_t len, const char *fmt, ...), fmt,
+        __vsprintf_chk, (str, flag, len, fmt, ap))
+WRAP_VARIADIC(int, __snprintf_chk,
+        (char *str, size_t size, int flag, size_t len, const char *fmt, ...), fmt,
+        __vsnprintf_chk, (str, size, flag, len, fmt, ap))
+WRAP(int, __vprintf_chk, (int flag, const char *fmt, va_list ap), (flag, fmt, ap))
+WRAP(int, __vfprintf_chk, (FILE *stream, int flag, const char *fmt, va_list ap),
+        (stream, flag, fmt, ap))
+WRAP(int, __vdprintf_chk, (int fd, int flag, const char *fmt, va_list ap), (fd, flag, fmt, ap))
+WRAP(int, __vsprintf_chk, (char *str, int flag, size_t len, const char *fmt, va_list ap),
+        (str, flag, len, fmt, ap))
+WRAP(int, __vsnprintf_chk,
+        (char *str, size_t size, int flag, size_t len, const char *fmt, va_list ap),
+        (str, size, flag, len, fmt, ap))
+WRAP(char *, __fgets_chk, (char *s, size_t len, int size, FILE *stream), (s, len, size, stream))
+WRAP(size_t, __fread_chk, (void *ptr, size_t len, size_t size, size_t n, FILE *stream),
+        (ptr, len, size, n, stream))
+
+/* scanf family, stdio.h renames calls to these in C99 and later */
+
+WRAP_VARIADIC(int, __isoc99_scanf, (const char *fmt, ...), fmt, __isoc99_vscanf, (fmt, ap))
+WRAP_VARIADIC(int, __isoc99_fscanf, (FILE *stream, const char *fmt, ...), fmt, __isoc99_vfscanf,
+        (stream, fmt, ap))
+WRAP_VARIADIC(int, __isoc99_sscanf, (const char *str, const char *fmt, ...), fmt,
+        __isoc99_vsscanf, (str, fmt, ap))
+WRAP(int, __isoc99_vscanf, (const char *fmt, va_list ap), (fmt, ap))
+WRAP(int, __isoc99_vfscanf, (FILE *stream, const char *fmt, va_list ap), (stream, fmt, ap))
+WRAP(int, __isoc99_vsscanf, (const char *str, const char *fmt, va_list ap), (str, fmt, ap))
+
+/* Also taking binary integers, from glibc 2.38 in C2X mode */
+
+WRAP_VARIADIC(int, __isoc23_scanf, (const char *fmt, ...), fmt, __isoc23_vscanf, (fmt, ap))
+WRAP_VARIADIC(int, __isoc23_fscanf, (FILE *stream, const char *fmt, ...), fmt, __isoc23_vfscanf,
+        (stream, fmt, ap))
+WRAP_VARIADIC(int, __isoc23_sscanf, (const char *str, const char *fmt, ...), fmt,
+        __isoc23_vsscanf, (str, fmt, ap))
+WRAP(int, __isoc23_vscanf, (const char *fmt, va_list ap), (fmt, ap))
+WRAP(int, __isoc23_vfscanf, (FILE *stream, const char *fmt, va_list ap), (stream, fmt, ap))
+WRAP(int, __isoc23_vsscanf, (const char *str, const char *fmt, va_list ap), (str, fmt, ap))
+
+/* Functions with hidden state */
+
+WRAP(char *, strtok, (char *str, const char *delim), (str, delim))
+WRAP(char *, strerror, (int errnum), (errnum))
+WRAP(struct tm *, localtime, (const time_t *t), (t))
+WRAP(struct tm *, gmtime, (const time_t *t), (t))
+WRAP(time_t, mktime, (struct tm *tm), (tm))
+WRAP(int, rand, (void), ())
+WRAP_VOID(srand, (unsigned int seed), (seed))
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "lthread.h"
+
+volatile int cleaned = 0;
+volatile int never = 0;
+volatile int reached = 0;
+volatile int spinning = 1;
+volatile int read_locked = 0;
+struct lthread_rwlock rw = LTHREAD_RWLOCK_INITIALIZER;
+
+static void
+cleanup(void *arg)
+{
+    cleaned += (int)(size_t)arg;
+}
+
+/* Sleeps far longer than the test runs */
+void *
+sleeper(void *data)
+{
+    (void)data;
+    lthread_cleanup_push(cleanup, (void *)1);
+    lthread_cleanup_push(cleanup, (void *)10);
+    lthread_sleep(60 * 1000);
+    lthread_cleanup_pop(0);
+    lthread_cleanup_pop(0);
+    return NULL;
+}
+
+/* Waits on a value nobody changes */
+void *
+waiter(void *data)
+{
+    (void)data;
+    lthread_cleanup_push(cleanup, (void *)100);
+    lthread_wait_on(&never, 0, NULL);
+    lthread_cleanup_pop(0);
+    return NULL;
+}
+
+/* Joins a thread that never finishes on its own */
+void *
+joiner(void *data)
+{
+    lthread_join(*(lthread *)data, NULL);
+    return NULL;
+}
+
+/* Ignores cancels until it is done, then checks for them */
+void *
+worker(void *data)
+{
+    (void)data;
+    lthread_setcancelstate(LTHREAD_CANCEL_DISABLE, NULL);
+    while (spinning) {
+    }
+    reached = 1;
+    lthread_setcancelstate(LTHREAD_CANCEL_ENABLE, NULL);
+    lthread_testcancel();
+    reached = 2;
+    return NULL;
+}
+
+/* Queues for the lock behind whoever holds it */
+void *
+writer(void *data)
+{
+    (void)data;
+    lthread_rwlock_wrlock(&rw);
+    lthread_rwlock_unlock(&rw);
+    return NULL;
+}
+
+void *
+reader(void *data)
+{
+    (void)data;
+    lthread_rwlock_rdlock(&rw);
+    read_locked = 1;
+    lthread_rwlock_unlock(&rw);
+    return NULL;
+}
+
+/* Pops with execute and finishes through lthread_exit */
+void *
+exiter(void *data)
+{
+    (void)data;
+    lthread_cleanup_push(cleanup, (void *)1000);
+    lthread_cleanup_pop(1);
+    lthread_cleanup_push(cleanup, (void *)10000);
+    lthread_exit((void *)42);
+    lthread_cleanup_pop(0);
+    return NULL;
+}
+
+static long
+elapsed_ms(const struct timespec *start)
+{
+    struct timespec end;
+    LTHREAD_SAFE clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1000 + (end.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc, (void) argv;
+
+    lthread s, w, j, busy, e, wr, rd;
+    struct timespec start, timeout = { .tv_sec = 0, .tv_nsec = 5000000 };
+    struct timespec negative = { .tv_sec = -1, .tv_nsec = 0 };
+    void *ret;
+
+    lthread_init();
+
+    lthread_create(&s, sleeper, NULL);
+    lthread_create(&w, waiter, NULL);
+    lthread_create(&j, joiner, &w);
+    lthread_yield();
+
+    /* Nothing finishes by itself */
+    if (lthread_join_timed(s, &ret, &timeout) != -1) {
+        LTHREAD_SAFE printf("Joined a thread that should still sleep\n");
+        return 1;
+    }
+
+    /* Sleepers wake up right away and run their handlers in order */
+    LTHREAD_SAFE clock_gettime(CLOCK_MONOTONIC, &start);
+    if (lthread_cancel(s) != 0 || lthread_join(s, &ret) != 0) {
+        LTHREAD_SAFE printf("Failed to cancel the sleeper\n");
+        return 1;
+    }
+    if (ret != LTHREAD_CANCELED || cleaned != 11) {
+        LTHREAD_SAFE printf("Sleeper returned %p, cleaned %d\n", ret, cleaned);
+        return 1;
+    }
+    if (elapsed_ms(&start) > 1000) {
+        LTHREAD_SAFE printf("Canceled sleeper took %ld ms\n", elapsed_ms(&start));
+        return 1;
+    }
+
+    /* A canceled joiner leaves its target joinable */
+    lthread_cancel(j);
+    if (lthread_join(j, &ret) != 0 || ret != LTHREAD_CANCELED) {
+        LTHREAD_SAFE printf("Failed to cancel the joiner\n");
+        return 1;
+    }
+    if (lthread_join_timed(w, NULL, &timeout) != -1) {
+        LTHREAD_SAFE printf("Waiter finished by itself\n");
+        return 1;
+    }
+    lthread_destroy(w);
+    if (cleaned != 111) {
+        LTHREAD_SAFE printf("Waiter cleaned %d\n", cleaned);
+        return 1;
+    }
+
+    /* Disabled cancellation is acted on at the next point after enabling */
+    lthread_create(&busy, worker, NULL);
+    lthread_yield();
+    lthread_cancel(busy);
+    if (lthread_join_timed(busy, NULL, &timeout) != -1) {
+        LTHREAD_SAFE printf("Canceled while cancellation was disabled\n");
+        return 1;
+    }
+    spinning = 0;
+    if (lthread_join(busy, &ret) != 0 || ret != LTHREAD_CANCELED || reached != 1) {
+        LTHREAD_SAFE printf("Worker reached %d\n", reached);
+        return 1;
+    }
+
+    lthread_create(&e, exiter, NULL);
+    if (lthread_join(e, &ret) != 0 || ret != (void *)42 || cleaned != 11111) {
+        LTHREAD_SAFE printf("lthread_exit returned %p, cleaned %d\n", ret, cleaned);
+        return 1;
+    }
+
+    /* A canceled writer leaves the line, the reader behind it goes */
+    lthread_rwlock_rdlock(&rw);
+    lthread_create(&wr, writer, NULL);
+    lthread_yield();
+    lthread_create(&rd, reader, NULL);
+    lthread_yield();
+    lthread_cancel(wr);
+    if (lthread_join(wr, &ret) != 0 || ret != LTHREAD_CANCELED) {
+        LTHREAD_SAFE printf("Failed to cancel the queued writer\n");
+        return 1;
+    }
+    if (lthread_join_timed(rd, NULL, NULL) != 0 || !read_locked) {
+        LTHREAD_SAFE printf("Reader stuck behind a canceled writer\n");
+        return 1;
+    }
+    lthread_rwlock_unlock(&rw);
+
+    /* Negative timeouts only check */
+    lthread_create(&busy, worker, NULL);
+    if (lthread_join_timed(busy, NULL, &negative) != -1) {
+        LTHREAD_SAFE printf("Joined with a negative timeout\n");
+        return 1;
+    }
+    lthread_join(busy, NULL);
+
+    /* The main thread can't be canceled */
+    if (lthread_cancel(lthread_self()) == 0) {
+        LTHREAD_SAFE printf("Canceled the main thread\n");
+        return 1;
+    }
+
+    printf("Canceled a sleeper, a waiter, a joiner and a queued writer\n");
+
+    return 0;
+}
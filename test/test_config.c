@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include "lthread.h"
+
+#define NUM_SPINNERS (2)
+#define NUM_THREADS (16)
+#define WINDOW_NS (200000000) /* 200ms */
+#define SHORT_QUANTUM_NS (500000) /* 0.5ms */
+#define LONG_QUANTUM_NS (20000000) /* 20ms */
+
+/* Not numbers, out of range or not real-time signals */
+static const char *bad_signals[] = {
+    "4294967296", "99999999999999999999", "-1", "SIG5", "RTMIN-1", "RTMAX+1", "USR1",
+};
+
+volatile int running = 1;
+volatile size_t last = (size_t)-1;
+volatile size_t switches = 0;
+
+static int64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(lthread_clock(), &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct timespec
+to_timespec(int64_t ns)
+{
+    return (struct timespec) {
+        .tv_sec = (time_t)(ns / 1000000000),
+        .tv_nsec = (long)(ns % 1000000000),
+    };
+}
+
+/* Counts every time it takes over from the other spinner */
+void *
+spinner(void *data)
+{
+    size_t me = (size_t)data;
+    while (running) {
+        if (last != me) {
+            last = me;
+            switches++;
+        }
+    }
+    return NULL;
+}
+
+/* Uses most of a small stack */
+void *
+stack_user(void *data)
+{
+    volatile char buf[32 * 1024];
+    memset((char *)buf, (int)(uintptr_t)data, sizeof(buf));
+    return (void *)(uintptr_t)buf[sizeof(buf) - 1];
+}
+
+/* Returns how many times the spinners switched in one window */
+static size_t
+count_switches(void)
+{
+    size_t before = switches;
+    struct timespec deadline = to_timespec(now_ns() + WINDOW_NS);
+    lthread_sleep_until(&deadline);
+    return switches - before;
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc, (void) argv;
+
+    struct lthread_config config;
+    struct sigaction act;
+    struct timespec quantum;
+    lthread spinners[NUM_SPINNERS], threads[NUM_THREADS];
+    size_t fast, slow;
+    void *ret;
+
+    lthread_config_default(&config);
+    if (config.sched != &lthread_sched_round_robin || config.signal != SIGRTMIN) {
+        printf("Unexpected default configuration\n");
+        return 1;
+    }
+
+    quantum = to_timespec(SHORT_QUANTUM_NS);
+    if (lthread_set_quantum(&quantum) == 0) {
+        printf("Changed the quantum before lthread_init\n");
+        return 1;
+    }
+
+    /* Out of range settings are refused before anything starts */
+    config.stack_size = 1;
+    if (lthread_init_ex(&config) == 0) {
+        printf("Accepted a 1 byte stack\n");
+        return 1;
+    }
+    /* Would round up to a page past the end of memory */
+    config.stack_size = SIZE_MAX;
+    if (lthread_init_ex(&config) == 0) {
+        printf("Accepted a stack larger than memory\n");
+        return 1;
+    }
+    lthread_config_default(&config);
+    setenv("LTHREAD_CLOCK", "sundial", 1);
+    if (lthread_init_ex(&config) == 0) {
+        printf("Accepted a bad LTHREAD_CLOCK\n");
+        return 1;
+    }
+    setenv("LTHREAD_CLOCK", "monotonic", 1);
+    for (size_t ii = 0; ii < sizeof(bad_signals) / sizeof(bad_signals[0]); ii++) {
+        setenv("LTHREAD_SIG", bad_signals[ii], 1);
+        if (lthread_init_ex(&config) == 0) {
+            printf("Accepted LTHREAD_SIG '%s'\n", bad_signals[ii]);
+            return 1;
+        }
+    }
+
+    /* The environment takes precedence over the configuration */
+    setenv("LTHREAD_SIG", "RTMIN+2", 1);
+    setenv("LTHREAD_DUMP_SIG", "SIGUSR1", 1);
+    config.stack_size = 64 * 1024;
+    config.initial_lthreads = 1;
+    config.quantum = to_timespec(SHORT_QUANTUM_NS);
+    config.signal = SIGRTMIN + 1;
+    if (lthread_init_ex(&config)) {
+        printf("Failed to initialize\n");
+        return 1;
+    }
+
+    if (lthread_clock() != CLOCK_MONOTONIC) {
+        LTHREAD_SAFE printf("LTHREAD_CLOCK was ignored\n");
+        return 1;
+    }
+    sigaction(SIGRTMIN + 2, NULL, &act);
+    if (!(act.sa_flags & SA_SIGINFO)) {
+        LTHREAD_SAFE printf("Scheduler is not on SIGRTMIN + 2\n");
+        return 1;
+    }
+    sigaction(SIGUSR1, NULL, &act);
+    if (!(act.sa_flags & SA_SIGINFO)) {
+        LTHREAD_SAFE printf("Dump is not on SIGUSR1\n");
+        return 1;
+    }
+    sigaction(SIGRTMIN, NULL, &act);
+    if (act.sa_handler != SIG_DFL) {
+        LTHREAD_SAFE printf("SIGRTMIN was taken over\n");
+        return 1;
+    }
+
+    /* Small stacks are enough, and the table grows past its initial size */
+    for (size_t ii = 0; ii < NUM_THREADS; ii++) {
+        lthread_create(&threads[ii], stack_user, (void *)(uintptr_t)(ii + 1));
+    }
+    for (size_t ii = 0; ii < NUM_THREADS; ii++) {
+        lthread_join(threads[ii], &ret);
+        if ((uintptr_t)ret != ii + 1) {
+            LTHREAD_SAFE printf("Thread %zu returned %zu\n", ii, (size_t)(uintptr_t)ret);
+            return 1;
+        }
+    }
+
+    /* A longer quantum means fewer preemptions between the spinners */
+    for (size_t ii = 0; ii < NUM_SPINNERS; ii++) {
+        lthread_create(&spinners[ii], spinner, (void *)ii);
+    }
+    fast = count_switches();
+
+    quantum = to_timespec(LONG_QUANTUM_NS);
+    if (lthread_set_quantum(&quantum)) {
+        LTHREAD_SAFE printf("Failed to change the quantum\n");
+        return 1;
+    }
+    slow = count_switches();
+
+    quantum = to_timespec(0);
+    if (lthread_set_quantum(&quantum) == 0) {
+        LTHREAD_SAFE printf("Accepted a zero quantum\n");
+        return 1;
+    }
+
+    running = 0;
+    for (size_t ii = 0; ii < NUM_SPINNERS; ii++) {
+        lthread_join(spinners[ii], NULL);
+    }
+
+    LTHREAD_SAFE printf("%zu switches with a %dus quantum, %zu with %dus\n",
+            fast, SHORT_QUANTUM_NS / 1000, slow, LONG_QUANTUM_NS / 1000);
+    if (slow * 4 > fast) {
+        LTHREAD_SAFE printf("Changing the quantum had no effect\n");
+        return 1;
+    }
+
+    return 0;
+}
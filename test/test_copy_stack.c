@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lthread.h"
+
+#define NUM_THREADS (10000)
+#define NUM_SPINNERS (4)
+#define DEPTH (64)
+#define NUM_BORROWERS (8)
+#define RANGE (1000)
+
+/* Parked threads are released by bumping the gate */
+volatile int gate = 0;
+volatile size_t parked = 0;
+volatile int running = 1;
+struct lthread_rwlock rw = LTHREAD_RWLOCK_INITIALIZER;
+size_t total = 0;
+
+/* Recurses 'depth' frames, checking each one survived the switches */
+static size_t
+nested(size_t id, int depth)
+{
+    volatile size_t frame[4] = { id, id + 1, id + 2, (size_t)depth };
+    size_t ret;
+
+    if (depth == 0) {
+        lthread_yield();
+        return 0;
+    }
+    ret = nested(id, depth - 1);
+    if (frame[0] != id || frame[1] != id + 1 || frame[2] != id + 2 ||
+            frame[3] != (size_t)depth) {
+        return SIZE_MAX / 2;
+    }
+    return ret + 1;
+}
+
+/* Mostly parked, like a connection handler waiting for input */
+void *
+handler(void *data)
+{
+    size_t id = (size_t)data;
+    volatile size_t canary[8];
+
+    for (size_t ii = 0; ii < 8; ii++) {
+        canary[ii] = id * 8 + ii;
+    }
+    parked++;
+    while (gate == 0) {
+        lthread_wait_on(&gate, 0, NULL);
+    }
+    for (size_t ii = 0; ii < 8; ii++) {
+        if (canary[ii] != id * 8 + ii) {
+            return (void *)1;
+        }
+    }
+
+    lthread_rwlock_wrlock(&rw);
+    total += id;
+    lthread_rwlock_unlock(&rw);
+
+    if (id % 100 == 0 && nested(id, DEPTH) != DEPTH) {
+        return (void *)1;
+    }
+    return NULL;
+}
+
+void *
+spinner(void *data)
+{
+    (void)data;
+    while (running) {
+    }
+    return NULL;
+}
+
+void *
+counter(void *data)
+{
+    (void)data;
+    for (size_t ii = 0; ii < 3; ii++) {
+        lthread_yield_value((void *)ii);
+    }
+    return NULL;
+}
+
+static void
+cleanup(void *arg)
+{
+    *(volatile int *)arg = 1;
+}
+
+/* Parks forever, until canceled */
+void *
+waiter(void *data)
+{
+    lthread_cleanup_push(cleanup, data);
+    lthread_wait_on(&running, 1, NULL);
+    lthread_cleanup_pop(0);
+    return NULL;
+}
+
+/* Blocks its helper long enough for other threads to take the stack */
+void *
+slow_double(void *data)
+{
+    struct timespec delay = { .tv_sec = 0, .tv_nsec = 5000000 };
+    nanosleep(&delay, NULL);
+    return (void *)((size_t)data * 2);
+}
+
+void *
+sum_range(size_t begin, size_t end, void *ctx)
+{
+    size_t sum = 0;
+    (void)ctx;
+    for (size_t ii = begin; ii < end; ii++) {
+        sum += ii;
+    }
+    return (void *)sum;
+}
+
+void *
+add(void *a, void *b, void *ctx)
+{
+    (void)ctx;
+    return (void *)((size_t)a + (size_t)b);
+}
+
+void *
+child(void *data)
+{
+    return data;
+}
+
+/* Uses everything that has other threads write to its records while
+ * other copy-stack threads have the stack */
+void *
+borrower(void *data)
+{
+    size_t id = (size_t)data;
+    struct lthread_waitset local, *ws;
+    void *result;
+    lthread t, done;
+
+    if (lthread_offload(slow_double, data, &result) || (size_t)result != id * 2) {
+        return (void *)1;
+    }
+    if (lthread_parallel_reduce(0, RANGE, 10, sum_range, add, NULL, NULL, &result) ||
+            (size_t)result != RANGE * (RANGE - 1) / 2) {
+        return (void *)2;
+    }
+
+    /* A wait-set on the shared stack is refused, one in the heap works */
+    lthread_waitset_init(&local);
+    lthread_create(&t, child, data);
+    if (!lthread_on_copy_stack(&local) || lthread_waitset_add(&local, t) == 0) {
+        return (void *)3;
+    }
+    ws = malloc(sizeof(*ws));
+    lthread_waitset_init(ws);
+    if (lthread_waitset_add(ws, t) || lthread_waitset_next(ws, &done, &result) ||
+            done != t || result != data) {
+        return (void *)4;
+    }
+    free(ws);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc, (void) argv;
+
+    static lthread threads[NUM_THREADS];
+    lthread spinners[NUM_SPINNERS], borrowers[NUM_BORROWERS], gen, w;
+    volatile int cleaned = 0;
+    struct timespec start, end;
+    size_t expected = 0;
+    void *ret, *value;
+    long ms;
+
+    lthread_init();
+
+    if (lthread_create_ex(&w, waiter, NULL, LTHREAD_COPY_STACK | LTHREAD_INTEGER_ONLY) == 0) {
+        LTHREAD_SAFE printf("Created a copy-stack thread without a stack pointer\n");
+        return 1;
+    }
+
+    for (size_t ii = 0; ii < NUM_SPINNERS; ii++) {
+        lthread_create(&spinners[ii], spinner, NULL);
+    }
+
+    LTHREAD_SAFE clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t ii = 0; ii < NUM_THREADS; ii++) {
+        lthread_create_ex(&threads[ii], handler, (void *)ii, LTHREAD_COPY_STACK);
+        expected += ii;
+    }
+    /* Let every handler get as far as parking */
+    while (parked != NUM_THREADS) {
+        lthread_sleep(1);
+    }
+
+    gate = 1;
+    lthread_wake(&gate, NUM_THREADS);
+    for (size_t ii = 0; ii < NUM_THREADS; ii++) {
+        if (lthread_join(threads[ii], &ret) != 0 || ret != NULL) {
+            LTHREAD_SAFE printf("Handler %zu lost its stack\n", ii);
+            return 1;
+        }
+    }
+    LTHREAD_SAFE clock_gettime(CLOCK_MONOTONIC, &end);
+    ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+
+    if (total != expected) {
+        LTHREAD_SAFE printf("Total %zu, expected %zu\n", total, expected);
+        return 1;
+    }
+
+    /* Generators switch directly, without the scheduler */
+    lthread_create_ex(&gen, counter, NULL, LTHREAD_GENERATOR | LTHREAD_COPY_STACK);
+    for (size_t ii = 0; ii < 3; ii++) {
+        if (lthread_resume(gen, &value) != 0 || value != (void *)ii) {
+            LTHREAD_SAFE printf("Generator yielded %p, expected %zu\n", value, ii);
+            return 1;
+        }
+    }
+    if (lthread_resume(gen, &value) != 1 || lthread_join(gen, NULL) != 0) {
+        LTHREAD_SAFE printf("Generator didn't finish\n");
+        return 1;
+    }
+
+    /* Canceled while its frames are off the stack */
+    lthread_create_ex(&w, waiter, (void *)&cleaned, LTHREAD_COPY_STACK);
+    lthread_create_ex(&gen, counter, NULL, LTHREAD_COPY_STACK);
+    lthread_sleep(10);
+    lthread_destroy(w);
+    lthread_join(gen, NULL);
+    if (!cleaned) {
+        LTHREAD_SAFE printf("Cleanup handler didn't run\n");
+        return 1;
+    }
+
+    for (size_t ii = 0; ii < NUM_BORROWERS; ii++) {
+        lthread_create_ex(&borrowers[ii], borrower, (void *)(ii + 1), LTHREAD_COPY_STACK);
+    }
+    for (size_t ii = 0; ii < NUM_BORROWERS; ii++) {
+        if (lthread_join(borrowers[ii], &ret) != 0 || ret != NULL) {
+            LTHREAD_SAFE printf("Borrower %zu failed at step %zu\n", ii, (size_t)ret);
+            return 1;
+        }
+    }
+
+    running = 0;
+    lthread_join_all(spinners, NUM_SPINNERS, NULL);
+
+    printf("%d threads sharing one stack parked and finished in %ld ms\n",
+            NUM_THREADS, ms);
+
+    return 0;
+}
@@ -0,0 +1,187 @@
+#include <cstdio>
+#include <cstdlib>
+#include <array>
+#include <mutex>
+#include <new>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "lthread.hpp"
+
+#define NUM_THREADS (16)
+#define INCREMENTS (2000)
+
+/* Counts C++ allocations, starting threads shouldn't make any */
+static volatile std::size_t allocations = 0;
+
+void *
+operator new(std::size_t size)
+{
+    allocations = allocations + 1;
+    if (void *p = std::malloc(size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void
+operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void
+operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+static int
+fail(const char *what)
+{
+    LTHREAD_SAFE std::printf("%s\n", what);
+    return 1;
+}
+
+int main()
+{
+    lthreads::mutex lock;
+    lthreads::shared_mutex rw;
+    lthreads::no_preempt np;
+    std::array<long, 256> weights;
+    std::size_t before;
+    long counter = 0, total = 0, seen = 0;
+
+    lthread_init();
+
+    for (std::size_t ii = 0; ii < weights.size(); ii++) {
+        weights[ii] = (long)ii;
+    }
+
+    /* A large capture lives on the new stack, nothing is allocated */
+    {
+        std::vector<lthreads::thread> threads;
+        threads.reserve(NUM_THREADS);
+        before = allocations;
+        for (int ii = 0; ii < NUM_THREADS; ii++) {
+            threads.push_back(lthreads::spawn([&, weights]() {
+                for (int jj = 0; jj < INCREMENTS; jj++) {
+                    std::lock_guard<lthreads::mutex> guard(lock);
+                    long seen_before = counter;
+                    lthread_yield();
+                    counter = seen_before + 1;
+                }
+                std::lock_guard<lthreads::mutex> guard(lock);
+                for (long w : weights) {
+                    total += w;
+                }
+            }));
+        }
+        if (allocations != before) {
+            return fail("Spawning threads allocated");
+        }
+        /* Joined as the vector goes away */
+    }
+    if (counter != NUM_THREADS * INCREMENTS) {
+        return fail("Lost updates under lthreads::mutex");
+    }
+    if (total != NUM_THREADS * 255 * 256 / 2) {
+        return fail("Captured array was not copied intact");
+    }
+
+    /* Moving a thread hands over the join */
+    {
+        lthreads::thread a = lthreads::spawn([&]() {
+            std::shared_lock<lthreads::shared_mutex> guard(rw);
+            seen++;
+        });
+        lthreads::thread b(std::move(a));
+        if (a.joinable() || !b.joinable()) {
+            return fail("Move didn't transfer ownership");
+        }
+        b.join();
+        if (b.joinable() || seen != 1) {
+            return fail("Join didn't finish the thread");
+        }
+    }
+
+    /* Typed results, and exceptions travel through the future. Nothing
+     * runs before the count is checked, 'broken' allocates when it does */
+    lthread_preempt_disable();
+    before = allocations;
+    auto answer = lthreads::async([]() { return 6 * 7; });
+    auto nothing = lthreads::async([&]() {
+        std::unique_lock<lthreads::shared_mutex> guard(rw);
+        seen++;
+    });
+    auto broken = lthreads::async([&]() -> int {
+        /* Throwing allocates, which must not be preempted */
+        std::lock_guard<lthreads::no_preempt> guard(np);
+        throw std::runtime_error("expected");
+    });
+    if (allocations != before) {
+        return fail("Starting async threads allocated");
+    }
+    lthread_preempt_enable();
+    if (answer.get() != 42) {
+        return fail("Wrong async result");
+    }
+    nothing.get();
+    if (seen != 2) {
+        return fail("void async didn't run");
+    }
+    try {
+        broken.get();
+        return fail("Exception was lost");
+    }
+    catch (const std::runtime_error &) {
+    }
+    if (answer.valid() || nothing.valid() || broken.valid()) {
+        return fail("Futures still valid after get");
+    }
+
+    /* Futures that move around, or are dropped without get */
+    {
+        auto str = lthreads::async([&]() {
+            std::lock_guard<lthreads::no_preempt> guard(np);
+            return std::string(100, 'x');
+        });
+        lthreads::future<std::string> moved;
+        moved = std::move(str);
+        if (str.valid() || moved.get().size() != 100) {
+            return fail("Moved future lost its result");
+        }
+        /* No state left to wait on, in either of them */
+        for (auto *empty : { &str, &moved }) {
+            try {
+                std::lock_guard<lthreads::no_preempt> guard(np);
+                empty->wait();
+                return fail("Waited on a future without a thread");
+            }
+            catch (const std::future_error &e) {
+                if (e.code() != std::future_errc::no_state) {
+                    return fail("Wrong error from an empty future");
+                }
+            }
+        }
+        try {
+            std::lock_guard<lthreads::no_preempt> guard(np);
+            lthreads::future<int>().get();
+            return fail("Got a default constructed future");
+        }
+        catch (const std::future_error &) {
+        }
+        auto dropped = lthreads::async([]() { return 1; });
+        (void)dropped;
+    }
+
+    /* Scoped LTHREAD_SAFE */
+    {
+        std::lock_guard<lthreads::no_preempt> guard(np);
+        std::printf("%d threads, counter %ld\n", NUM_THREADS, counter);
+    }
+
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "lthread.h"
+
+#define BATCH (1000)
+
+void *
+double_it(void *data)
+{
+    lthread_yield();
+    return (void *)((uintptr_t)data * 2);
+}
+
+/* Checks every thread in 'threads' returns double its argument */
+static int
+join_batch(lthread *threads, void **args, size_t n)
+{
+    void *ret;
+    for (size_t ii = 0; ii < n; ii++) {
+        lthread_join(threads[ii], &ret);
+        if ((uintptr_t)ret != (uintptr_t)args[ii] * 2) {
+            LTHREAD_SAFE printf("Thread %zu returned %zu\n", ii, (size_t)(uintptr_t)ret);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc, (void) argv;
+
+    static lthread first[BATCH], second[BATCH];
+    static void *args[BATCH];
+    lthread single;
+
+    lthread_init();
+
+    for (size_t ii = 0; ii < BATCH; ii++) {
+        args[ii] = (void *)(uintptr_t)ii;
+    }
+
+    if (lthread_create_n(first, BATCH, double_it, args)) {
+        printf("Failed to create first batch\n");
+        return 1;
+    }
+
+    /* Free half the first batch so the second reuses their slots */
+    if (join_batch(first, args, BATCH / 2)) {
+        return 1;
+    }
+
+    if (lthread_create_n(second, BATCH, double_it, args)) {
+        LTHREAD_SAFE printf("Failed to create second batch\n");
+        return 1;
+    }
+
+    /* Batches mix with threads made one at a time */
+    lthread_create(&single, double_it, args[1]);
+
+    if (join_batch(first + BATCH / 2, args + BATCH / 2, BATCH - BATCH / 2) ||
+            join_batch(second, args, BATCH) || join_batch(&single, args + 1, 1)) {
+        return 1;
+    }
+
+    /* No arguments means every thread gets NULL */
+    if (lthread_create_n(first, BATCH, double_it, NULL) ||
+            lthread_join_all(first, BATCH, NULL)) {
+        LTHREAD_SAFE printf("Failed batch without arguments\n");
+        return 1;
+    }
+
+    LTHREAD_SAFE printf("Created and joined %d threads in batches\n", 3 * BATCH);
+
+    return 0;
+}
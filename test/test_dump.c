@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <dlfcn.h>
+
+#include "lthread.h"
+
+volatile int running = 1;
+volatile int never = 0;
+
+/* Should show up in the sleeper's backtrace */
+void
+deep_sleep(void)
+{
+    lthread_sleep(60 * 1000);
+}
+
+void *
+sleeper(void *data)
+{
+    (void)data;
+    deep_sleep();
+    return NULL;
+}
+
+void *
+waiter(void *data)
+{
+    (void)data;
+    lthread_wait_on(&never, 0, NULL);
+    return NULL;
+}
+
+void *
+spinner(void *data)
+{
+    (void)data;
+    while (running) {
+    }
+    return NULL;
+}
+
+/* Reads back everything written to 'fd' since the last call */
+static char *
+read_report(int fd)
+{
+    static char report[65536];
+    static off_t offset = 0;
+    ssize_t len;
+
+    len = pread(fd, report, sizeof(report) - 1, offset);
+    if (len < 0) {
+        len = 0;
+    }
+    offset += len;
+    report[len] = '\0';
+    return report;
+}
+
+/* Returns non-zero if a backtrace line in 'report' is in function 'name' */
+static int
+has_frame(const char *report, const char *name)
+{
+    const char *line = report;
+    Dl_info info;
+    void *addr;
+
+    while ((line = strstr(line, "    #")) != NULL) {
+        line = strstr(line, "0x");
+        addr = (void *)(size_t)strtoull(line, NULL, 16);
+        if (dladdr(addr, &info) != 0 && info.dli_sname != NULL &&
+                strcmp(info.dli_sname, name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc, (void) argv;
+
+    lthread s, w, spin;
+    char line[64], *report;
+    int fd = fileno(tmpfile());
+    struct sigevent event = { .sigev_notify = SIGEV_SIGNAL, .sigev_signo = SIGUSR1 };
+    struct itimerspec soon = { .it_value = { .tv_nsec = 5000000 } };
+    timer_t timer;
+
+    lthread_init();
+
+    lthread_create(&s, sleeper, NULL);
+    lthread_create(&w, waiter, NULL);
+    lthread_create(&spin, spinner, NULL);
+    lthread_sleep(10);
+
+    if (lthread_dump(fd) != 0) {
+        printf("Failed to write the report\n");
+        return 1;
+    }
+    report = read_report(fd);
+
+    if (strstr(report, "main running") == NULL) {
+        printf("Main thread missing from the report:\n%s", report);
+        return 1;
+    }
+    snprintf(line, sizeof(line), "lthread %zu sleeping", s);
+    if (strstr(report, line) == NULL || strstr(report, "wakes in") == NULL) {
+        printf("Sleeper missing from the report:\n%s", report);
+        return 1;
+    }
+    snprintf(line, sizeof(line), "lthread %zu waits on %p", w, (void *)&never);
+    if (strstr(report, line) == NULL) {
+        printf("Waiter missing from the report:\n%s", report);
+        return 1;
+    }
+    if (strstr(report, "queue: ") == NULL || strstr(report, " stack ") == NULL) {
+        printf("Queue or stack sizes missing from the report:\n%s", report);
+        return 1;
+    }
+    if (!has_frame(report, "deep_sleep") || !has_frame(report, "main")) {
+        printf("Backtraces missing from the report:\n%s", report);
+        return 1;
+    }
+
+    /* The same report on a signal, while a thread is running */
+    if (lthread_dump_on_signal(SIGUSR1, fd) != 0) {
+        printf("Failed to catch SIGUSR1\n");
+        return 1;
+    }
+    raise(SIGUSR1);
+    report = read_report(fd);
+    snprintf(line, sizeof(line), "lthread %zu ready", spin);
+    if (strstr(report, line) == NULL || !has_frame(report, "deep_sleep")) {
+        printf("Signal didn't write the report:\n%s", report);
+        return 1;
+    }
+
+    /* Held back while the scheduler's lists may be changing ... */
+    LTHREAD_SAFE {
+        raise(SIGUSR1);
+        report = read_report(fd);
+    }
+    if (report[0] != '\0') {
+        printf("Signal wrote the report with scheduling blocked:\n%s", report);
+        return 1;
+    }
+    /* ... and written by the scheduler once they're done */
+    lthread_sleep(10);
+    report = read_report(fd);
+    if (strstr(report, "main ") == NULL) {
+        printf("Report held back by LTHREAD_SAFE never came\n");
+        return 1;
+    }
+
+    running = 0;
+    lthread_join(spin, NULL);
+
+    /* Arriving while the scheduler waits with nothing to run */
+    timer_create(CLOCK_MONOTONIC, &event, &timer);
+    timer_settime(timer, 0, &soon, NULL);
+    lthread_sleep(50);
+    timer_delete(timer);
+    report = read_report(fd);
+    if (strstr(report, "main sleeping") == NULL) {
+        printf("No report while every thread waited:\n%s", report);
+        return 1;
+    }
+
+    lthread_destroy(s);
+    lthread_destroy(w);
+
+    printf("Reported on 4 threads, on demand, on a signal and while idle\n");
+
+    return 0;
+}
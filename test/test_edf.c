@@ -0,0 +1,76 @@
+#include <stdio.h>
+
+#include "lthread.h"
+
+#define NUM_BUSY_THREADS (40)
+#define PERIODS (200)
+#define PERIOD_NS (5000000) /* 5ms */
+#define DEADLINE_NS (2000000) /* 2ms */
+
+/* Set once the real-time thread is done so the busy threads stop */
+volatile int done = 0;
+
+void *
+busy(void *data)
+{
+    (void)data;
+    volatile size_t spin = 0;
+    while (!done) {
+        spin++;
+    }
+    return NULL;
+}
+
+void *
+control_loop(void *data)
+{
+    (void)data;
+    struct lthread_rt_params params = {
+        .period = { .tv_sec = 0, .tv_nsec = PERIOD_NS },
+        .deadline = { .tv_sec = 0, .tv_nsec = DEADLINE_NS },
+    };
+    struct lthread_rt_stats *stats = data;
+
+    lthread_set_rt(&params);
+    for (int ii = 0; ii < PERIODS; ii++) {
+        /* A little bit of work each period */
+        for (volatile int jj = 0; jj < 10000; jj++) {
+        }
+        lthread_rt_wait_period();
+    }
+    lthread_get_rt_stats(stats);
+    done = 1;
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc, (void) argv;
+
+    lthread threads[NUM_BUSY_THREADS];
+    lthread rt_thread;
+    struct lthread_rt_stats stats;
+
+    lthread_init();
+
+    for (int ii = 0; ii < NUM_BUSY_THREADS; ii++) {
+        lthread_create(threads + ii, busy, NULL);
+    }
+    lthread_create(&rt_thread, control_loop, &stats);
+
+    lthread_join(rt_thread, NULL);
+    lthread_join_all(threads, NUM_BUSY_THREADS, NULL);
+
+    /* Round-robin through all the busy threads would take 20ms,
+     * allow for some noise from the host but not for that
+     */
+    LTHREAD_SAFE printf("%zu jobs, %zu deadline misses\n",
+            stats.jobs, stats.deadline_misses);
+    if (stats.jobs != PERIODS || stats.deadline_misses > PERIODS / 10) {
+        LTHREAD_SAFE printf("Too many deadline misses\n");
+        return 1;
+    }
+
+    return 0;
+}
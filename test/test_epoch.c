@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lthread.h"
+
+#define NUM_READERS (8)
+#define VALUES (16)
+#define VERSIONS (2000)
+#define SLOW_READER_YIELDS (200)
+
+/* Every value equals 'version' in a consistent copy */
+struct table {
+    size_t version;
+    size_t values[VALUES];
+};
+
+struct table *volatile current;
+volatile int done = 0;
+volatile int torn = 0;
+volatile size_t reclaimed = 0;
+size_t reads = 0;
+
+/* Scribbles over a table before freeing it, so a reader that could
+ * still see it would notice
+ */
+void
+destroy_table(void *ptr)
+{
+    memset(ptr, 0xff, sizeof(struct table));
+    free(ptr);
+    reclaimed++;
+}
+
+/* Holds each table across 'data' yields */
+void *
+reader(void *data)
+{
+    size_t yields = (size_t)data;
+    struct table *t;
+    while (!done) {
+        lthread_epoch_enter();
+        t = current;
+        for (size_t ii = 0; ii < VALUES; ii++) {
+            if (t->values[ii] != t->version) torn = 1;
+            /* Let the writer swap versions under us */
+            if (ii == VALUES / 2) {
+                for (size_t jj = 0; jj < yields; jj++) lthread_yield();
+            }
+        }
+        lthread_epoch_exit();
+        LTHREAD_SAFE reads++;
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc, (void) argv;
+
+    lthread threads[NUM_READERS];
+    struct table *next, *old;
+
+    lthread_init();
+
+    LTHREAD_SAFE current = calloc(1, sizeof(*current));
+
+    /* One reader holds on to tables far longer than the rest */
+    for (size_t ii = 0; ii < NUM_READERS; ii++) {
+        lthread_create(threads + ii, reader,
+                (void *)(size_t)(ii == 0 ? SLOW_READER_YIELDS : 1));
+    }
+
+    /* Publish new versions by pointer swap, never waiting on readers */
+    for (size_t version = 1; version <= VERSIONS; version++) {
+        LTHREAD_SAFE next = malloc(sizeof(*next));
+        next->version = version;
+        for (size_t ii = 0; ii < VALUES; ii++) {
+            next->values[ii] = version;
+        }
+        old = current;
+        current = next;
+        lthread_defer_free(old, destroy_table);
+        lthread_yield();
+    }
+
+    done = 1;
+    lthread_join_all(threads, NUM_READERS, NULL);
+
+    LTHREAD_SAFE printf("%zu reads, %zu of %d old versions reclaimed\n",
+            reads, (size_t)reclaimed, VERSIONS);
+
+    if (torn) {
+        LTHREAD_SAFE printf("A reader saw a reclaimed or partial table\n");
+        return 1;
+    }
+    if (reclaimed == 0) {
+        LTHREAD_SAFE printf("Nothing was reclaimed while readers ran\n");
+        return 1;
+    }
+
+    return 0;
+}
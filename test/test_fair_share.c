@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "lthread.h"
+
+#define MANY_THREADS (20)
+#define RUN_MS (600)
+
+volatile int running = 1;
+volatile size_t sleeps = 0;
+
+struct lthread_group crowd, single, heavy;
+lthread crowd_threads[MANY_THREADS], single_thread, heavy_threads[2], napper;
+
+static double
+seconds(const struct timespec *ts)
+{
+    return (double)ts->tv_sec + (double)ts->tv_nsec / 1e9;
+}
+
+void *
+spinner(void *data)
+{
+    (void)data;
+    while (running) {
+    }
+    return NULL;
+}
+
+/* Sleeps in short naps, checks sleepers still get woken */
+void *
+sleeper(void *data)
+{
+    (void)data;
+    while (running) {
+        lthread_sleep(2);
+        sleeps++;
+    }
+    return NULL;
+}
+
+/* Creates the crowd from inside its group, they inherit it */
+void *
+spawner(void *data)
+{
+    (void)data;
+    for (size_t ii = 0; ii < MANY_THREADS; ii++) {
+        lthread_create(&crowd_threads[ii], spinner, NULL);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc, (void) argv;
+
+    struct lthread_group_stats crowd_stats, single_stats, heavy_stats;
+    double crowd_time, single_time, heavy_time;
+    lthread t;
+
+    if (lthread_init_sched(&lthread_sched_fair)) {
+        printf("Failed to start the fair-share policy\n");
+        return 1;
+    }
+
+    if (lthread_group_init(&crowd, 0) == 0) {
+        LTHREAD_SAFE printf("Accepted a zero weight\n");
+        return 1;
+    }
+    lthread_group_init(&crowd, LTHREAD_GROUP_WEIGHT_DEFAULT);
+    lthread_group_init(&single, LTHREAD_GROUP_WEIGHT_DEFAULT);
+    lthread_group_init(&heavy, 2 * LTHREAD_GROUP_WEIGHT_DEFAULT);
+
+    /* In its group before it can create anything */
+    lthread_group_create(&crowd, &t, spawner, NULL, 0);
+    lthread_join(t, NULL);
+
+    lthread_group_create(&single, &single_thread, spinner, NULL, 0);
+    for (size_t ii = 0; ii < 2; ii++) {
+        lthread_group_create(&heavy, &heavy_threads[ii], spinner, NULL, 0);
+    }
+    /* Moved after creation */
+    lthread_create(&napper, sleeper, NULL);
+    lthread_group_add(&single, napper);
+
+    lthread_group_get_stats(&crowd, &crowd_stats);
+    if (crowd_stats.threads != MANY_THREADS) {
+        LTHREAD_SAFE printf("Crowd has %zu threads\n", crowd_stats.threads);
+        return 1;
+    }
+    if (lthread_group_destroy(&crowd) == 0) {
+        LTHREAD_SAFE printf("Destroyed a group with threads in it\n");
+        return 1;
+    }
+
+    lthread_sleep(RUN_MS);
+    running = 0;
+
+    lthread_group_get_stats(&crowd, &crowd_stats);
+    lthread_group_get_stats(&single, &single_stats);
+    lthread_group_get_stats(&heavy, &heavy_stats);
+
+    for (size_t ii = 0; ii < MANY_THREADS; ii++) {
+        lthread_join(crowd_threads[ii], NULL);
+    }
+    lthread_join(single_thread, NULL);
+    lthread_join(heavy_threads[0], NULL);
+    lthread_join(heavy_threads[1], NULL);
+    lthread_join(napper, NULL);
+
+    crowd_time = seconds(&crowd_stats.run_time);
+    single_time = seconds(&single_stats.run_time);
+    heavy_time = seconds(&heavy_stats.run_time);
+    LTHREAD_SAFE printf("crowd %.3fs (%zu picks), single %.3fs (%zu picks), "
+            "heavy %.3fs (%zu picks), %zu naps\n",
+            crowd_time, crowd_stats.picks, single_time, single_stats.picks,
+            heavy_time, heavy_stats.picks, (size_t)sleeps);
+
+    /* 20 threads get no more than the 1, the double weight gets twice */
+    if (crowd_time > single_time * 1.4 || crowd_time < single_time * 0.7) {
+        LTHREAD_SAFE printf("Crowd and single group got unequal shares\n");
+        return 1;
+    }
+    if (heavy_time > single_time * 2.6 || heavy_time < single_time * 1.5) {
+        LTHREAD_SAFE printf("Heavy group didn't get double the share\n");
+        return 1;
+    }
+    if (sleeps < 10) {
+        LTHREAD_SAFE printf("Sleeper only woke %zu times\n", (size_t)sleeps);
+        return 1;
+    }
+
+    if (lthread_group_destroy(&crowd) || lthread_group_destroy(&single) ||
+            lthread_group_destroy(&heavy)) {
+        LTHREAD_SAFE printf("Failed to destroy finished groups\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "lthread.h"
+
+#define NUM_ITEMS (100000)
+
+volatile int running = 1;
+volatile size_t background_loops = 0;
+
+/* Yields 1 through NUM_ITEMS, then returns how many it yielded */
+void *
+count_up(void *data)
+{
+    (void)data;
+    uintptr_t ii;
+    for (ii = 1; ii <= NUM_ITEMS; ii++) {
+        lthread_yield_value((void *)ii);
+    }
+    return (void *)(ii - 1);
+}
+
+/* Pulls from the generator in 'data' and yields only the even values */
+void *
+evens(void *data)
+{
+    lthread source = *(lthread *)data;
+    void *value;
+    while (lthread_resume(source, &value) == 0) {
+        if ((uintptr_t)value % 2 == 0) {
+            lthread_yield_value(value);
+        }
+    }
+    lthread_join(source, &value);
+    return value;
+}
+
+/* Keeps the scheduler busy with another thread to preempt to */
+void *
+background(void *data)
+{
+    (void)data;
+    while (running) {
+        background_loops++;
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc, (void) argv;
+
+    lthread source, filter, other;
+    void *value;
+    uintptr_t expected = 2, total = 0;
+    int ret;
+
+    lthread_init();
+
+    lthread_create(&other, background, NULL);
+    lthread_create_ex(&source, count_up, NULL,
+            LTHREAD_GENERATOR | LTHREAD_INTEGER_ONLY);
+    lthread_create_ex(&filter, evens, &source, LTHREAD_GENERATOR);
+
+    /* Calling lthread_yield_value outside a generator is an error */
+    if (lthread_yield_value(NULL) == 0) {
+        LTHREAD_SAFE printf("Yielded a value without a resumer\n");
+        return 1;
+    }
+
+    while ((ret = lthread_resume(filter, &value)) == 0) {
+        if ((uintptr_t)value != expected) {
+            LTHREAD_SAFE printf("Got %zu, expected %zu\n",
+                    (size_t)(uintptr_t)value, (size_t)expected);
+            return 1;
+        }
+        expected += 2;
+        total++;
+    }
+
+    if (ret != 1 || total != NUM_ITEMS / 2) {
+        LTHREAD_SAFE printf("Generator stopped after %zu values\n", (size_t)total);
+        return 1;
+    }
+
+    /* Finished generators can't be resumed, only joined */
+    if (lthread_resume(filter, NULL) != -1) {
+        LTHREAD_SAFE printf("Resumed a finished generator\n");
+        return 1;
+    }
+    lthread_join(filter, &value);
+    if ((uintptr_t)value != NUM_ITEMS) {
+        LTHREAD_SAFE printf("Source yielded %zu values\n", (size_t)(uintptr_t)value);
+        return 1;
+    }
+
+    running = 0;
+    lthread_join(other, NULL);
+
+    LTHREAD_SAFE printf("%zu values through 2 generators, background loops %zu\n",
+            (size_t)total, (size_t)background_loops);
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "lthread.h"
+
+#define SLOW_HOLD_MS (3)
+#define SLOW_HOLDS (5)
+#define FAST_HOLDS (10000)
+#define SLEEPY_HOLD_MS (1) /* Shorter than SLOW_HOLD_MS */
+
+volatile int running = 1;
+volatile size_t counter = 0;
+volatile int never = 0;
+
+/* Not static, the report names call sites from the dynamic symbol table */
+void
+slow_section(void)
+{
+    struct timespec start, now;
+    LTHREAD_SAFE {
+        /* Starves everyone else for several ticks */
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+        } while ((now.tv_sec - start.tv_sec) * 1000 +
+                (now.tv_nsec - start.tv_nsec) / 1000000 < SLOW_HOLD_MS);
+    }
+}
+
+void
+fast_section(void)
+{
+    LTHREAD_SAFE counter++;
+}
+
+/* Parks while blocked, other threads hold and release in between */
+void
+sleepy_section(void)
+{
+    struct timespec timeout = { .tv_sec = 0, .tv_nsec = SLEEPY_HOLD_MS * 1000000 };
+    LTHREAD_SAFE lthread_wait_on(&never, 0, &timeout);
+}
+
+void *
+busy(void *data)
+{
+    (void)data;
+    while (running) {
+        fast_section();
+        lthread_yield();
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc, (void) argv;
+
+    lthread other;
+    char line[1024];
+    size_t deferred = 0, sleepy_count = 0;
+    double sleepy_max = 0;
+    FILE *out;
+    int first_site = 1, ok = 0;
+
+    lthread_init();
+    lthread_create(&other, busy, NULL);
+
+    for (size_t ii = 0; ii < FAST_HOLDS; ii++) {
+        fast_section();
+    }
+    for (size_t ii = 0; ii < SLOW_HOLDS; ii++) {
+        slow_section();
+        lthread_yield();
+    }
+    sleepy_section();
+
+    running = 0;
+    lthread_join(other, NULL);
+
+    LTHREAD_SAFE {
+        out = tmpfile();
+        if (out == NULL || lthread_hold_report(fileno(out))) {
+            printf("Failed to write hold report\n");
+            return 1;
+        }
+
+        /* The worst offender is listed first */
+        rewind(out);
+        while (fgets(line, sizeof(line), out) != NULL) {
+            fputs(line, stdout);
+            if (line[0] == ' ' || strncmp(line, "lthread_block", 13) == 0) {
+                continue;
+            }
+            if (strncmp(line, "sleepy_section+", 15) == 0) {
+                sscanf(line, "%*[^:]: %zu holds, max %lf us", &sleepy_count, &sleepy_max);
+            }
+            if (first_site) {
+                ok = strncmp(line, "slow_section+", 13) == 0 &&
+                    sscanf(line, "%*[^:]: %*u holds, max %*f us, mean %*f us, %zu ticks",
+                            &deferred) == 1;
+                first_site = 0;
+            }
+        }
+        fclose(out);
+    }
+
+    if (!ok) {
+        LTHREAD_SAFE printf("slow_section wasn't reported as the worst offender\n");
+        return 1;
+    }
+    /* The hold is the sleeper's own, not cut short by the busy thread's */
+    if (sleepy_count != 1 || sleepy_max < SLEEPY_HOLD_MS * 1000.0) {
+        LTHREAD_SAFE printf("sleepy_section held %zu times, at most %.1f us\n",
+                sleepy_count, sleepy_max);
+        return 1;
+    }
+    /* A tick every 500us, each slow hold must have held one back */
+    if (deferred < SLOW_HOLDS) {
+        LTHREAD_SAFE printf("Only %zu deferred ticks counted\n", deferred);
+        return 1;
+    }
+
+    return 0;
+}
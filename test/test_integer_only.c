@@ -0,0 +1,62 @@
+#include <stdio.h>
+
+#include "lthread.h"
+
+#define NUM_THREADS (8)
+#define ITERATIONS (20000000)
+
+/* Integer work, safe to run without saving the FP environment */
+void *
+add_ints(void *data)
+{
+    size_t increment = (size_t)data, sum = 0;
+    for (size_t ii = 0; ii < ITERATIONS; ii++) {
+        sum += increment;
+    }
+    return (void *)sum;
+}
+
+/* FP work interleaved with the integer threads must not be disturbed */
+void *
+add_doubles(void *data)
+{
+    volatile double sum = 0.0;
+    double increment = (double)(size_t)data;
+    for (size_t ii = 0; ii < ITERATIONS; ii++) {
+        sum += increment;
+    }
+    return (void *)(size_t)sum;
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc, (void) argv;
+
+    lthread threads[NUM_THREADS];
+    void *retvals[NUM_THREADS];
+
+    lthread_init();
+
+    for (size_t ii = 0; ii < NUM_THREADS; ii++) {
+        if (ii % 2) {
+            lthread_create_ex(threads + ii, add_ints, (void *)ii, LTHREAD_INTEGER_ONLY);
+        }
+        else {
+            lthread_create(threads + ii, add_doubles, (void *)ii);
+        }
+    }
+
+    lthread_join_all(threads, NUM_THREADS, retvals);
+
+    for (size_t ii = 0; ii < NUM_THREADS; ii++) {
+        LTHREAD_SAFE if ((size_t)retvals[ii] != ii * ITERATIONS) {
+            printf("[%zu] %zu != %zu\n", ii, (size_t)retvals[ii], ii * ITERATIONS);
+            return 1;
+        }
+        else {
+            printf("[%zu] = %zu\n", ii, (size_t)retvals[ii]);
+        }
+    }
+
+    return 0;
+}
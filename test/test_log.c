@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "lthread.h"
+
+#define NUM_THREADS (10)
+#define NUM_LINES (2000)
+#define FLOOD_LINES (5000) /* Several times what fits in a buffer */
+
+/* Messages each thread had dropped, the flooder's last */
+int dropped_by[NUM_THREADS + 1] = {0};
+
+void *
+log_lines(void *data)
+{
+    size_t id = (size_t)data;
+    for (int ii = 0; ii < NUM_LINES; ii++) {
+        /* Full buffers drop messages, wait for the flusher */
+        while (lthread_log("thread %02zu line %5d %s\n", id, ii, "ok")) {
+            dropped_by[id]++;
+            lthread_yield();
+        }
+    }
+    return NULL;
+}
+
+/* Logs faster than it can be written out, without retrying */
+void *
+flood(void *data)
+{
+    (void)data;
+    lthread_preempt_disable();
+    for (int ii = 0; ii < FLOOD_LINES; ii++) {
+        dropped_by[NUM_THREADS] += lthread_log("flood %d\n", ii) != 0;
+    }
+    lthread_preempt_enable();
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc, (void) argv;
+
+    lthread threads[NUM_THREADS], flooder;
+    char filename[] = "test_log.txt";
+    int next_line[NUM_THREADS] = {0};
+    char line[64];
+    size_t id, dropped = 0, expected = 0;
+    int number, flooded = 0;
+    FILE *file;
+    int fd;
+
+    lthread_init();
+
+    LTHREAD_SAFE fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LTHREAD_SAFE perror("Failed to open log file");
+        return 1;
+    }
+
+    lthread_log_init(fd);
+    for (size_t ii = 0; ii < NUM_THREADS; ii++) {
+        lthread_create(threads + ii, log_lines, (void *)ii);
+    }
+    lthread_join_all(threads, NUM_THREADS, NULL);
+    lthread_create(&flooder, flood, NULL);
+    lthread_join(flooder, NULL);
+    lthread_log_stop();
+    close(fd);
+
+    /* Each thread's lines should all be there, in order */
+    LTHREAD_SAFE {
+        file = fopen(filename, "r");
+        if (file == NULL) {
+            perror("Failed to open log file for reading");
+            return 1;
+        }
+
+        while (fgets(line, sizeof(line), file) != NULL) {
+            if (sscanf(line, "[dropped] %zu", &id) == 1) {
+                dropped += id;
+                continue;
+            }
+            if (sscanf(line, "flood %d", &number) == 1) {
+                flooded++;
+                continue;
+            }
+            if (sscanf(line, "thread %zu line %d ok", &id, &number) != 2 ||
+                    id >= NUM_THREADS || number != next_line[id]) {
+                printf("Unexpected line: %s", line);
+                return 1;
+            }
+            next_line[id]++;
+        }
+        fclose(file);
+
+        for (int ii = 0; ii < NUM_THREADS; ii++) {
+            if (next_line[ii] != NUM_LINES) {
+                printf("Thread %d logged %d lines, expected %d\n",
+                        ii, next_line[ii], NUM_LINES);
+                return 1;
+            }
+        }
+        /* Every message that didn't fit is accounted for */
+        for (int ii = 0; ii <= NUM_THREADS; ii++) {
+            expected += (size_t)dropped_by[ii];
+        }
+        if (dropped_by[NUM_THREADS] == 0 || dropped != expected ||
+                flooded + dropped_by[NUM_THREADS] != FLOOD_LINES) {
+            printf("%d flood lines logged, %zu dropped, %zu reported dropped\n",
+                    flooded, expected, dropped);
+            return 1;
+        }
+        printf("%d lines logged, %zu reported dropped\n", NUM_THREADS * NUM_LINES, dropped);
+
+        if (remove(filename)) {
+            perror("Failed to remove file");
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "lthread.h"
+
+#define NUM_THREADS (8)
+#define BLOCK_MS (100)
+
+volatile int done = 0;
+
+/* A blocking call that would stall every lthread if called directly */
+void *
+slow_call(void *data)
+{
+    struct timespec delay = {
+        .tv_sec = 0,
+        .tv_nsec = BLOCK_MS * 1000000,
+    };
+    nanosleep(&delay, NULL);
+    return (void *)((size_t)data * 2);
+}
+
+void *
+offloader(void *data)
+{
+    void *result;
+    if (lthread_offload(slow_call, data, &result)) {
+        return NULL;
+    }
+    return result;
+}
+
+/* Counts how often it gets to run while the calls are blocked */
+void *
+ticker(void *data)
+{
+    (void)data;
+    size_t ticks = 0;
+    while (!done) {
+        ticks++;
+        lthread_sleep(1);
+    }
+    return (void *)ticks;
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc, (void) argv;
+
+    lthread threads[NUM_THREADS];
+    void *retvals[NUM_THREADS];
+    lthread tick_thread;
+    void *ticks, *result;
+
+    lthread_init();
+
+    lthread_create(&tick_thread, ticker, NULL);
+    for (size_t ii = 0; ii < NUM_THREADS; ii++) {
+        lthread_create(threads + ii, offloader, (void *)(ii + 1));
+    }
+
+    /* The main thread offloads like any other */
+    if (lthread_offload(slow_call, (void *)21, &result) || (size_t)result != 42) {
+        LTHREAD_SAFE printf("Offload from the main thread failed\n");
+        return 1;
+    }
+
+    lthread_join_all(threads, NUM_THREADS, retvals);
+    done = 1;
+    lthread_join(tick_thread, &ticks);
+
+    for (size_t ii = 0; ii < NUM_THREADS; ii++) {
+        if ((size_t)retvals[ii] != (ii + 1) * 2) {
+            LTHREAD_SAFE printf("[%zu] %zu != %zu\n", ii, (size_t)retvals[ii], (ii + 1) * 2);
+            return 1;
+        }
+    }
+
+    /* The ticker should have kept running through the blocking calls */
+    LTHREAD_SAFE printf("ticker ran %zu times\n", (size_t)ticks);
+    if ((size_t)ticks < BLOCK_MS / 2) {
+        LTHREAD_SAFE printf("Offloaded calls blocked the scheduler\n");
+        return 1;
+    }
+
+    return 0;
+}
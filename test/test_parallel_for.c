@@ -0,0 +1,72 @@
+#include <stdio.h>
+
+#include "lthread.h"
+
+#define N (1000000)
+#define GRAIN (10000)
+
+size_t squares[N];
+
+void
+square_range(size_t begin, size_t end, void *ctx)
+{
+    (void)ctx;
+    for (size_t ii = begin; ii < end; ii++) {
+        squares[ii] = ii * ii;
+    }
+}
+
+void *
+sum_range(size_t begin, size_t end, void *ctx)
+{
+    (void)ctx;
+    size_t sum = 0;
+    for (size_t ii = begin; ii < end; ii++) {
+        sum += ii;
+    }
+    return (void *)sum;
+}
+
+void *
+add(void *a, void *b, void *ctx)
+{
+    (void)ctx;
+    return (void *)((size_t)a + (size_t)b);
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc, (void) argv;
+    void *sum;
+
+    lthread_init();
+
+    if (lthread_parallel_for(0, N, GRAIN, square_range, NULL)) {
+        LTHREAD_SAFE printf("lthread_parallel_for failed\n");
+        return 1;
+    }
+
+    for (size_t ii = 0; ii < N; ii++) {
+        if (squares[ii] != ii * ii) {
+            LTHREAD_SAFE printf("[%zu] %zu != %zu\n", ii, squares[ii], ii * ii);
+            return 1;
+        }
+    }
+
+    /* Uneven grain so the chunks don't divide the range exactly */
+    if (lthread_parallel_reduce(0, N, GRAIN - 1, sum_range, add, (void *)0, NULL, &sum)) {
+        LTHREAD_SAFE printf("lthread_parallel_reduce failed\n");
+        return 1;
+    }
+
+    LTHREAD_SAFE if ((size_t)sum != (size_t)N * (N - 1) / 2) {
+        printf("Sum %zu doesn't match expected %zu\n",
+                (size_t)sum, (size_t)N * (N - 1) / 2);
+        return 1;
+    }
+    else {
+        printf("Sum = %zu\n", (size_t)sum);
+    }
+
+    return 0;
+}
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "lthread.h"
+
+#define PERIOD_NS (2000000) /* 2ms */
+#define ACTIVATIONS (50)
+#define NUM_SLEEPERS (8)
+#define SLACK_NS (1000000) /* 1ms */
+
+static int64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(lthread_clock(), &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct timespec
+to_timespec(int64_t ns)
+{
+    return (struct timespec) {
+        .tv_sec = (time_t)(ns / 1000000000),
+        .tv_nsec = (long)(ns % 1000000000),
+    };
+}
+
+int64_t deadlines[NUM_SLEEPERS];
+int64_t woke[NUM_SLEEPERS];
+
+void *
+sleeper(void *data)
+{
+    size_t ii = (size_t)data;
+    struct timespec deadline = to_timespec(deadlines[ii]);
+    lthread_sleep_until(&deadline);
+    woke[ii] = now_ns();
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc, (void) argv;
+
+    struct lthread_periodic p;
+    struct timespec period = to_timespec(PERIOD_NS), slack = to_timespec(SLACK_NS);
+    struct timespec deadline;
+    lthread threads[NUM_SLEEPERS];
+    int64_t start, end, first_release;
+    int missed;
+
+    lthread_init();
+
+    /* Sub-millisecond absolute sleep */
+    start = now_ns();
+    deadline = to_timespec(start + 300000);
+    lthread_sleep_until(&deadline);
+    end = now_ns();
+    if (end < start + 300000) {
+        LTHREAD_SAFE printf("Woke %lld ns early\n", (long long)(start + 300000 - end));
+        return 1;
+    }
+
+    /* Periodic releases don't drift with the work done in between */
+    lthread_periodic_init(&p, &period);
+    start = now_ns();
+    first_release = (int64_t)p.next.tv_sec * 1000000000 + p.next.tv_nsec;
+    for (size_t ii = 0; ii < ACTIVATIONS; ii++) {
+        /* Some work, well under a period */
+        for (volatile size_t jj = 0; jj < 10000; jj++) ;
+        lthread_periodic_wait(&p);
+    }
+    end = now_ns();
+    if (end < first_release + (ACTIVATIONS - 1) * (int64_t)PERIOD_NS) {
+        LTHREAD_SAFE printf("Periodic loop finished early\n");
+        return 1;
+    }
+    LTHREAD_SAFE printf("%d activations took %.3f ms, %zu overruns\n",
+            ACTIVATIONS, (double)(end - start) / 1e6, p.overruns);
+
+    /* Running past several releases reports them and stays on the grid */
+    while (now_ns() < end + 5 * (int64_t)PERIOD_NS) ;
+    missed = lthread_periodic_wait(&p);
+    if (missed < 4) {
+        LTHREAD_SAFE printf("Only %d overruns reported\n", missed);
+        return 1;
+    }
+    if (((int64_t)p.next.tv_sec * 1000000000 + p.next.tv_nsec - first_release) %
+            PERIOD_NS != 0) {
+        LTHREAD_SAFE printf("Releases moved off the original schedule\n");
+        return 1;
+    }
+    LTHREAD_SAFE printf("%d releases overrun\n", missed);
+
+    /* Nearby deadlines are rounded up to the slack, never woken early */
+    lthread_set_timer_slack(&slack);
+    start = now_ns();
+    for (size_t ii = 0; ii < NUM_SLEEPERS; ii++) {
+        deadlines[ii] = start + 2 * SLACK_NS + (int64_t)ii * 50000;
+        lthread_create(threads + ii, sleeper, (void *)ii);
+    }
+    lthread_join_all(threads, NUM_SLEEPERS, NULL);
+    for (size_t ii = 0; ii < NUM_SLEEPERS; ii++) {
+        int64_t rounded = (deadlines[ii] + SLACK_NS - 1) / SLACK_NS * SLACK_NS;
+        if (woke[ii] < rounded) {
+            LTHREAD_SAFE printf("Sleeper %zu woke before its rounded deadline\n", ii);
+            return 1;
+        }
+    }
+
+    return 0;
+}
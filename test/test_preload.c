@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <dlfcn.h>
+
+#include "lthread.h"
+
+/* Runs itself again under the interposition library, then calls into
+ * the C library from many lthreads with no LTHREAD_SAFE at all. Built
+ * fortified, so most of those calls are to the __*_chk versions
+ */
+
+#if !defined(__OPTIMIZE__) || _FORTIFY_SOURCE < 2
+#error "Build with -O2 -D_FORTIFY_SOURCE=2"
+#endif
+
+#define PRELOAD "./liblthread_preload.so"
+#define NUM_THREADS (16)
+#define ITERATIONS (100000)
+
+volatile int running = 1;
+volatile size_t spins = 0;
+
+static int64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+busy_wait(int64_t ns)
+{
+    int64_t end = now_ns() + ns;
+    while (now_ns() < end) {
+    }
+}
+
+void *
+spinner(void *data)
+{
+    (void)data;
+    while (running) {
+        spins++;
+    }
+    return NULL;
+}
+
+/* Stream taking a while for each read and write, to see whether
+ * another lthread runs during the wrapped stdio call using it
+ */
+struct slow_stream {
+    int preempted;
+    const char *input;
+};
+
+static void
+slow_check(struct slow_stream *stream)
+{
+    size_t before = spins;
+    busy_wait(5000000);
+    if (spins != before) {
+        stream->preempted = 1;
+    }
+}
+
+static ssize_t
+slow_read(void *cookie, char *buf, size_t size)
+{
+    struct slow_stream *stream = cookie;
+    size_t len = strlen(stream->input);
+
+    slow_check(stream);
+    len = len < size ? len : size;
+    memcpy(buf, stream->input, len);
+    stream->input += len;
+    return (ssize_t)len;
+}
+
+static ssize_t
+slow_write(void *cookie, const char *buf, size_t size)
+{
+    (void)buf;
+    slow_check(cookie);
+    return (ssize_t)size;
+}
+
+/* What the calls in this file compile to, all should be wrapped */
+static const char *interposed[] = {
+    "malloc",
+
+};
+
+/* Allocates, formats and writes as fast as it can */
+void *
+worker(void *data)
+{
+    size_t id = (size_t)data, size;
+    char expected[64], *buf;
+    FILE *out = fopen("/dev/null", "w");
+
+    if (out == NULL) {
+        return (void *)1;
+    }
+    for (size_t ii = 0; ii < ITERATIONS; ii++) {
+        size = sizeof(expected) + (ii * 7 + id) % 1024;
+        buf = malloc(size);
+        snprintf(buf, size, "thread %zu item %zu", id, ii);
+        sprintf(expected, "thread %zu item %zu", id, ii);
+        if (strcmp(buf, expected) != 0) {
+            return (void *)1;
+        }
+        fprintf(out, "%s\n", buf);
+        buf = realloc(buf, size * 2);
+        free(buf);
+    }
+    fclose(out);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc;
+
+    lthread threads[NUM_THREADS], spin;
+    cookie_io_functions_t io = { .read = slow_read, .write = slow_write };
+    struct slow_stream stream = { 0, "42\n" };
+    FILE *slow;
+    int value = 0;
+    const char *preload = getenv("LD_PRELOAD");
+    size_t before;
+    void *ret;
+    Dl_info info;
+
+    if (preload == NULL || strstr(preload, "lthread_preload") == NULL) {
+        setenv("LD_PRELOAD", PRELOAD, 1);
+        execv("/proc/self/exe", argv);
+        perror("Failed to run under " PRELOAD);
+        return 1;
+    }
+
+    for (size_t ii = 0; ii < sizeof(interposed) / sizeof(interposed[0]); ii++) {
+        if (dladdr(dlsym(RTLD_DEFAULT, interposed[ii]), &info) == 0 ||
+                strstr(info.dli_fname, "lthread_preload") == NULL) {
+            printf("%s is not interposed\n", interposed[ii]);
+            return 1;
+        }
+    }
+
+    lthread_init();
+    lthread_create(&spin, spinner, NULL);
+    lthread_yield();
+
+    /* Ticks are held back while preemption is disabled ... */
+    lthread_preempt_disable();
+    lthread_preempt_disable();
+    before = spins;
+    busy_wait(5000000);
+    lthread_preempt_enable();
+    busy_wait(5000000);
+    if (spins != before) {
+        lthread_preempt_enable();
+        printf("Preempted while preemption was disabled\n");
+        return 1;
+    }
+    /* ... and handled once it is enabled again */
+    lthread_preempt_enable();
+    busy_wait(5000000);
+    if (spins == before) {
+        printf("No switch after enabling preemption\n");
+        return 1;
+    }
+
+    /* lthread_init registered the hooks, the program exports nothing */
+    slow = fopencookie(&stream, "r", io);
+    setvbuf(slow, NULL, _IONBF, 0);
+    if (fscanf(slow, "%d", &value) != 1 || value != 42) {
+        printf("fscanf read %d\n", value);
+        return 1;
+    }
+    fclose(slow);
+    slow = fopencookie(&stream, "w", io);
+    setvbuf(slow, NULL, _IONBF, 0);
+    fprintf(slow, "%d\n", value);
+    fclose(slow);
+    if (stream.preempted) {
+        printf("Preempted inside fscanf or fprintf\n");
+        return 1;
+    }
+
+    for (size_t ii = 0; ii < NUM_THREADS; ii++) {
+        lthread_create(&threads[ii], worker, (void *)ii);
+    }
+    for (size_t ii = 0; ii < NUM_THREADS; ii++) {
+        lthread_join(threads[ii], &ret);
+        if (ret != NULL) {
+            printf("Worker %zu got a corrupted string\n", ii);
+            return 1;
+        }
+    }
+
+    running = 0;
+    lthread_join(spin, NULL);
+
+    printf("%d threads made %d allocations each without LTHREAD_SAFE\n",
+            NUM_THREADS, 2 * ITERATIONS);
+
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "lthread.h"
+
+#define SPIN_MS (300)
+#define MAX_SAMPLES (100000)
+
+/* Not static, the profiler names frames from the dynamic symbol table */
+void
+profile_spin_inner(volatile size_t *counter)
+{
+    for (size_t ii = 0; ii < 1000; ii++) {
+        (*counter)++;
+    }
+}
+
+void *
+profile_spin(void *data)
+{
+    volatile size_t counter = 0;
+    struct timespec start, now;
+    (void)data;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        profile_spin_inner(&counter);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000 +
+            (now.tv_nsec - start.tv_nsec) / 1000000 < SPIN_MS);
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc, (void) argv;
+
+    lthread threads[2];
+    char line[4096];
+    size_t lines = 0, spin_samples = 0, count;
+    FILE *out;
+
+    lthread_init();
+
+    if (lthread_profile_start(MAX_SAMPLES)) {
+        printf("Failed to start profiler\n");
+        return 1;
+    }
+
+    lthread_create(threads + 0, profile_spin, NULL);
+    lthread_create(threads + 1, profile_spin, NULL);
+    lthread_join_all(threads, 2, NULL);
+
+    if (lthread_profile_stop()) {
+        printf("Profiler wasn't running\n");
+        return 1;
+    }
+
+    LTHREAD_SAFE {
+        out = tmpfile();
+        if (out == NULL || lthread_profile_dump(fileno(out))) {
+            printf("Failed to dump profile\n");
+            return 1;
+        }
+
+        /* Every line is "thread;frame;...;frame count" */
+        rewind(out);
+        while (fgets(line, sizeof(line), out) != NULL) {
+            lines++;
+            if (strncmp(line, "lthread ", 8) == 0 &&
+                    strstr(line, ";profile_spin;profile_spin_inner") != NULL &&
+                    sscanf(strrchr(line, ' '), "%zu", &count) == 1) {
+                spin_samples += count;
+            }
+        }
+        fclose(out);
+
+        printf("%zu distinct stacks, %zu samples in profile_spin_inner\n",
+                lines, spin_samples);
+    }
+
+    /* Two threads spinning for SPIN_MS with a 500us tick */
+    if (spin_samples < SPIN_MS) {
+        LTHREAD_SAFE printf("Too few samples of the spinning threads\n");
+        return 1;
+    }
+
+    return 0;
+}
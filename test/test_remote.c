@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "lthread.h"
+
+#define NUM_PTHREADS (4)
+#define LTHREADS_PER_PTHREAD (100)
+
+size_t count = 0;
+volatile int pthreads_done = 0;
+
+/* Set by a pthread before it wakes the parked lthread */
+volatile int flag = 0;
+
+void *
+increment(void *data)
+{
+    (void)data;
+    LTHREAD_SAFE count++;
+    return NULL;
+}
+
+void *
+wait_for_flag(void *data)
+{
+    (void)data;
+    while (!flag) {
+        lthread_park();
+    }
+    return (void *)1;
+}
+
+/* Runs outside the scheduler, so it only uses the _remote functions */
+void *
+submitter(void *data)
+{
+    lthread *handles = data;
+    sigset_t mask;
+
+    /* Keep scheduling signals away from this OS thread */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    for (size_t ii = 0; ii < LTHREADS_PER_PTHREAD; ii++) {
+        if (ii % 2) {
+            lthread_create_remote(handles + ii, increment, NULL);
+        }
+        else {
+            /* Detached, nothing to join */
+            handles[ii] = (lthread)-1;
+            lthread_create_remote(NULL, increment, NULL);
+        }
+    }
+
+    __atomic_fetch_add(&pthreads_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+void *
+waker(void *data)
+{
+    lthread target = *(lthread *)data;
+    sigset_t mask;
+
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    flag = 1;
+    lthread_unpark_remote(target);
+
+    __atomic_fetch_add(&pthreads_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc, (void) argv;
+
+    pthread_t pthreads[NUM_PTHREADS + 1];
+    lthread handles[NUM_PTHREADS][LTHREADS_PER_PTHREAD];
+    lthread parked;
+    void *retval;
+
+    lthread_init();
+
+    lthread_create(&parked, wait_for_flag, NULL);
+
+    LTHREAD_SAFE {
+        for (int ii = 0; ii < NUM_PTHREADS; ii++) {
+            pthread_create(pthreads + ii, NULL, submitter, handles[ii]);
+        }
+        pthread_create(pthreads + NUM_PTHREADS, NULL, waker, &parked);
+    }
+
+    /* pthread_join would stall the scheduler the pthreads rely on */
+    while (__atomic_load_n(&pthreads_done, __ATOMIC_ACQUIRE) != NUM_PTHREADS + 1) {
+        lthread_sleep(1);
+    }
+
+    LTHREAD_SAFE for (int ii = 0; ii < NUM_PTHREADS + 1; ii++) {
+        pthread_join(pthreads[ii], NULL);
+    }
+
+    for (int ii = 0; ii < NUM_PTHREADS; ii++) {
+        for (int jj = 1; jj < LTHREADS_PER_PTHREAD; jj += 2) {
+            lthread_join(handles[ii][jj], NULL);
+        }
+    }
+
+    lthread_join(parked, &retval);
+    if (retval != (void *)1) {
+        LTHREAD_SAFE printf("Parked thread didn't see the flag\n");
+        return 1;
+    }
+
+    /* Detached threads may still be finishing up */
+    while (__atomic_load_n(&count, __ATOMIC_RELAXED) != NUM_PTHREADS * LTHREADS_PER_PTHREAD) {
+        lthread_sleep(1);
+    }
+
+    LTHREAD_SAFE printf("count = %zu\n", count);
+
+    return 0;
+}
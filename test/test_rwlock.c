@@ -0,0 +1,95 @@
+#include <stdio.h>
+
+#include "lthread.h"
+
+#define NUM_READERS (8)
+#define NUM_WRITERS (2)
+#define TABLE_SIZE (64)
+#define ROUNDS (200)
+
+struct lthread_rwlock lock = LTHREAD_RWLOCK_INITIALIZER;
+size_t table[TABLE_SIZE];
+
+volatile size_t readers_inside = 0;
+volatile size_t most_readers_inside = 0;
+volatile int torn = 0;
+
+void *
+reader(void *data)
+{
+    (void)data;
+    for (size_t round = 0; round < ROUNDS; round++) {
+        lthread_rwlock_rdlock(&lock);
+        LTHREAD_SAFE {
+            if (++readers_inside > most_readers_inside) {
+                most_readers_inside = readers_inside;
+            }
+        }
+
+        /* Yield halfway so other readers and waiting writers overlap */
+        for (size_t ii = 0; ii < TABLE_SIZE; ii++) {
+            if (table[ii] != table[0]) torn = 1;
+            if (ii == TABLE_SIZE / 2) lthread_yield();
+        }
+
+        LTHREAD_SAFE readers_inside--;
+        lthread_rwlock_unlock(&lock);
+    }
+    return NULL;
+}
+
+void *
+writer(void *data)
+{
+    (void)data;
+    for (size_t round = 0; round < ROUNDS; round++) {
+        lthread_rwlock_wrlock(&lock);
+        if (readers_inside != 0) torn = 1;
+        for (size_t ii = 0; ii < TABLE_SIZE; ii++) {
+            table[ii]++;
+            if (ii == TABLE_SIZE / 2) lthread_yield();
+        }
+        lthread_rwlock_unlock(&lock);
+        lthread_yield();
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc, (void) argv;
+
+    lthread threads[NUM_READERS + NUM_WRITERS];
+
+    lthread_init();
+
+    for (size_t ii = 0; ii < NUM_READERS; ii++) {
+        lthread_create(threads + ii, reader, NULL);
+    }
+    for (size_t ii = NUM_READERS; ii < NUM_READERS + NUM_WRITERS; ii++) {
+        lthread_create(threads + ii, writer, NULL);
+    }
+    lthread_join_all(threads, NUM_READERS + NUM_WRITERS, NULL);
+
+    LTHREAD_SAFE printf("table at %zu, at most %zu readers at once\n",
+            table[0], (size_t)most_readers_inside);
+
+    if (torn) {
+        LTHREAD_SAFE printf("Readers and writers overlapped\n");
+        return 1;
+    }
+    if (table[0] != NUM_WRITERS * ROUNDS) {
+        LTHREAD_SAFE printf("Lost writes\n");
+        return 1;
+    }
+    if (most_readers_inside < 2) {
+        LTHREAD_SAFE printf("Readers never shared the lock\n");
+        return 1;
+    }
+    if (lthread_rwlock_unlock(&lock) == 0) {
+        LTHREAD_SAFE printf("Unlocked a free lock\n");
+        return 1;
+    }
+
+    return 0;
+}
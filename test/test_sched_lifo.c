@@ -0,0 +1,55 @@
+#include <stdio.h>
+
+#include "lthread.h"
+
+#define NUM_THREADS (5)
+
+volatile size_t parked = 0;
+size_t order[NUM_THREADS];
+size_t ran = 0;
+
+void *
+wait_then_record(void *data)
+{
+    LTHREAD_SAFE parked++;
+    lthread_park();
+    LTHREAD_SAFE order[ran++] = (size_t)data;
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc, (void) argv;
+
+    lthread threads[NUM_THREADS];
+
+    if (lthread_init_sched(&lthread_sched_lifo)) {
+        printf("Failed to start with %s policy\n", lthread_sched_lifo.name);
+        return 1;
+    }
+
+    for (size_t ii = 0; ii < NUM_THREADS; ii++) {
+        lthread_create(threads + ii, wait_then_record, (void *)ii);
+    }
+
+    while (parked != NUM_THREADS) {
+        lthread_yield();
+    }
+
+    /* Wake everyone at once, the last one woken should run first */
+    LTHREAD_SAFE for (size_t ii = 0; ii < NUM_THREADS; ii++) {
+        lthread_unpark(threads[ii]);
+    }
+
+    lthread_join_all(threads, NUM_THREADS, NULL);
+
+    for (size_t ii = 0; ii < NUM_THREADS; ii++) {
+        LTHREAD_SAFE printf("%zu ran %zu\n", order[ii], ii);
+        if (order[ii] != NUM_THREADS - 1 - ii) {
+            LTHREAD_SAFE printf("Threads didn't run most recently woken first\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "lthread.h"
+
+#define NUM_THREADS (8)
+#define INCREMENTS (2000)
+
+/* A mutex built on lthread_wait_on, 0 unlocked, 1 locked and 2 locked
+ * with threads possibly waiting
+ */
+volatile int mutex = 0;
+size_t counter = 0;
+volatile size_t contended = 0;
+
+static void
+mutex_lock(void)
+{
+    int c = __sync_val_compare_and_swap(&mutex, 0, 1);
+    if (c == 0) {
+        return;
+    }
+    if (c != 2) {
+        c = __atomic_exchange_n(&mutex, 2, __ATOMIC_ACQUIRE);
+    }
+    while (c != 0) {
+        contended++;
+        lthread_wait_on(&mutex, 2, NULL);
+        c = __atomic_exchange_n(&mutex, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+static void
+mutex_unlock(void)
+{
+    if (__atomic_exchange_n(&mutex, 0, __ATOMIC_RELEASE) == 2) {
+        lthread_wake(&mutex, 1);
+    }
+}
+
+void *
+increment(void *data)
+{
+    size_t tmp;
+    (void)data;
+    for (size_t ii = 0; ii < INCREMENTS; ii++) {
+        mutex_lock();
+        tmp = counter;
+        /* Give others a chance to find the mutex taken */
+        if (ii % 16 == 0) lthread_yield();
+        counter = tmp + 1;
+        mutex_unlock();
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc, (void) argv;
+
+    lthread threads[NUM_THREADS];
+    volatile int flag = 0;
+    struct timespec timeout = { .tv_sec = 0, .tv_nsec = 2000000 }, start, end;
+    long waited_ns;
+
+    lthread_init();
+
+    /* Value already changed, nothing to wait for */
+    if (lthread_wait_on(&flag, 1, NULL) != 1) {
+        printf("Waited even though the value didn't match\n");
+        return 1;
+    }
+
+    /* Nobody wakes us, the timeout does */
+    LTHREAD_SAFE clock_gettime(CLOCK_MONOTONIC, &start);
+    if (lthread_wait_on(&flag, 0, &timeout) != -1) {
+        LTHREAD_SAFE printf("Wait without a waker didn't time out\n");
+        return 1;
+    }
+    LTHREAD_SAFE clock_gettime(CLOCK_MONOTONIC, &end);
+    waited_ns = (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+    if (waited_ns < timeout.tv_nsec) {
+        LTHREAD_SAFE printf("Timed out after only %ld ns\n", waited_ns);
+        return 1;
+    }
+    if (lthread_wake(&flag, 1) != 0) {
+        LTHREAD_SAFE printf("Timed out waiter was still queued\n");
+        return 1;
+    }
+
+    for (size_t ii = 0; ii < NUM_THREADS; ii++) {
+        lthread_create(threads + ii, increment, NULL);
+    }
+    lthread_join_all(threads, NUM_THREADS, NULL);
+
+    LTHREAD_SAFE printf("counter %zu, waited on the mutex %zu times\n",
+            counter, (size_t)contended);
+
+    if (counter != NUM_THREADS * INCREMENTS) {
+        LTHREAD_SAFE printf("Lost increments\n");
+        return 1;
+    }
+    if (contended == 0) {
+        LTHREAD_SAFE printf("Mutex was never contended\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include <stdio.h>
+
+#include "lthread.h"
+
+#define NUM_THREADS (8)
+#define SLEEP_STEP_MS (20)
+
+/* Threads created later sleep for less time, so they finish first */
+void *
+sleep_then_return(void *data)
+{
+    size_t index = (size_t)data;
+    lthread_sleep((NUM_THREADS - index) * SLEEP_STEP_MS);
+    return data;
+}
+
+void *
+return_square(void *data)
+{
+    size_t value = (size_t)data;
+    return (void *)(value * value);
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc, (void) argv;
+
+    lthread threads[NUM_THREADS];
+    void *retvals[NUM_THREADS];
+    struct lthread_waitset ws;
+    lthread t;
+    void *retval;
+    size_t expected = NUM_THREADS;
+
+    lthread_init();
+
+    /* Results should arrive in completion order, not creation order */
+    lthread_waitset_init(&ws);
+    for (size_t ii = 0; ii < NUM_THREADS; ii++) {
+        lthread_create(threads + ii, sleep_then_return, (void *)ii);
+        lthread_waitset_add(&ws, threads[ii]);
+    }
+
+    while (lthread_waitset_next(&ws, &t, &retval) == 0) {
+        expected--;
+        LTHREAD_SAFE printf("thread %zu finished\n", (size_t)retval);
+        if ((size_t)retval != expected) {
+            LTHREAD_SAFE printf("Expected thread %zu to finish next\n", expected);
+            return 1;
+        }
+    }
+
+    if (expected != 0) {
+        LTHREAD_SAFE printf("%zu threads were never collected\n", expected);
+        return 1;
+    }
+
+    /* Bulk join keeps return values in handle order */
+    for (size_t ii = 0; ii < NUM_THREADS; ii++) {
+        lthread_create(threads + ii, return_square, (void *)ii);
+    }
+
+    if (lthread_join_all(threads, NUM_THREADS, retvals)) {
+        LTHREAD_SAFE printf("lthread_join_all failed\n");
+        return 1;
+    }
+
+    for (size_t ii = 0; ii < NUM_THREADS; ii++) {
+        if ((size_t)retvals[ii] != ii * ii) {
+            LTHREAD_SAFE printf("[%zu] %zu != %zu\n", ii, (size_t)retvals[ii], ii * ii);
+            return 1;
+        }
+    }
+
+    return 0;
+}
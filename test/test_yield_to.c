@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "lthread.h"
+
+#define NUM_SPINNERS (8)
+#define ROUNDS (2000)
+#define PLAIN_ROUNDS (100) /* Each turn waits for every spinner */
+#define RT_PERIOD_NS (2000000) /* 2ms */
+
+volatile int running = 1;
+volatile size_t spins = 0;
+
+/* Ping-pong between two threads, each handing the turn to the other */
+volatile int turn = 0;
+volatile size_t mark = 0;
+volatile size_t direct = 0;
+int rounds = 0;
+
+void *
+spinner(void *data)
+{
+    (void)data;
+    while (running) {
+        spins++;
+    }
+    return NULL;
+}
+
+/* Takes odd turns, 'data' non-zero to hand back with lthread_wake_handoff */
+void *
+pong(void *data)
+{
+    int handoff = data != NULL;
+    for (int ii = 0; ii < rounds; ii++) {
+        while (turn % 2 == 0) {
+            lthread_wait_on(&turn, turn, NULL);
+        }
+        /* No spinner ran since ping handed over */
+        direct += spins == mark;
+        mark = spins;
+        turn++;
+        if (handoff) {
+            lthread_wake_handoff(&turn);
+        }
+        else {
+            lthread_wake(&turn, 1);
+        }
+    }
+    return NULL;
+}
+
+/* Takes even turns, returns how many came straight from pong */
+static size_t
+ping(int n, int handoff)
+{
+    lthread t;
+
+    rounds = n;
+    turn = 0;
+    direct = 0;
+    lthread_create(&t, pong, handoff ? (void *)1 : NULL);
+    for (int ii = 0; ii < rounds; ii++) {
+        while (turn % 2 == 1) {
+            lthread_wait_on(&turn, turn, NULL);
+        }
+        direct += ii > 0 && spins == mark;
+        mark = spins;
+        turn++;
+        if (handoff) {
+            lthread_wake_handoff(&turn);
+        }
+        else {
+            lthread_wake(&turn, 1);
+        }
+    }
+    lthread_join(t, NULL);
+    return direct;
+}
+
+void *
+target(void *data)
+{
+    *(volatile size_t *)data = spins;
+    return NULL;
+}
+
+/* Sleeps until its second period, then notes that it ran */
+void *
+rt_job(void *data)
+{
+    struct lthread_rt_params params = {
+        .period = { .tv_sec = 0, .tv_nsec = RT_PERIOD_NS },
+    };
+
+    lthread_set_rt(&params);
+    lthread_rt_wait_period();
+    *(volatile int *)data = 1;
+    return NULL;
+}
+
+static void
+busy_wait_ns(long ns)
+{
+    struct timespec now, end;
+
+    clock_gettime(lthread_clock(), &end);
+    end.tv_nsec += ns;
+    end.tv_sec += end.tv_nsec / 1000000000;
+    end.tv_nsec %= 1000000000;
+    do {
+        clock_gettime(lthread_clock(), &now);
+    } while (now.tv_sec < end.tv_sec ||
+            (now.tv_sec == end.tv_sec && now.tv_nsec < end.tv_nsec));
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc, (void) argv;
+
+    lthread spinners[NUM_SPINNERS], t, rt;
+    volatile size_t seen = 0;
+    volatile int rt_ran = 0;
+    struct timespec start, end, quantum;
+    size_t plain, handed;
+    long ms;
+
+    lthread_init();
+
+    for (size_t ii = 0; ii < NUM_SPINNERS; ii++) {
+        lthread_create(&spinners[ii], spinner, NULL);
+    }
+    lthread_yield();
+
+    /* The target runs next, ahead of every spinner */
+    lthread_create(&t, target, (void *)&seen);
+    mark = spins;
+    if (lthread_yield_to(t) != 0) {
+        LTHREAD_SAFE printf("Failed to yield to a new thread\n");
+        return 1;
+    }
+    if (lthread_join(t, NULL) != 0 || seen != mark) {
+        LTHREAD_SAFE printf("Spinners ran before the target\n");
+        return 1;
+    }
+
+    if (lthread_yield_to(lthread_self()) == 0) {
+        LTHREAD_SAFE printf("Yielded to self\n");
+        return 1;
+    }
+    if (lthread_yield_to(t) == 0) {
+        LTHREAD_SAFE printf("Yielded to a finished thread\n");
+        return 1;
+    }
+
+    /* Every turn waits behind the spinners without a handoff ... */
+    plain = ping(PLAIN_ROUNDS, 0);
+
+    /* ... and almost none does with one, ticks can still land between */
+    LTHREAD_SAFE clock_gettime(CLOCK_MONOTONIC, &start);
+    handed = ping(ROUNDS, 1);
+    LTHREAD_SAFE clock_gettime(CLOCK_MONOTONIC, &end);
+    ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+
+    running = 0;
+    lthread_join_all(spinners, NUM_SPINNERS, NULL);
+
+    /* No ticks, the real-time thread only comes due when checked for */
+    quantum = (struct timespec) { .tv_sec = 10, .tv_nsec = 0 };
+    lthread_set_quantum(&quantum);
+    lthread_create(&rt, rt_job, (void *)&rt_ran);
+    lthread_yield_to(rt);
+    lthread_create(&t, target, (void *)&seen);
+    busy_wait_ns(2 * RT_PERIOD_NS);
+    if (lthread_yield_to(t) == 0) {
+        LTHREAD_SAFE printf("Yielded past a real-time thread that was due\n");
+        return 1;
+    }
+    if (lthread_yield_to(rt) != 0 || !rt_ran) {
+        LTHREAD_SAFE printf("Failed to yield to the real-time thread\n");
+        return 1;
+    }
+    lthread_join(rt, NULL);
+    lthread_join(t, NULL);
+
+    printf("Behind %d spinners: %zu of %d turns direct with lthread_wake, "
+            "%zu of %d with lthread_wake_handoff (%ld ms)\n", NUM_SPINNERS,
+            plain, 2 * PLAIN_ROUNDS - 1, handed, 2 * ROUNDS - 1, ms);
+
+    if (handed < (2 * ROUNDS - 1) * 9 / 10) {
+        printf("Too few direct handoffs\n");
+        return 1;
+    }
+
+    return 0;
+}